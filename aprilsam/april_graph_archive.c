@@ -0,0 +1,807 @@
+/* Copyright (C) 2013-2019, The Regents of The University of Michigan.
+All rights reserved.
+
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*$LICENSE*/
+
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "aprilsam.h"
+#include "./common/io_util.h"
+
+/** Compact graph archive, version 1.
+
+    u32 magic, u8 version
+    attribute value names
+    infos:   varint n, n x (varint dim, u8 symmetric, dim*(dim+1)/2
+             doubles of the upper triangle, or dim*dim doubles if W
+             isn't exactly symmetric)
+    nodes:   node names, varint n, n x (varint name, node)
+    factors: factor names, varint n, n x (varint name, factor)
+    u8 has attributes, [attributes of the graph]
+
+    The stype names of each section are stored once, in a table
+    (varint n, n x (varint length, bytes)), and referred to by index.
+    Separate tables keep a corrupt index from turning a node into a
+    factor.
+
+    XYT nodes are u8 flags (NODE_HAS_*), then the state, init and
+    truth. XYT and XYTPOS factors are u8 flags (FACTOR_HAS_*), the
+    endpoints, z, ztruth and a varint index into the info table.
+    Objects of other types are stored as varint length and the
+    payload of their stype encoding.
+
+    Integers are varints (7 bits per byte, low bits first); signed
+    ones are zigzag coded first. Node indices are delta coded: the
+    first endpoint of a factor against the first endpoint of the
+    previous factor, the second against the first.
+
+    Doubles are XORed with a prediction: a node's state with the
+    previous node's state, its init and truth with its own state, and
+    a factor's z with the previous z of the same factor type, ztruth
+    with z. Nearby values share sign, exponent and leading mantissa
+    bits, so the XOR has leading (and often trailing) zero bytes.
+    Each double is written as one byte holding the number of
+    remaining bytes (high nibble) and of trailing zero bytes (low
+    nibble), then the remaining bytes, most significant first.
+    Decoding reverses every step bit for bit.
+
+    attributes: varint n, n x (varint key length, key, varint name,
+    varint length, payload of the value's stype encoding). Values of
+    types that aren't registered when decoding are dropped.
+**/
+
+#define ARCHIVE_MAGIC 0x4150475a  // "APGZ"
+#define ARCHIVE_VERSION 1
+
+#define NODE_HAS_INIT   1
+#define NODE_HAS_TRUTH  2
+#define NODE_HAS_ATTR   4
+
+#define FACTOR_HAS_ZTRUTH 1
+#define FACTOR_HAS_ATTR   2
+
+struct names
+{
+    zarray_t *names;     // const char*, table order
+    zhash_t *idxs;       // const char* => int
+};
+
+struct archive
+{
+    struct names node_names, factor_names, attr_names;
+    zarray_t *infos;     // int: interned info indices, table order
+    zhash_t *info_idxs;  // int => int
+
+    // predictions for the next state and z.
+    double state[3];
+    double z_xyt[3];
+    double z_xytpos[3];
+    int prev_a;
+};
+
+static void encode_varint(uint8_t *data, uint64_t *datapos, uint64_t v)
+{
+    while (v >= 0x80) {
+        encode_u8(data, datapos, (v & 0x7f) | 0x80);
+        v >>= 7;
+    }
+    encode_u8(data, datapos, v);
+}
+
+// Returns -1 if the varint is truncated or longer than 64 bits.
+static int decode_varint(const uint8_t *data, uint64_t *datapos, uint64_t datalen, uint64_t *v)
+{
+    *v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (*datapos >= datalen)
+            return -1;
+        uint8_t b = decode_u8(data, datapos, datalen);
+        *v |= (uint64_t) (b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return 0;
+    }
+    return -1;
+}
+
+static uint64_t zigzag(int64_t v)
+{
+    return ((uint64_t) v << 1) ^ (uint64_t) (v >> 63);
+}
+
+static int64_t unzigzag(uint64_t v)
+{
+    return (int64_t) (v >> 1) ^ -(int64_t) (v & 1);
+}
+
+static uint64_t double_bits(double v)
+{
+    uint64_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    return bits;
+}
+
+static void encode_xor(uint8_t *data, uint64_t *datapos, double v, double pred)
+{
+    uint64_t x = double_bits(v) ^ double_bits(pred);
+
+    if (x == 0) {
+        encode_u8(data, datapos, 0);
+        return;
+    }
+
+    int lead = __builtin_clzll(x) / 8;
+    int trail = __builtin_ctzll(x) / 8;
+    int n = 8 - lead - trail;
+
+    encode_u8(data, datapos, (n << 4) | trail);
+    x >>= 8 * trail;
+    for (int i = n - 1; i >= 0; i--)
+        encode_u8(data, datapos, (x >> (8 * i)) & 0xff);
+}
+
+static int decode_xor(const uint8_t *data, uint64_t *datapos, uint64_t datalen, double pred, double *v)
+{
+    if (*datapos >= datalen)
+        return -1;
+
+    uint8_t header = decode_u8(data, datapos, datalen);
+    int n = header >> 4, trail = header & 0x0f;
+    if (n + trail > 8 || *datapos + n > datalen)
+        return -1;
+
+    uint64_t x = 0;
+    for (int i = 0; i < n; i++)
+        x = (x << 8) | decode_u8(data, datapos, datalen);
+    if (n > 0)
+        x <<= 8 * trail;
+
+    uint64_t bits = double_bits(pred) ^ x;
+    memcpy(v, &bits, sizeof(bits));
+    return 0;
+}
+
+static void names_init(struct names *names)
+{
+    names->names = zarray_create(sizeof(const char*));
+    names->idxs = zhash_create(sizeof(const char*), sizeof(int), zhash_str_hash, zhash_str_equals);
+}
+
+static void names_destroy(struct names *names)
+{
+    zarray_destroy(names->names);
+    zhash_destroy(names->idxs);
+}
+
+static void add_name(struct names *names, const stype_t *stype)
+{
+    const char *name = stype->name;
+    if (zhash_contains(names->idxs, &name))
+        return;
+
+    int idx = zarray_size(names->names);
+    zarray_add(names->names, &name);
+    zhash_put(names->idxs, &name, &idx, NULL, NULL);
+}
+
+static int name_idx(struct names *names, const stype_t *stype)
+{
+    const char *name = stype->name;
+    int idx;
+    zhash_get(names->idxs, &name, &idx);
+    return idx;
+}
+
+static void encode_names(uint8_t *data, uint64_t *datapos, const struct names *names)
+{
+    encode_varint(data, datapos, zarray_size(names->names));
+    for (int i = 0; i < zarray_size(names->names); i++) {
+        const char *name;
+        zarray_get(names->names, i, &name);
+        uint64_t len = strlen(name);
+        encode_varint(data, datapos, len);
+        encodeN(data, datapos, (const uint8_t*) name, len);
+    }
+}
+
+static void add_attr_names(struct archive *ar, const april_graph_attr_t *attr)
+{
+    if (!attr)
+        return;
+
+    zhash_iterator_t zit;
+    zhash_iterator_init((zhash_t*) attr->hash, &zit);
+    char *key;
+    struct april_graph_attr_record record;
+    while (zhash_iterator_next(&zit, &key, &record)) {
+        if (record.stype)
+            add_name(&ar->attr_names, record.stype);
+    }
+}
+
+static int is_compact_factor(const april_graph_factor_t *factor)
+{
+    return factor->type == APRIL_GRAPH_FACTOR_XYT_TYPE || factor->type == APRIL_GRAPH_FACTOR_XYTPOS_TYPE;
+}
+
+// Fill the name and info tables.
+static void archive_collect(struct archive *ar, april_graph_t *graph)
+{
+    for (int i = 0; i < zarray_size(graph->nodes); i++) {
+        april_graph_node_t *node;
+        zarray_get(graph->nodes, i, &node);
+        add_name(&ar->node_names, node->stype);
+        add_attr_names(ar, node->attr);
+    }
+
+    for (int i = 0; i < zarray_size(graph->factors); i++) {
+        april_graph_factor_t *factor;
+        zarray_get(graph->factors, i, &factor);
+        add_name(&ar->factor_names, factor->stype);
+        add_attr_names(ar, factor->attr);
+
+        if (is_compact_factor(factor) && !zhash_contains(ar->info_idxs, &factor->u.common.info)) {
+            int idx = zarray_size(ar->infos);
+            zarray_add(ar->infos, &factor->u.common.info);
+            zhash_put(ar->info_idxs, &factor->u.common.info, &idx, NULL, NULL);
+        }
+    }
+
+    add_attr_names(ar, graph->attr);
+}
+
+// Attributes without a type can't be decoded, so (as with the stype
+// encoding) they aren't stored.
+static void encode_attr(struct archive *ar, uint8_t *data, uint64_t *datapos, const april_graph_attr_t *attr)
+{
+    zhash_iterator_t zit;
+    char *key;
+    struct april_graph_attr_record record;
+
+    int n = 0;
+    zhash_iterator_init((zhash_t*) attr->hash, &zit);
+    while (zhash_iterator_next(&zit, &key, &record))
+        n += record.stype != NULL;
+    encode_varint(data, datapos, n);
+
+    zhash_iterator_init((zhash_t*) attr->hash, &zit);
+    while (zhash_iterator_next(&zit, &key, &record)) {
+        if (!record.stype)
+            continue;
+
+        uint64_t keylen = strlen(key);
+        encode_varint(data, datapos, keylen);
+        encodeN(data, datapos, (const uint8_t*) key, keylen);
+        encode_varint(data, datapos, name_idx(&ar->attr_names, record.stype));
+
+        uint64_t len = 0;
+        record.stype->encode(record.stype, NULL, &len, record.value);
+        encode_varint(data, datapos, len);
+        record.stype->encode(record.stype, data, datapos, record.value);
+    }
+}
+
+// Payload of an object of a type without a compact encoding.
+static void encode_other(uint8_t *data, uint64_t *datapos, const stype_t *stype, const void *obj)
+{
+    uint64_t len = 0;
+    stype->encode(stype, NULL, &len, obj);
+    encode_varint(data, datapos, len);
+    stype->encode(stype, data, datapos, obj);
+}
+
+static void encode_node(struct archive *ar, uint8_t *data, uint64_t *datapos, const april_graph_node_t *node)
+{
+    encode_varint(data, datapos, name_idx(&ar->node_names, node->stype));
+
+    if (node->type != APRIL_GRAPH_NODE_XYT_TYPE) {
+        encode_other(data, datapos, node->stype, node);
+        return;
+    }
+
+    encode_u8(data, datapos, (node->init ? NODE_HAS_INIT : 0) |
+              (node->truth ? NODE_HAS_TRUTH : 0) |
+              (node->attr ? NODE_HAS_ATTR : 0));
+
+    for (int i = 0; i < 3; i++)
+        encode_xor(data, datapos, node->state[i], ar->state[i]);
+    for (int i = 0; node->init && i < 3; i++)
+        encode_xor(data, datapos, node->init[i], node->state[i]);
+    for (int i = 0; node->truth && i < 3; i++)
+        encode_xor(data, datapos, node->truth[i], node->state[i]);
+    if (node->attr)
+        encode_attr(ar, data, datapos, node->attr);
+
+    memcpy(ar->state, node->state, sizeof(ar->state));
+}
+
+static void encode_factor(struct archive *ar, uint8_t *data, uint64_t *datapos, const april_graph_factor_t *factor)
+{
+    encode_varint(data, datapos, name_idx(&ar->factor_names, factor->stype));
+
+    if (!is_compact_factor(factor)) {
+        encode_other(data, datapos, factor->stype, factor);
+        return;
+    }
+
+    encode_u8(data, datapos, (factor->u.common.ztruth ? FACTOR_HAS_ZTRUTH : 0) |
+              (factor->attr ? FACTOR_HAS_ATTR : 0));
+
+    int a = factor->nodes[0];
+    encode_varint(data, datapos, zigzag((int64_t) a - ar->prev_a));
+    if (factor->type == APRIL_GRAPH_FACTOR_XYT_TYPE)
+        encode_varint(data, datapos, zigzag((int64_t) factor->nodes[1] - a));
+    ar->prev_a = a;
+
+    double *pred = factor->type == APRIL_GRAPH_FACTOR_XYT_TYPE ? ar->z_xyt : ar->z_xytpos;
+    for (int i = 0; i < 3; i++)
+        encode_xor(data, datapos, factor->u.common.z[i], pred[i]);
+    for (int i = 0; factor->u.common.ztruth && i < 3; i++)
+        encode_xor(data, datapos, factor->u.common.ztruth[i], factor->u.common.z[i]);
+    memcpy(pred, factor->u.common.z, 3 * sizeof(double));
+
+    int info;
+    zhash_get(ar->info_idxs, &factor->u.common.info, &info);
+    encode_varint(data, datapos, info);
+
+    if (factor->attr)
+        encode_attr(ar, data, datapos, factor->attr);
+}
+
+static void encode_info(uint8_t *data, uint64_t *datapos, const april_graph_info_t *info)
+{
+    int dim = info->dim;
+    const double *W = info->Wmat->data;
+
+    int symmetric = 1;
+    for (int i = 0; i < dim; i++)
+        for (int j = i + 1; j < dim; j++)
+            symmetric &= double_bits(W[i*dim + j]) == double_bits(W[j*dim + i]);
+
+    encode_varint(data, datapos, dim);
+    encode_u8(data, datapos, symmetric);
+    for (int i = 0; i < dim; i++)
+        for (int j = symmetric ? i : 0; j < dim; j++)
+            encode_f64(data, datapos, W[i*dim + j]);
+}
+
+uint64_t april_graph_archive_encode(april_graph_t *graph, uint8_t *data)
+{
+    struct archive ar;
+    memset(&ar, 0, sizeof(ar));
+    names_init(&ar.node_names);
+    names_init(&ar.factor_names);
+    names_init(&ar.attr_names);
+    ar.infos = zarray_create(sizeof(int));
+    ar.info_idxs = zhash_create(sizeof(int), sizeof(int), zhash_uint32_hash, zhash_uint32_equals);
+
+    archive_collect(&ar, graph);
+
+    uint64_t pos = 0;
+    encode_u32(data, &pos, ARCHIVE_MAGIC);
+    encode_u8(data, &pos, ARCHIVE_VERSION);
+
+    encode_names(data, &pos, &ar.attr_names);
+
+    encode_varint(data, &pos, zarray_size(ar.infos));
+    for (int i = 0; i < zarray_size(ar.infos); i++) {
+        int idx;
+        zarray_get(ar.infos, i, &idx);
+        encode_info(data, &pos, april_graph_info_get(idx));
+    }
+
+    encode_names(data, &pos, &ar.node_names);
+    encode_varint(data, &pos, zarray_size(graph->nodes));
+    for (int i = 0; i < zarray_size(graph->nodes); i++) {
+        april_graph_node_t *node;
+        zarray_get(graph->nodes, i, &node);
+        encode_node(&ar, data, &pos, node);
+    }
+
+    encode_names(data, &pos, &ar.factor_names);
+    encode_varint(data, &pos, zarray_size(graph->factors));
+    for (int i = 0; i < zarray_size(graph->factors); i++) {
+        april_graph_factor_t *factor;
+        zarray_get(graph->factors, i, &factor);
+        encode_factor(&ar, data, &pos, factor);
+    }
+
+    encode_u8(data, &pos, graph->attr != NULL);
+    if (graph->attr)
+        encode_attr(&ar, data, &pos, graph->attr);
+
+    names_destroy(&ar.node_names);
+    names_destroy(&ar.factor_names);
+    names_destroy(&ar.attr_names);
+    zarray_destroy(ar.infos);
+    zhash_destroy(ar.info_idxs);
+
+    return pos;
+}
+
+/////////////////////////////////////////////////////////////////
+// decoding
+
+struct stypes
+{
+    int n;
+    const stype_t **stypes;  // NULL for types that aren't registered
+};
+
+struct unarchive
+{
+    const uint8_t *data;
+    uint64_t pos, len;
+
+    struct stypes node_stypes, factor_stypes, attr_stypes;
+
+    int ninfos;
+    int *infos;              // interned, one reference each
+
+    double state[3];
+    double z_xyt[3];
+    double z_xytpos[3];
+    int prev_a;
+};
+
+static int read_varint(struct unarchive *ua, uint64_t *v)
+{
+    return decode_varint(ua->data, &ua->pos, ua->len, v);
+}
+
+// a varint no larger than 'max'.
+static int read_count(struct unarchive *ua, uint64_t max, int *v)
+{
+    uint64_t u;
+    if (read_varint(ua, &u) || u > max || u > INT_MAX)
+        return -1;
+    *v = u;
+    return 0;
+}
+
+static int read_doubles(struct unarchive *ua, int n, const double *pred, double *v)
+{
+    for (int i = 0; i < n; i++) {
+        if (decode_xor(ua->data, &ua->pos, ua->len, pred[i], &v[i]))
+            return -1;
+    }
+    return 0;
+}
+
+// Decode a payload written by encode_other() or encode_attr() with
+// 'stype'. With stype == NULL, skips it.
+static int read_payload(struct unarchive *ua, const stype_t *stype, void **obj)
+{
+    uint64_t len;
+    if (read_varint(ua, &len) || len > ua->len - ua->pos)
+        return -1;
+
+    uint64_t end = ua->pos + len;
+    *obj = NULL;
+    if (stype) {
+        *obj = stype->decode(stype, ua->data, &ua->pos, end);
+        if (ua->pos != end)
+            return -1;
+    }
+    ua->pos = end;
+    return 0;
+}
+
+// each name takes at least one byte, which bounds the count.
+static int read_names(struct unarchive *ua, struct stypes *stypes)
+{
+    if (read_count(ua, ua->len - ua->pos, &stypes->n))
+        return -1;
+
+    stypes->stypes = calloc(stypes->n, sizeof(stype_t*));
+    for (int i = 0; i < stypes->n; i++) {
+        uint64_t len;
+        if (read_varint(ua, &len) || len > ua->len - ua->pos)
+            return -1;
+        char *name = strndup((const char*) &ua->data[ua->pos], len);
+        stypes->stypes[i] = stype_get(name);
+        free(name);
+        ua->pos += len;
+    }
+
+    return 0;
+}
+
+static int read_name(struct unarchive *ua, const struct stypes *stypes, const stype_t **stype)
+{
+    int idx;
+    if (stypes->n == 0 || read_count(ua, stypes->n - 1, &idx))
+        return -1;
+    *stype = stypes->stypes[idx];
+    return 0;
+}
+
+static int read_attr(struct unarchive *ua, april_graph_attr_t **_attr)
+{
+    april_graph_attr_t *attr = april_graph_attr_create();
+    *_attr = attr;
+
+    int n;
+    if (read_count(ua, ua->len - ua->pos, &n))
+        return -1;
+
+    for (int i = 0; i < n; i++) {
+        uint64_t keylen;
+        if (read_varint(ua, &keylen) || keylen > ua->len - ua->pos)
+            return -1;
+        const char *key = (const char*) &ua->data[ua->pos];
+        ua->pos += keylen;
+
+        const stype_t *stype;
+        void *value;
+        if (read_name(ua, &ua->attr_stypes, &stype) || read_payload(ua, stype, &value))
+            return -1;
+        if (!stype)
+            continue;
+
+        struct april_graph_attr_record record = { .stype = stype, .value = value };
+        char *k = strndup(key, keylen);
+        char *oldk;
+        struct april_graph_attr_record oldr;
+        if (zhash_put(attr->hash, &k, &record, &oldk, &oldr)) {
+            free(oldk);
+            if (oldr.stype)
+                oldr.stype->destroy(oldr.stype, oldr.value);
+        }
+    }
+
+    return 0;
+}
+
+static april_graph_node_t *read_node(struct unarchive *ua)
+{
+    const stype_t *stype;
+    if (read_name(ua, &ua->node_stypes, &stype) || !stype)
+        return NULL;
+
+    if (stype != stype_get("april_graph_node_xyt")) {
+        void *obj;
+        if (read_payload(ua, stype, &obj)) {
+            if (obj)
+                ((april_graph_node_t*) obj)->destroy(obj);
+            return NULL;
+        }
+        return obj;
+    }
+
+    if (ua->pos >= ua->len)
+        return NULL;
+    int flags = decode_u8(ua->data, &ua->pos, ua->len);
+
+    double state[3], init[3], truth[3];
+    if (read_doubles(ua, 3, ua->state, state) ||
+        ((flags & NODE_HAS_INIT) && read_doubles(ua, 3, state, init)) ||
+        ((flags & NODE_HAS_TRUTH) && read_doubles(ua, 3, state, truth)))
+        return NULL;
+    memcpy(ua->state, state, sizeof(state));
+
+    april_graph_node_t *node = april_graph_node_xyt_create(state,
+                                                           (flags & NODE_HAS_INIT) ? init : NULL,
+                                                           (flags & NODE_HAS_TRUTH) ? truth : NULL);
+    if ((flags & NODE_HAS_ATTR) && read_attr(ua, &node->attr)) {
+        node->destroy(node);
+        return NULL;
+    }
+
+    return node;
+}
+
+static april_graph_factor_t *read_factor(struct unarchive *ua, int nnodes)
+{
+    const stype_t *stype;
+    if (read_name(ua, &ua->factor_stypes, &stype) || !stype)
+        return NULL;
+
+    int xyt = stype == stype_get("april_graph_factor_xyt");
+    if (!xyt && stype != stype_get("april_graph_factor_xytpos")) {
+        void *obj;
+        if (read_payload(ua, stype, &obj)) {
+            if (obj)
+                ((april_graph_factor_t*) obj)->destroy(obj);
+            return NULL;
+        }
+        return obj;
+    }
+
+    if (ua->pos >= ua->len)
+        return NULL;
+    int flags = decode_u8(ua->data, &ua->pos, ua->len);
+
+    uint64_t u;
+    if (read_varint(ua, &u))
+        return NULL;
+    int64_t a = ua->prev_a + unzigzag(u), b = 0;
+    if (xyt) {
+        if (read_varint(ua, &u))
+            return NULL;
+        b = a + unzigzag(u);
+    }
+    if (a < 0 || a >= nnodes || b < 0 || b >= nnodes)
+        return NULL;
+    ua->prev_a = a;
+
+    double *pred = xyt ? ua->z_xyt : ua->z_xytpos;
+    double z[3], ztruth[3];
+    int info;
+    if (read_doubles(ua, 3, pred, z) ||
+        ((flags & FACTOR_HAS_ZTRUTH) && read_doubles(ua, 3, z, ztruth)) ||
+        ua->ninfos == 0 || read_count(ua, ua->ninfos - 1, &info))
+        return NULL;
+    memcpy(pred, z, sizeof(z));
+
+    const double *zt = (flags & FACTOR_HAS_ZTRUTH) ? ztruth : NULL;
+    april_graph_info_retain(ua->infos[info]);
+    april_graph_factor_t *factor = xyt ? april_graph_factor_xyt_create_info(a, b, z, zt, ua->infos[info]) :
+                                         april_graph_factor_xytpos_create_info(a, z, zt, ua->infos[info]);
+
+    if ((flags & FACTOR_HAS_ATTR) && read_attr(ua, &factor->attr)) {
+        factor->destroy(factor);
+        return NULL;
+    }
+
+    return factor;
+}
+
+static int read_info(struct unarchive *ua, int *idx)
+{
+    int dim;
+    if (read_count(ua, 64, &dim) || dim < 1 || ua->pos >= ua->len)
+        return -1;
+    int symmetric = decode_u8(ua->data, &ua->pos, ua->len);
+
+    int n = symmetric ? dim*(dim+1)/2 : dim*dim;
+    if (8 * (uint64_t) n > ua->len - ua->pos)
+        return -1;
+
+    double *W = malloc(dim * dim * sizeof(double));
+    for (int i = 0; i < dim; i++) {
+        for (int j = symmetric ? i : 0; j < dim; j++) {
+            W[i*dim + j] = decode_f64(ua->data, &ua->pos, ua->len);
+            if (symmetric)
+                W[j*dim + i] = W[i*dim + j];
+        }
+    }
+
+    *idx = april_graph_info_intern_data(dim, W);
+    free(W);
+    return 0;
+}
+
+april_graph_t *april_graph_archive_decode(const uint8_t *data, uint64_t datalen)
+{
+    struct unarchive ua;
+    memset(&ua, 0, sizeof(ua));
+    ua.data = data;
+    ua.len = datalen;
+
+    if (decode_u32(data, &ua.pos, datalen) != ARCHIVE_MAGIC)
+        return NULL;
+    if (decode_u8(data, &ua.pos, datalen) != ARCHIVE_VERSION) {
+        printf("april_graph_archive_decode: unsupported version\n");
+        return NULL;
+    }
+
+    april_graph_t *graph = april_graph_create();
+    int nnodes, nfactors;
+
+    if (read_names(&ua, &ua.attr_stypes))
+        goto fail;
+
+    // each entry takes at least one byte, which bounds the counts.
+    if (read_count(&ua, ua.len - ua.pos, &ua.ninfos))
+        goto fail;
+    ua.infos = calloc(ua.ninfos, sizeof(int));
+    for (int i = 0; i < ua.ninfos; i++) {
+        if (read_info(&ua, &ua.infos[i])) {
+            ua.ninfos = i;
+            goto fail;
+        }
+    }
+
+    if (read_names(&ua, &ua.node_stypes) || read_count(&ua, ua.len - ua.pos, &nnodes))
+        goto fail;
+    zarray_ensure_capacity(graph->nodes, nnodes);
+    for (int i = 0; i < nnodes; i++) {
+        april_graph_node_t *node = read_node(&ua);
+        if (!node)
+            goto fail;
+        zarray_add(graph->nodes, &node);
+    }
+
+    if (read_names(&ua, &ua.factor_stypes) || read_count(&ua, ua.len - ua.pos, &nfactors))
+        goto fail;
+    zarray_ensure_capacity(graph->factors, nfactors);
+    for (int i = 0; i < nfactors; i++) {
+        april_graph_factor_t *factor = read_factor(&ua, nnodes);
+        if (!factor)
+            goto fail;
+        zarray_add(graph->factors, &factor);
+    }
+
+    if (ua.pos >= ua.len)
+        goto fail;
+    april_graph_attr_destroy(graph->attr);
+    graph->attr = NULL;
+    if (decode_u8(data, &ua.pos, datalen) && read_attr(&ua, &graph->attr))
+        goto fail;
+
+    if (ua.pos != ua.len)
+        goto fail;
+
+  cleanup:
+    // the factors hold their own references.
+    for (int i = 0; i < ua.ninfos; i++)
+        april_graph_info_release(ua.infos[i]);
+    free(ua.infos);
+    free(ua.node_stypes.stypes);
+    free(ua.factor_stypes.stypes);
+    free(ua.attr_stypes.stypes);
+    return graph;
+
+  fail:
+    printf("april_graph_archive_decode: malformed archive\n");
+    april_graph_destroy(graph);
+    graph = NULL;
+    goto cleanup;
+}
+
+int april_graph_save_archive(april_graph_t *graph, const char *path)
+{
+    uint64_t len = april_graph_archive_encode(graph, NULL);
+    uint8_t *data = malloc(len);
+    april_graph_archive_encode(graph, data);
+
+    int ret = ioutils_write_file(path, data, len);
+    free(data);
+    return ret;
+}
+
+april_graph_t *april_graph_load_archive(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size < 5) {
+        close(fd);
+        return NULL;
+    }
+
+    void *base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return NULL;
+
+    april_graph_t *graph = april_graph_archive_decode(base, st.st_size);
+    munmap(base, st.st_size);
+    return graph;
+}
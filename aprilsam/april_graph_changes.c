@@ -0,0 +1,139 @@
+/* Copyright (C) 2013-2019, The Regents of The University of Michigan.
+All rights reserved.
+
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*$LICENSE*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "aprilsam.h"
+
+/** Change message, version 1.
+
+    u8 version, varint count, then for each changed node in order of
+    increasing index: varint gap (index - previous index - 1, with
+    previous = -1 initially), u8 length, length x f64 state.
+**/
+
+#define CHANGES_VERSION 1
+
+static void encode_varint(uint8_t *data, uint64_t *datapos, uint32_t v)
+{
+    while (v >= 0x80) {
+        encode_u8(data, datapos, (v & 0x7f) | 0x80);
+        v >>= 7;
+    }
+    encode_u8(data, datapos, v);
+}
+
+// Returns -1 if the varint is truncated or too long.
+static int64_t decode_varint(const uint8_t *data, uint64_t *datapos, uint64_t datalen)
+{
+    uint32_t v = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+        if (*datapos >= datalen)
+            return -1;
+        uint8_t b = decode_u8(data, datapos, datalen);
+        v |= (uint32_t) (b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return v;
+    }
+    return -1;
+}
+
+static int int_compare(const void *_a, const void *_b)
+{
+    int a = *(const int*) _a, b = *(const int*) _b;
+    return a < b ? -1 : a > b;
+}
+
+void april_graph_changes_iterator_init(const april_graph_changes_t *changes, april_graph_changes_iterator_t *it)
+{
+    it->changes = changes;
+    it->pos = 0;
+}
+
+int april_graph_changes_iterator_next(april_graph_changes_iterator_t *it, int *idx)
+{
+    if (it->pos >= it->changes->n)
+        return 0;
+
+    *idx = it->changes->nodes[it->pos++];
+    return 1;
+}
+
+uint64_t april_graph_changes_encode(const april_graph_changes_t *changes, const april_graph_t *graph, uint8_t *data)
+{
+    int *idxs = malloc((changes->n > 0 ? changes->n : 1) * sizeof(int));
+    memcpy(idxs, changes->nodes, changes->n * sizeof(int));
+    qsort(idxs, changes->n, sizeof(int), int_compare);
+
+    uint64_t pos = 0;
+    encode_u8(data, &pos, CHANGES_VERSION);
+    encode_varint(data, &pos, changes->n);
+
+    int prev = -1;
+    for (int i = 0; i < changes->n; i++) {
+        april_graph_node_t *node;
+        zarray_get(graph->nodes, idxs[i], &node);
+
+        encode_varint(data, &pos, idxs[i] - prev - 1);
+        encode_u8(data, &pos, node->length);
+        for (int j = 0; j < node->length; j++)
+            encode_f64(data, &pos, node->state[j]);
+        prev = idxs[i];
+    }
+
+    free(idxs);
+    return pos;
+}
+
+int april_graph_changes_apply(april_graph_t *graph, const uint8_t *data, uint64_t datalen)
+{
+    uint64_t pos = 0;
+    if (decode_u8(data, &pos, datalen) != CHANGES_VERSION)
+        return -1;
+
+    int64_t n = decode_varint(data, &pos, datalen);
+    if (n < 0)
+        return -1;
+
+    int64_t idx = -1;
+    for (int64_t i = 0; i < n; i++) {
+        int64_t gap = decode_varint(data, &pos, datalen);
+        if (gap < 0)
+            return -1;
+        idx += gap + 1;
+        if (idx >= zarray_size(graph->nodes))
+            return -1;
+
+        april_graph_node_t *node;
+        zarray_get(graph->nodes, idx, &node);
+
+        int length = decode_u8(data, &pos, datalen);
+        if (length != node->length || pos + 8 * length > datalen)
+            return -1;
+        for (int j = 0; j < length; j++)
+            node->state[j] = decode_f64(data, &pos, datalen);
+    }
+
+    return pos == datalen ? n : -1;
+}
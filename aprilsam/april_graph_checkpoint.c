@@ -0,0 +1,416 @@
+/* Copyright (C) 2013-2019, The Regents of The University of Michigan.
+All rights reserved.
+
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*$LICENSE*/
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "aprilsam.h"
+#include "./common/io_util.h"
+
+/** Solver checkpoint, version 1.
+
+    Everything april_graph_cholesky_inc() carries from one step to
+    the next: the factor U, the node ordering, B, y, delta_x, A (unless
+    lean), the search tree and the linearization points of the nodes.
+    The factor evals are not stored; they are recomputed on demand.
+    Numbers are big-endian, as written by encode_bytes.h; sparse rows
+    are stored as (column, value) pairs.
+**/
+
+#define CHECKPOINT_MAGIC 0x4150534b  // "APSK"
+#define CHECKPOINT_VERSION 1
+
+static void encode_smatd_rows(uint8_t *data, uint64_t *datapos, const smatd_t *m)
+{
+    for (int i = 0; i < m->nrows; i++) {
+        const svecd_t *v = &m->rows[i];
+        encode_u32(data, datapos, v->nz);
+        for (int j = 0; j < v->nz; j++) {
+            encode_u32(data, datapos, v->indices[j]);
+            encode_f64(data, datapos, v->values[j]);
+        }
+    }
+}
+
+// Returns NULL if the rows don't fit in the data or refer to columns
+// outside an n x n matrix.
+static smatd_t *decode_smatd_rows(const uint8_t *data, uint64_t *datapos, uint64_t datalen, int n)
+{
+    smatd_t *m = smatd_create(n, n);
+
+    for (int i = 0; i < n; i++) {
+        svecd_t *v = &m->rows[i];
+        uint32_t nz = decode_u32(data, datapos, datalen);
+        if (nz > (uint32_t) n || *datapos + 12 * (uint64_t) nz > datalen) {
+            smatd_destroy(m);
+            return NULL;
+        }
+
+        svecd_ensure_capacity(v, nz > 0 ? nz : 1);
+        for (int j = 0; j < (int) nz; j++) {
+            v->indices[j] = decode_u32(data, datapos, datalen);
+            v->values[j] = decode_f64(data, datapos, datalen);
+            if (v->indices[j] < 0 || v->indices[j] >= n) {
+                smatd_destroy(m);
+                return NULL;
+            }
+        }
+        v->nz = nz;
+    }
+
+    return m;
+}
+
+static void encode_doubles(uint8_t *data, uint64_t *datapos, const double *v, int n)
+{
+    for (int i = 0; i < n; i++)
+        encode_f64(data, datapos, v[i]);
+}
+
+static double *decode_doubles(const uint8_t *data, uint64_t *datapos, uint64_t datalen, int n)
+{
+    double *v = calloc(n > 0 ? n : 1, sizeof(double));
+    for (int i = 0; i < n; i++)
+        v[i] = decode_f64(data, datapos, datalen);
+    return v;
+}
+
+static void encode_checkpoint(uint8_t *data, uint64_t *datapos,
+                              const april_graph_cholesky_param_t *param, const april_graph_t *graph)
+{
+    const smatd_t *u = param->chol->u;
+    const search_tree_t *tr = param->tr;
+    int nnodes = param->nreordering;
+    int xlen = u->nrows;
+
+    assert(tr->nnodes == nnodes);
+
+    encode_u32(data, datapos, CHECKPOINT_MAGIC);
+    encode_u32(data, datapos, CHECKPOINT_VERSION);
+
+    encode_u32(data, datapos, nnodes);
+    encode_u32(data, datapos, xlen);
+    encode_u32(data, datapos, param->factor_num);
+    encode_f64(data, datapos, param->batch_time);
+    encode_u8(data, datapos, param->chol->is_spd);
+
+    for (int i = 0; i < nnodes; i++)
+        encode_u32(data, datapos, param->ordering[i]);
+    for (int i = 0; i < nnodes; i++)
+        encode_u32(data, datapos, param->idxs[i]);
+
+    encode_doubles(data, datapos, param->B, xlen);
+    encode_doubles(data, datapos, param->y, xlen);
+    encode_doubles(data, datapos, param->delta_x, xlen);
+
+    encode_smatd_rows(data, datapos, u);
+    encode_u8(data, datapos, param->A != NULL);
+    if (param->A)
+        encode_smatd_rows(data, datapos, param->A);
+
+    // search tree; nodes are identified by their index.
+    encode_u32(data, datapos, tr->root - tr->nodes);
+    encode_u32(data, datapos, tr->start_over);
+    encode_u32(data, datapos, tr->isam1_cnt);
+    encode_u32(data, datapos, tr->naffected);
+    encode_f64(data, datapos, tr->delta_xy);
+    encode_f64(data, datapos, tr->delta_theta);
+    encode_f64(data, datapos, tr->total_delta_xy);
+    encode_f64(data, datapos, tr->total_delta_theta);
+
+    encode_u32(data, datapos, tr->nlinearized_nodes);
+    for (int i = 0; i < tr->nlinearized_nodes; i++)
+        encode_u32(data, datapos, tr->linearized_nodes[i]);
+
+    for (int i = 0; i < nnodes; i++) {
+        const search_tree_node_t *tn = &tr->nodes[i];
+        encode_s32(data, datapos, tn->parent);
+        encode_u32(data, datapos, tn->id);
+        encode_u8(data, datapos, tn->label_changed);
+        encode_u8(data, datapos, tn->label_relinearized);
+        encode_u32(data, datapos, tn->nchildren);
+        for (int j = 0; j < tn->nchildren; j++)
+            encode_u32(data, datapos, tn->children[j]);
+    }
+
+    // linearization points
+    for (int i = 0; i < nnodes; i++) {
+        april_graph_node_t *node;
+        zarray_get(graph->nodes, i, &node);
+        encode_u32(data, datapos, node->length);
+        encode_doubles(data, datapos, node->l_point, node->length);
+        encode_doubles(data, datapos, node->delta_X, node->length);
+    }
+
+    encode_u32(data, datapos, CHECKPOINT_MAGIC);
+}
+
+int april_graph_cholesky_save(const april_graph_cholesky_param_t *param, const april_graph_t *graph, const char *path)
+{
+    if (!param->chol || !param->tr) {
+        printf("april_graph_cholesky_save: nothing to save before the first solve\n");
+        return -1;
+    }
+
+    uint64_t len = 0;
+    encode_checkpoint(NULL, &len, param, graph);
+
+    uint8_t *buf = malloc(len);
+    len = 0;
+    encode_checkpoint(buf, &len, param, graph);
+
+    int ret = ioutils_write_file(path, buf, len);
+    free(buf);
+    return ret;
+}
+
+// Decodes the search tree of a checkpoint, or returns NULL if it is
+// inconsistent.
+static search_tree_t *decode_search_tree(const uint8_t *data, uint64_t *datapos, uint64_t datalen,
+                                         int nnodes, april_graph_t *graph)
+{
+    april_graph_node_t **nodes_array = (april_graph_node_t**) graph->nodes->data;
+
+    search_tree_t *tr = calloc(1, sizeof(search_tree_t));
+    tr->nnodes = nnodes;
+    tr->nalloc = nnodes;
+    tr->nodes = calloc(tr->nalloc, sizeof(search_tree_node_t));
+    tr->linearized_nodes = calloc(tr->nalloc, sizeof(int));
+
+    int ok = 1;
+    uint32_t root = decode_u32(data, datapos, datalen);
+    ok &= root < (uint32_t) nnodes;
+    tr->root = &tr->nodes[ok ? root : 0];
+
+    tr->start_over = decode_u32(data, datapos, datalen);
+    tr->isam1_cnt = decode_u32(data, datapos, datalen);
+    tr->naffected = decode_u32(data, datapos, datalen);
+    tr->delta_xy = decode_f64(data, datapos, datalen);
+    tr->delta_theta = decode_f64(data, datapos, datalen);
+    tr->total_delta_xy = decode_f64(data, datapos, datalen);
+    tr->total_delta_theta = decode_f64(data, datapos, datalen);
+
+    uint32_t nlinearized = decode_u32(data, datapos, datalen);
+    ok &= nlinearized <= (uint32_t) nnodes;
+    for (int i = 0; ok && i < (int) nlinearized; i++) {
+        tr->linearized_nodes[i] = decode_u32(data, datapos, datalen);
+        ok &= tr->linearized_nodes[i] >= 0 && tr->linearized_nodes[i] < nnodes;
+    }
+    tr->nlinearized_nodes = ok ? nlinearized : 0;
+
+    for (int i = 0; i < nnodes; i++) {
+        search_tree_node_t *tn = &tr->nodes[i];
+        tn->parent = -1;
+        tn->nalloc = 8;
+        if (ok) {
+            tn->parent = decode_s32(data, datapos, datalen);
+            tn->id = decode_u32(data, datapos, datalen);
+            tn->label_changed = decode_u8(data, datapos, datalen);
+            tn->label_relinearized = decode_u8(data, datapos, datalen);
+            uint32_t nchildren = decode_u32(data, datapos, datalen);
+            ok &= tn->parent >= -1 && tn->parent < nnodes && tn->id >= 0 && tn->id < nnodes &&
+                nchildren <= (uint32_t) nnodes && *datapos + 4 * (uint64_t) nchildren <= datalen;
+            if (ok) {
+                while (tn->nalloc < (int) nchildren)
+                    tn->nalloc *= 2;
+                tn->nchildren = nchildren;
+            }
+        }
+        tn->children = calloc(tn->nalloc, sizeof(int));
+        for (int j = 0; ok && j < tn->nchildren; j++) {
+            tn->children[j] = decode_u32(data, datapos, datalen);
+            ok &= tn->children[j] >= 0 && tn->children[j] < nnodes;
+        }
+
+        tn->g_node = nodes_array[i];
+    }
+
+    if (!ok) {
+        search_tree_destroy(tr);
+        return NULL;
+    }
+
+    return tr;
+}
+
+int april_graph_cholesky_load(april_graph_cholesky_param_t *param, april_graph_t *graph, const char *path)
+{
+    uint8_t *data;
+    long datalen;
+
+    if (ioutils_read_file(path, (void**) &data, &datalen, -1)) {
+        printf("april_graph_cholesky_load: can't read %s\n", path);
+        return -1;
+    }
+
+    uint64_t pos = 0;
+    int nnodes = 0, xlen = 0, factor_num = 0;
+
+    smatd_t *u = NULL, *A = NULL;
+    search_tree_t *tr = NULL;
+    int *ordering = NULL, *idxs = NULL;
+    double *B = NULL, *y = NULL, *delta_x = NULL;
+    double batch_time;
+    int is_spd;
+
+    const char *err = "not a solver checkpoint";
+    if (decode_u32(data, &pos, datalen) != CHECKPOINT_MAGIC)
+        goto fail;
+    err = "unsupported version";
+    if (decode_u32(data, &pos, datalen) != CHECKPOINT_VERSION)
+        goto fail;
+
+    nnodes = decode_u32(data, &pos, datalen);
+    xlen = decode_u32(data, &pos, datalen);
+    factor_num = decode_u32(data, &pos, datalen);
+    batch_time = decode_f64(data, &pos, datalen);
+    is_spd = decode_u8(data, &pos, datalen);
+
+    err = "checkpoint doesn't match the graph";
+    if (nnodes <= 0 || nnodes > zarray_size(graph->nodes) ||
+        factor_num < 0 || factor_num > zarray_size(graph->factors) ||
+        xlen != 3 * nnodes) // HARD CODE: xyt_node, so 3 here.
+        goto fail;
+
+    err = "truncated checkpoint";
+    if (pos + 8 * (uint64_t) nnodes + 24 * (uint64_t) xlen > (uint64_t) datalen)
+        goto fail;
+
+    ordering = calloc(nnodes, sizeof(int));
+    idxs = calloc(nnodes, sizeof(int));
+    for (int i = 0; i < nnodes; i++)
+        ordering[i] = decode_u32(data, &pos, datalen);
+    for (int i = 0; i < nnodes; i++)
+        idxs[i] = decode_u32(data, &pos, datalen);
+
+    err = "corrupt ordering";
+    for (int i = 0; i < nnodes; i++) {
+        if (ordering[i] < 0 || ordering[i] >= nnodes || idxs[i] < 0 || idxs[i] + 3 > xlen)
+            goto fail;
+    }
+
+    B = decode_doubles(data, &pos, datalen, xlen);
+    y = decode_doubles(data, &pos, datalen, xlen);
+    delta_x = decode_doubles(data, &pos, datalen, xlen);
+
+    err = "corrupt factorization";
+    if (!(u = decode_smatd_rows(data, &pos, datalen, xlen)))
+        goto fail;
+    int has_A = decode_u8(data, &pos, datalen);
+    if (has_A && !(A = decode_smatd_rows(data, &pos, datalen, xlen)))
+        goto fail;
+    err = "checkpoint of a lean solver can't be loaded into one that keeps A";
+    if (!has_A && !param->lean)
+        goto fail;
+
+    err = "corrupt search tree";
+    if (!(tr = decode_search_tree(data, &pos, datalen, nnodes, graph)))
+        goto fail;
+
+    // check the rest of the file before touching the graph.
+    err = "linearization points don't match the graph";
+    uint64_t lpos = pos;
+    for (int i = 0; i < nnodes; i++) {
+        april_graph_node_t *node;
+        zarray_get(graph->nodes, i, &node);
+        if ((int) decode_u32(data, &lpos, datalen) != node->length)
+            goto fail;
+        lpos += 16 * node->length;
+    }
+
+    err = "truncated checkpoint";
+    if (decode_u32(data, &lpos, datalen) != CHECKPOINT_MAGIC || lpos != (uint64_t) datalen)
+        goto fail;
+
+    for (int i = 0; i < nnodes; i++)
+        tr->nodes[i].g_node->UID = i;
+
+    for (int i = 0; i < nnodes; i++) {
+        april_graph_node_t *node;
+        zarray_get(graph->nodes, i, &node);
+        decode_u32(data, &pos, datalen);
+        for (int j = 0; j < node->length; j++)
+            node->l_point[j] = decode_f64(data, &pos, datalen);
+        for (int j = 0; j < node->length; j++)
+            node->delta_X[j] = decode_f64(data, &pos, datalen);
+    }
+
+    free(data);
+
+    // replace the solver state; the configuration stays as it is.
+    april_graph_cholesky_batch_cancel(param);
+    if (param->chol)
+        smatd_chol_destroy(param->chol);
+    if (param->A)
+        smatd_destroy(param->A);
+    if (param->tr)
+        search_tree_destroy(param->tr);
+    free(param->ordering);
+    free(param->idxs);
+    free(param->B);
+    free(param->y);
+    free(param->delta_x);
+    // the running chi2 starts over with the next step.
+    april_graph_chi2_tracker_destroy(param->chi2);
+    param->chi2 = NULL;
+
+    param->chol = calloc(1, sizeof(smatd_chol_t));
+    param->chol->u = u;
+    param->chol->is_spd = is_spd;
+    param->A = A;
+    if (param->lean && param->A) {
+        smatd_destroy(param->A);
+        param->A = NULL;
+    }
+    param->tr = tr;
+    param->tr->changes = &param->changes;
+    param->ordering = ordering;
+    param->idxs = idxs;
+    param->B = B;
+    param->y = y;
+    param->delta_x = delta_x;
+    param->nalloc = nnodes;
+    param->xalloc = xlen;
+    param->nreordering = nnodes;
+    param->factor_num = factor_num;
+    param->batch_time = batch_time;
+
+    return 0;
+
+  fail:
+    printf("april_graph_cholesky_load: %s: %s\n", path, err);
+    free(data);
+    if (u)
+        smatd_destroy(u);
+    if (A)
+        smatd_destroy(A);
+    if (tr)
+        search_tree_destroy(tr);
+    free(ordering);
+    free(idxs);
+    free(B);
+    free(y);
+    free(delta_x);
+    return -1;
+}
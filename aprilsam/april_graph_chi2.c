@@ -0,0 +1,382 @@
+/* Copyright (C) 2013-2019, The Regents of The University of Michigan.
+All rights reserved.
+
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*$LICENSE*/
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "aprilsam.h"
+
+// Factors per partial sum. Fixed, so that the sums are added in the
+// same order however the work is split.
+#define CHI2_BLOCK 256
+
+// Evals of factors that have to be evaluated, recycled per type like
+// the eval cache's scratch evals. Each range has its own.
+struct chi2_scratch
+{
+    int n;
+    int types[APRIL_GRAPH_EVAL_CACHE_NSCRATCH];
+    april_graph_factor_eval_t *evals[APRIL_GRAPH_EVAL_CACHE_NSCRATCH];
+};
+
+struct chi2_task
+{
+    april_graph_t *graph;
+    april_graph_eval_cache_t *cache;
+    int nfactors;
+
+    double *chi2s;
+    double *residuals;
+    const int *offsets;     // per block: where its residuals start
+    double *sums;           // per block
+};
+
+static int at_lpoint(april_graph_factor_t *factor, april_graph_t *graph)
+{
+    for (int i = 0; i < factor->nnodes; i++) {
+        april_graph_node_t *node;
+        zarray_get(graph->nodes, factor->nodes[i], &node);
+        if (memcmp(node->l_point, node->state, node->length * sizeof(double)))
+            return 0;
+    }
+    return 1;
+}
+
+// An eval of the factor at the current state of its nodes, as
+// april_graph_chi2() does it.
+static april_graph_factor_eval_t *state_eval(struct chi2_scratch *scratch, april_graph_eval_cache_t *cache,
+                                             april_graph_t *graph, int fidx)
+{
+    april_graph_factor_t *factor;
+    zarray_get(graph->factors, fidx, &factor);
+
+    // the cached eval is at the linearization point; that's the
+    // state only if the nodes haven't moved since.
+    if (cache) {
+        april_graph_factor_eval_t *eval = april_graph_eval_cache_peek(cache, graph, fidx);
+        if (eval && (factor->state_eval == NULL || at_lpoint(factor, graph)))
+            return eval;
+    }
+
+    int s = 0;
+    while (s < scratch->n && scratch->types[s] != factor->type)
+        s++;
+    if (s == scratch->n) {
+        if (s == APRIL_GRAPH_EVAL_CACHE_NSCRATCH) {
+            s--;
+            april_graph_factor_eval_destroy(scratch->evals[s]);
+        } else {
+            scratch->n++;
+        }
+        scratch->types[s] = factor->type;
+        scratch->evals[s] = NULL;
+    }
+
+    if (factor->state_eval)
+        scratch->evals[s] = factor->state_eval(factor, graph, scratch->evals[s]);
+    else
+        scratch->evals[s] = factor->eval(factor, graph, scratch->evals[s]);
+    return scratch->evals[s];
+}
+
+static void whiten(april_graph_factor_t *factor, april_graph_factor_eval_t *eval, double *out)
+{
+    if (eval->info && eval->info->whiten) {
+        april_graph_info_whiten(eval->info, eval->r, out);
+        return;
+    }
+
+    matd_chol_t *chol = matd_chol(eval->W);
+    for (int i = 0; i < eval->length; i++) {
+        double acc = 0;
+        for (int j = i; j < eval->length; j++)
+            acc += MATD_EL(chol->u, i, j) * eval->r[j];
+        out[i] = acc;
+    }
+    matd_chol_destroy(chol);
+}
+
+static void chi2_range(void *arg, int b0, int b1)
+{
+    struct chi2_task *task = arg;
+    int nfactors = task->nfactors;
+    struct chi2_scratch scratch = { .n = 0 };
+
+    for (int b = b0; b < b1; b++) {
+        int i1 = (b + 1) * CHI2_BLOCK < nfactors ? (b + 1) * CHI2_BLOCK : nfactors;
+        int pos = task->offsets ? task->offsets[b] : 0;
+        double sum = 0;
+
+        for (int i = b * CHI2_BLOCK; i < i1; i++) {
+            april_graph_factor_eval_t *eval = state_eval(&scratch, task->cache, task->graph, i);
+
+            sum += eval->chi2;
+            if (task->chi2s)
+                task->chi2s[i] = eval->chi2;
+            if (task->residuals) {
+                april_graph_factor_t *factor;
+                zarray_get(task->graph->factors, i, &factor);
+                whiten(factor, eval, &task->residuals[pos]);
+                pos += eval->length;
+            }
+        }
+        task->sums[b] = sum;
+    }
+
+    for (int s = 0; s < scratch.n; s++)
+        april_graph_factor_eval_destroy(scratch.evals[s]);
+}
+
+double april_graph_chi2_eval(april_graph_t *graph, april_graph_eval_cache_t *cache, double *chi2s, double *residuals)
+{
+    int nfactors = zarray_size(graph->factors);
+    int nblocks = (nfactors + CHI2_BLOCK - 1) / CHI2_BLOCK;
+    if (nblocks == 0)
+        return 0;
+
+    struct chi2_task task = { .graph = graph, .cache = cache, .nfactors = nfactors,
+                              .chi2s = chi2s, .residuals = residuals };
+    task.sums = malloc(nblocks * sizeof(double));
+
+    int *offsets = NULL;
+    if (residuals) {
+        offsets = malloc(nblocks * sizeof(int));
+        int pos = 0;
+        for (int i = 0; i < nfactors; i++) {
+            if (i % CHI2_BLOCK == 0)
+                offsets[i / CHI2_BLOCK] = pos;
+            april_graph_factor_t *factor;
+            zarray_get(graph->factors, i, &factor);
+            pos += factor->length;
+        }
+        task.offsets = offsets;
+    }
+
+    taskpool_parallel_for(april_graph_taskpool(graph), 0, nblocks, 1, chi2_range, &task);
+
+    double chi2 = 0;
+    for (int b = 0; b < nblocks; b++)
+        chi2 += task.sums[b];
+
+    free(task.sums);
+    free(offsets);
+    return chi2;
+}
+
+int april_graph_residual_length(const april_graph_t *graph)
+{
+    int len = 0;
+    for (int i = 0; i < zarray_size(graph->factors); i++) {
+        april_graph_factor_t *factor;
+        zarray_get(graph->factors, i, &factor);
+        len += factor->length;
+    }
+    return len;
+}
+
+/////////////////////////////////////////////////////////////
+// running chi2
+
+struct april_graph_chi2_tracker
+{
+    double total;
+    int nsteps;             // since the last full recompute
+
+    double *chi2s;          // per factor
+    int nfactors;           // factors accounted for
+    int factors_alloc;
+
+    // The factors on each node, as linked lists: head[node] is the
+    // first entry, and entry e is factor efactor[e], followed by
+    // entry enext[e] (-1 ends the list).
+    int *head;
+    int nodes_alloc;
+    int *efactor;
+    int *enext;
+    int nentries;
+    int entries_alloc;
+
+    // factors to evaluate in this update; mark[f] == stamp iff listed.
+    int *fidxs;
+    double *vals;
+    int *mark;
+    int stamp;
+};
+
+april_graph_chi2_tracker_t *april_graph_chi2_tracker_create()
+{
+    april_graph_chi2_tracker_t *tracker = calloc(1, sizeof(april_graph_chi2_tracker_t));
+    return tracker;
+}
+
+void april_graph_chi2_tracker_destroy(april_graph_chi2_tracker_t *tracker)
+{
+    if (!tracker)
+        return;
+
+    free(tracker->chi2s);
+    free(tracker->head);
+    free(tracker->efactor);
+    free(tracker->enext);
+    free(tracker->fidxs);
+    free(tracker->vals);
+    free(tracker->mark);
+    free(tracker);
+}
+
+static int grow(int alloc, int need)
+{
+    if (alloc < 64)
+        alloc = 64;
+    while (alloc < need)
+        alloc *= 2;
+    return alloc;
+}
+
+// Make room for the graph's factors and nodes, and link the factors
+// that are new since the last update into the node lists.
+static void tracker_add_factors(april_graph_chi2_tracker_t *tracker, april_graph_t *graph)
+{
+    int nfactors = zarray_size(graph->factors);
+    int nnodes = zarray_size(graph->nodes);
+
+    if (nfactors > tracker->factors_alloc) {
+        int alloc = grow(tracker->factors_alloc, nfactors);
+        tracker->chi2s = realloc(tracker->chi2s, alloc * sizeof(double));
+        tracker->fidxs = realloc(tracker->fidxs, alloc * sizeof(int));
+        tracker->vals = realloc(tracker->vals, alloc * sizeof(double));
+        tracker->mark = realloc(tracker->mark, alloc * sizeof(int));
+        memset(&tracker->mark[tracker->factors_alloc], 0, (alloc - tracker->factors_alloc) * sizeof(int));
+        tracker->factors_alloc = alloc;
+    }
+
+    if (nnodes > tracker->nodes_alloc) {
+        int alloc = grow(tracker->nodes_alloc, nnodes);
+        tracker->head = realloc(tracker->head, alloc * sizeof(int));
+        for (int i = tracker->nodes_alloc; i < alloc; i++)
+            tracker->head[i] = -1;
+        tracker->nodes_alloc = alloc;
+    }
+
+    for (int i = tracker->nfactors; i < nfactors; i++) {
+        april_graph_factor_t *factor;
+        zarray_get(graph->factors, i, &factor);
+
+        if (tracker->nentries + factor->nnodes > tracker->entries_alloc) {
+            int alloc = grow(tracker->entries_alloc, tracker->nentries + factor->nnodes);
+            tracker->efactor = realloc(tracker->efactor, alloc * sizeof(int));
+            tracker->enext = realloc(tracker->enext, alloc * sizeof(int));
+            tracker->entries_alloc = alloc;
+        }
+
+        for (int j = 0; j < factor->nnodes; j++) {
+            int e = tracker->nentries++;
+            tracker->efactor[e] = i;
+            tracker->enext[e] = tracker->head[factor->nodes[j]];
+            tracker->head[factor->nodes[j]] = e;
+        }
+    }
+}
+
+struct list_task
+{
+    april_graph_t *graph;
+    april_graph_eval_cache_t *cache;
+    const int *fidxs;
+    double *vals;
+};
+
+static void list_range(void *arg, int i0, int i1)
+{
+    struct list_task *task = arg;
+    struct chi2_scratch scratch = { .n = 0 };
+
+    for (int i = i0; i < i1; i++)
+        task->vals[i] = state_eval(&scratch, task->cache, task->graph, task->fidxs[i])->chi2;
+
+    for (int s = 0; s < scratch.n; s++)
+        april_graph_factor_eval_destroy(scratch.evals[s]);
+}
+
+static void tracker_list(april_graph_chi2_tracker_t *tracker, int *n, int fidx)
+{
+    if (tracker->mark[fidx] == tracker->stamp)
+        return;
+    tracker->mark[fidx] = tracker->stamp;
+    tracker->fidxs[(*n)++] = fidx;
+}
+
+double april_graph_chi2_tracker_update(april_graph_chi2_tracker_t *tracker, april_graph_t *graph,
+                                       april_graph_eval_cache_t *cache, const april_graph_changes_t *changes,
+                                       int refresh)
+{
+    int nfactors = zarray_size(graph->factors);
+    int factor0 = tracker->nfactors;
+    tracker_add_factors(tracker, graph);
+    tracker->nfactors = nfactors;
+
+    // Re-evaluating more than about half of the factors one by one
+    // doesn't pay off.
+    tracker->nsteps++;
+    if ((refresh > 0 && tracker->nsteps >= refresh) || factor0 == 0 ||
+        2 * changes->ntouched > zarray_size(graph->nodes)) {
+        tracker->total = april_graph_chi2_eval(graph, cache, tracker->chi2s, NULL);
+        tracker->nsteps = 0;
+        return tracker->total;
+    }
+
+    // the new factors, and the old ones on touched nodes.
+    tracker->stamp++;
+    int n = 0;
+    for (int i = factor0; i < nfactors; i++)
+        tracker_list(tracker, &n, i);
+    for (int i = 0; i < changes->ntouched; i++) {
+        for (int e = tracker->head[changes->touched[i]]; e >= 0; e = tracker->enext[e])
+            tracker_list(tracker, &n, tracker->efactor[e]);
+    }
+
+    struct list_task task = { .graph = graph, .cache = cache, .fidxs = tracker->fidxs, .vals = tracker->vals };
+    taskpool_parallel_for(april_graph_taskpool(graph), 0, n, 0, list_range, &task);
+
+    // in list order, so the total doesn't depend on the threads.
+    for (int i = 0; i < n; i++) {
+        int fidx = tracker->fidxs[i];
+        if (fidx < factor0)
+            tracker->total -= tracker->chi2s[fidx];
+        tracker->chi2s[fidx] = tracker->vals[i];
+        tracker->total += tracker->vals[i];
+    }
+
+    return tracker->total;
+}
+
+double april_graph_chi2_tracker_total(const april_graph_chi2_tracker_t *tracker)
+{
+    return tracker->total;
+}
+
+const double *april_graph_chi2_tracker_factors(const april_graph_chi2_tracker_t *tracker)
+{
+    return tracker->chi2s;
+}
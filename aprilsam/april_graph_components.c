@@ -0,0 +1,414 @@
+/* Copyright (C) 2013-2019, The Regents of The University of Michigan.
+All rights reserved.
+
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*$LICENSE*/
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "aprilsam.h"
+
+/////////////////////////////////////////////////////////////
+// union-find
+
+struct april_graph_components
+{
+    int *parent;
+    int *size;
+    int nnodes;
+    int alloc;
+    int nsets;
+
+    int nfactors;   // factors accounted for by april_graph_components_update()
+};
+
+april_graph_components_t *april_graph_components_create()
+{
+    april_graph_components_t *comps = calloc(1, sizeof(april_graph_components_t));
+    return comps;
+}
+
+void april_graph_components_destroy(april_graph_components_t *comps)
+{
+    if (!comps)
+        return;
+
+    free(comps->parent);
+    free(comps->size);
+    free(comps);
+}
+
+void april_graph_components_add_nodes(april_graph_components_t *comps, int nnodes)
+{
+    if (nnodes <= comps->nnodes)
+        return;
+
+    if (nnodes > comps->alloc) {
+        int alloc = comps->alloc > 64 ? comps->alloc : 64;
+        while (alloc < nnodes)
+            alloc *= 2;
+        comps->parent = realloc(comps->parent, alloc * sizeof(int));
+        comps->size = realloc(comps->size, alloc * sizeof(int));
+        comps->alloc = alloc;
+    }
+
+    for (int i = comps->nnodes; i < nnodes; i++) {
+        comps->parent[i] = i;
+        comps->size[i] = 1;
+    }
+    comps->nsets += nnodes - comps->nnodes;
+    comps->nnodes = nnodes;
+}
+
+int april_graph_components_find(april_graph_components_t *comps, int node)
+{
+    assert(node >= 0 && node < comps->nnodes);
+
+    // path halving
+    while (comps->parent[node] != node) {
+        comps->parent[node] = comps->parent[comps->parent[node]];
+        node = comps->parent[node];
+    }
+    return node;
+}
+
+int april_graph_components_union(april_graph_components_t *comps, int a, int b)
+{
+    a = april_graph_components_find(comps, a);
+    b = april_graph_components_find(comps, b);
+    if (a == b)
+        return a;
+
+    // the larger set absorbs the smaller one.
+    if (comps->size[a] < comps->size[b]) {
+        int t = a;
+        a = b;
+        b = t;
+    }
+    comps->parent[b] = a;
+    comps->size[a] += comps->size[b];
+    comps->nsets--;
+    return a;
+}
+
+int april_graph_components_size(april_graph_components_t *comps, int node)
+{
+    return comps->size[april_graph_components_find(comps, node)];
+}
+
+int april_graph_components_count(const april_graph_components_t *comps)
+{
+    return comps->nsets;
+}
+
+int april_graph_components_update(april_graph_components_t *comps, april_graph_t *graph)
+{
+    april_graph_components_add_nodes(comps, zarray_size(graph->nodes));
+
+    int nmerges = 0;
+    for (; comps->nfactors < zarray_size(graph->factors); comps->nfactors++) {
+        april_graph_factor_t *factor;
+        zarray_get(graph->factors, comps->nfactors, &factor);
+        for (int i = 1; i < factor->nnodes; i++) {
+            if (april_graph_components_find(comps, factor->nodes[0]) !=
+                april_graph_components_find(comps, factor->nodes[i])) {
+                april_graph_components_union(comps, factor->nodes[0], factor->nodes[i]);
+                nmerges++;
+            }
+        }
+    }
+    return nmerges;
+}
+
+/////////////////////////////////////////////////////////////
+// per-component solver
+
+// One connected component, solved as a graph of its own.
+struct component
+{
+    // The component's nodes are the full graph's node objects; its
+    // factors are copies whose node indices are local. Built like the
+    // background batch's snapshot, so that only the factors are its
+    // own.
+    april_graph_t *graph;
+    april_graph_cholesky_param_t *param;
+    int *nodes;             // per local index: the index in the full graph
+    int nalloc;
+
+    int nfactors_solved;    // factors included in the last step
+    int fresh;              // new or merged: the next step is a batch
+};
+
+struct april_graph_component_solver
+{
+    const april_graph_cholesky_param_t *config;
+    april_graph_components_t *comps;
+
+    // per node of the full graph: the index in its component's graph,
+    // or -1 while no factor has reached it. comp[r] is the component
+    // of the set with root r.
+    int *local;
+    struct component **comp;
+    int alloc;
+
+    zarray_t *components;   // struct component*
+    int nnodes;             // nodes and factors of the full graph seen
+    int nfactors;
+};
+
+static april_graph_cholesky_param_t *component_param(const april_graph_cholesky_param_t *config)
+{
+    april_graph_cholesky_param_t *param = calloc(1, sizeof(april_graph_cholesky_param_t));
+    april_graph_cholesky_param_init(param);
+    param->tikhanov = config->tikhanov;
+    param->show_timing = config->show_timing;
+    param->lean = config->lean;
+    param->l_thresh = config->l_thresh;
+    param->delta_thresh = config->delta_thresh;
+    param->nthreshold = config->nthreshold;
+    param->delta_xy = config->delta_xy;
+    param->delta_theta = config->delta_theta;
+    param->changes.eps = config->changes.eps;
+    param->background = config->background;
+    param->track_chi2 = config->track_chi2;
+    param->chi2_refresh = config->chi2_refresh;
+    param->deterministic = config->deterministic;
+    param->nested_dissection = config->nested_dissection;
+    return param;
+}
+
+static struct component *component_create(april_graph_component_solver_t *solver, april_graph_t *graph)
+{
+    struct component *c = calloc(1, sizeof(struct component));
+    c->graph = calloc(1, sizeof(april_graph_t));
+    c->graph->nodes = zarray_create(sizeof(april_graph_node_t*));
+    c->graph->factors = zarray_create(sizeof(april_graph_factor_t*));
+    c->graph->taskpool = graph->taskpool;
+    c->param = component_param(solver->config);
+    c->fresh = 1;
+    zarray_add(solver->components, &c);
+    return c;
+}
+
+// Destroys the component's factors and solver, but not its nodes.
+static void component_destroy(struct component *c)
+{
+    for (int i = 0; i < zarray_size(c->graph->factors); i++) {
+        april_graph_factor_t *factor;
+        zarray_get(c->graph->factors, i, &factor);
+        factor->destroy(factor);
+    }
+    zarray_destroy(c->graph->nodes);
+    zarray_destroy(c->graph->factors);
+    free(c->graph);
+    april_graph_cholesky_param_destory(c->param);
+    free(c->nodes);
+    free(c);
+}
+
+static void component_add_node(april_graph_component_solver_t *solver, struct component *c,
+                               april_graph_t *graph, int idx)
+{
+    int n = zarray_size(c->graph->nodes);
+    if (n == c->nalloc) {
+        c->nalloc = c->nalloc ? 2 * c->nalloc : 16;
+        c->nodes = realloc(c->nodes, c->nalloc * sizeof(int));
+    }
+    c->nodes[n] = idx;
+    solver->local[idx] = n;
+
+    april_graph_node_t *node;
+    zarray_get(graph->nodes, idx, &node);
+    zarray_add(c->graph->nodes, &node);
+}
+
+// Moves the nodes and factors of 'b' into 'a', after a's own, and
+// destroys 'b'. Both have to start over with a batch.
+static void component_merge(april_graph_component_solver_t *solver, struct component *a, struct component *b,
+                            april_graph_t *graph)
+{
+    april_graph_cholesky_batch_cancel(b->param);
+    april_graph_cholesky_batch_cancel(a->param);
+
+    int root = april_graph_components_union(solver->comps, a->nodes[0], b->nodes[0]);
+    solver->comp[root] = a;
+
+    int offset = zarray_size(a->graph->nodes);
+    for (int i = 0; i < zarray_size(b->graph->nodes); i++)
+        component_add_node(solver, a, graph, b->nodes[i]);
+
+    for (int i = 0; i < zarray_size(b->graph->factors); i++) {
+        april_graph_factor_t *factor;
+        zarray_get(b->graph->factors, i, &factor);
+        for (int j = 0; j < factor->nnodes; j++)
+            factor->nodes[j] += offset;
+        zarray_add(a->graph->factors, &factor);
+    }
+    zarray_clear(b->graph->factors);
+
+    // a new solver: the factorization doesn't cover b's nodes, and
+    // the eval cache is keyed by factor index.
+    april_graph_cholesky_param_destory(a->param);
+    a->param = component_param(solver->config);
+    a->fresh = 1;
+
+    zarray_remove_value(solver->components, &b, 0);
+    component_destroy(b);
+}
+
+static void solver_reserve(april_graph_component_solver_t *solver, int nnodes)
+{
+    if (nnodes <= solver->alloc)
+        return;
+
+    int alloc = solver->alloc > 64 ? solver->alloc : 64;
+    while (alloc < nnodes)
+        alloc *= 2;
+    solver->local = realloc(solver->local, alloc * sizeof(int));
+    solver->comp = realloc(solver->comp, alloc * sizeof(struct component*));
+    for (int i = solver->alloc; i < alloc; i++) {
+        solver->local[i] = -1;
+        solver->comp[i] = NULL;
+    }
+    solver->alloc = alloc;
+}
+
+april_graph_component_solver_t *april_graph_component_solver_create(const april_graph_cholesky_param_t *config)
+{
+    april_graph_component_solver_t *solver = calloc(1, sizeof(april_graph_component_solver_t));
+    solver->config = config;
+    solver->comps = april_graph_components_create();
+    solver->components = zarray_create(sizeof(struct component*));
+    return solver;
+}
+
+void april_graph_component_solver_destroy(april_graph_component_solver_t *solver)
+{
+    if (!solver)
+        return;
+
+    for (int i = 0; i < zarray_size(solver->components); i++) {
+        struct component *c;
+        zarray_get(solver->components, i, &c);
+        component_destroy(c);
+    }
+    zarray_destroy(solver->components);
+    april_graph_components_destroy(solver->comps);
+    free(solver->local);
+    free(solver->comp);
+    free(solver);
+}
+
+// Adds a factor of the full graph to the component of its nodes,
+// creating and merging components as needed.
+static void solver_add_factor(april_graph_component_solver_t *solver, april_graph_t *graph,
+                              april_graph_factor_t *factor)
+{
+    // the largest of the components the factor touches takes the
+    // others in (a bridge).
+    struct component *c = NULL;
+    for (int i = 0; i < factor->nnodes; i++) {
+        int idx = factor->nodes[i];
+        if (solver->local[idx] < 0)
+            continue;
+        struct component *ci = solver->comp[april_graph_components_find(solver->comps, idx)];
+        if (c == NULL || zarray_size(ci->graph->nodes) > zarray_size(c->graph->nodes))
+            c = ci;
+    }
+    for (int i = 0; i < factor->nnodes; i++) {
+        int idx = factor->nodes[i];
+        if (solver->local[idx] < 0)
+            continue;
+        struct component *ci = solver->comp[april_graph_components_find(solver->comps, idx)];
+        if (ci != c)
+            component_merge(solver, c, ci, graph);
+    }
+
+    if (c == NULL)
+        c = component_create(solver, graph);
+
+    for (int i = 0; i < factor->nnodes; i++) {
+        if (solver->local[factor->nodes[i]] < 0)
+            component_add_node(solver, c, graph, factor->nodes[i]);
+        april_graph_components_union(solver->comps, factor->nodes[0], factor->nodes[i]);
+    }
+    solver->comp[april_graph_components_find(solver->comps, factor->nodes[0])] = c;
+
+    april_graph_factor_t *copy = factor->copy(factor);
+    for (int i = 0; i < copy->nnodes; i++)
+        copy->nodes[i] = solver->local[factor->nodes[i]];
+    zarray_add(c->graph->factors, &copy);
+}
+
+static void component_step(void *arg)
+{
+    struct component *c = arg;
+
+    if (c->fresh)
+        april_graph_cholesky(c->graph, c->param);
+    else
+        april_graph_cholesky_inc(c->graph, c->param);
+    c->fresh = 0;
+    c->nfactors_solved = zarray_size(c->graph->factors);
+}
+
+void april_graph_component_solver_step(april_graph_component_solver_t *solver, april_graph_t *graph)
+{
+    int nnodes = zarray_size(graph->nodes);
+    solver_reserve(solver, nnodes);
+    april_graph_components_add_nodes(solver->comps, nnodes);
+    solver->nnodes = nnodes;
+
+    for (; solver->nfactors < zarray_size(graph->factors); solver->nfactors++) {
+        april_graph_factor_t *factor;
+        zarray_get(graph->factors, solver->nfactors, &factor);
+        solver_add_factor(solver, graph, factor);
+    }
+
+    // only the components that have new factors; they share nothing,
+    // so they are solved in parallel.
+    taskpool_group_t group;
+    taskpool_group_init(april_graph_taskpool(graph), &group);
+    for (int i = 0; i < zarray_size(solver->components); i++) {
+        struct component *c;
+        zarray_get(solver->components, i, &c);
+        if (c->fresh || c->nfactors_solved < zarray_size(c->graph->factors))
+            taskpool_spawn(&group, component_step, c);
+    }
+    taskpool_wait(&group);
+}
+
+int april_graph_component_solver_count(const april_graph_component_solver_t *solver)
+{
+    return zarray_size(solver->components);
+}
+
+april_graph_cholesky_param_t *april_graph_component_solver_param(april_graph_component_solver_t *solver, int node,
+                                                                int *local)
+{
+    if (node < 0 || node >= solver->nnodes || solver->local[node] < 0)
+        return NULL;
+
+    if (local)
+        *local = solver->local[node];
+    return solver->comp[april_graph_components_find(solver->comps, node)]->param;
+}
@@ -0,0 +1,666 @@
+/* Copyright (C) 2013-2019, The Regents of The University of Michigan.
+All rights reserved.
+
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*$LICENSE*/
+
+#include <assert.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "aprilsam.h"
+
+#define DEFAULT_LEAF_SIZE 256
+
+// subtrees of the separator tree smaller than this many scalars are
+// factored by the thread that reaches them.
+#define CHOL_GRAIN 768
+
+// a refinement pass gives up after this many moves without a smaller
+// separator.
+#define REFINE_WINDOW 32
+#define REFINE_PASSES 4
+
+/////////////////////////////////////////////////////////////
+// ordering
+
+struct dissection
+{
+    int nnodes;
+    int leaf_size;
+
+    // node adjacency, compressed: the neighbors of node i are
+    // adj[adjp[i]] ... adj[adjp[i+1]-1].
+    int *adjp;
+    int *adj;
+
+    // subset[i] == subset_stamp: node i is in the set being bisected.
+    int *subset;
+    int subset_stamp;
+
+    // visited[i] == visit_stamp: the current BFS has reached node i,
+    // at level[i].
+    int *visited;
+    int visit_stamp;
+    int *level;
+    int *queue;
+
+    // side of a node in a bisection: 0 or 1, or 2 in the separator.
+    int *where;
+
+    int *tmp;
+    int *local;     // index of a node within its leaf
+
+    april_graph_separator_tree_t *tree;
+};
+
+static int int_compare(const void *_a, const void *_b)
+{
+    int a = *(const int*) _a, b = *(const int*) _b;
+    return (a > b) - (a < b);
+}
+
+static void make_adjacency(struct dissection *nd, april_graph_t *graph)
+{
+    int nnodes = nd->nnodes;
+    nd->adjp = calloc(nnodes + 1, sizeof(int));
+
+    for (int fidx = 0; fidx < zarray_size(graph->factors); fidx++) {
+        april_graph_factor_t *factor;
+        zarray_get(graph->factors, fidx, &factor);
+        for (int i = 0; i < factor->nnodes; i++)
+            nd->adjp[factor->nodes[i] + 1] += factor->nnodes - 1;
+    }
+    for (int i = 0; i < nnodes; i++)
+        nd->adjp[i + 1] += nd->adjp[i];
+
+    int *fill = malloc(nnodes * sizeof(int));
+    memcpy(fill, nd->adjp, nnodes * sizeof(int));
+    nd->adj = malloc((nd->adjp[nnodes] + 1) * sizeof(int));
+
+    for (int fidx = 0; fidx < zarray_size(graph->factors); fidx++) {
+        april_graph_factor_t *factor;
+        zarray_get(graph->factors, fidx, &factor);
+        for (int i = 0; i < factor->nnodes; i++)
+            for (int j = 0; j < factor->nnodes; j++)
+                if (i != j)
+                    nd->adj[fill[factor->nodes[i]]++] = factor->nodes[j];
+    }
+    free(fill);
+}
+
+// Breadth-first search from 'start' within the subset, appending to
+// the queue from 'tail' on; returns the new tail. Levels are counted
+// from start.
+static int bfs_append(struct dissection *nd, int start, int tail)
+{
+    int head = tail;
+    nd->queue[tail++] = start;
+    nd->visited[start] = nd->visit_stamp;
+    nd->level[start] = 0;
+
+    while (head < tail) {
+        int u = nd->queue[head++];
+        for (int p = nd->adjp[u]; p < nd->adjp[u + 1]; p++) {
+            int v = nd->adj[p];
+            if (nd->subset[v] != nd->subset_stamp || nd->visited[v] == nd->visit_stamp)
+                continue;
+            nd->visited[v] = nd->visit_stamp;
+            nd->level[v] = nd->level[u] + 1;
+            nd->queue[tail++] = v;
+        }
+    }
+    return tail;
+}
+
+// Returns the number of nodes reached from 'start'; the last one is a
+// node farthest from start, and its level the depth.
+static int bfs(struct dissection *nd, int start, int *last)
+{
+    nd->visit_stamp++;
+    int n = bfs_append(nd, start, 0);
+    *last = nd->queue[n - 1];
+    return n;
+}
+
+// The number of neighbors of separator node v on the side opposite
+// 'side', which would have to join the separator if v moved to 'side'.
+static int refine_cost(struct dissection *nd, int v, int side)
+{
+    int cost = 0;
+    for (int p = nd->adjp[v]; p < nd->adjp[v + 1]; p++) {
+        int u = nd->adj[p];
+        if (nd->subset[u] == nd->subset_stamp && nd->where[u] == 1 - side)
+            cost++;
+    }
+    return cost;
+}
+
+// Improves the separator (nd->where of nodes[0..m-1]) by moving
+// separator nodes to a side, pulling their neighbors on the other side
+// into the separator, in the manner of Fiduccia-Mattheyses: each pass
+// makes the best move of an unmoved node, even if that grows the
+// separator, and then rolls back to the smallest separator it saw.
+// Neither side is made smaller than m/4 if it isn't already.
+static void refine(struct dissection *nd, int *nodes, int m)
+{
+    int count[3] = { 0, 0, 0 };
+    for (int i = 0; i < m; i++)
+        count[nd->where[nodes[i]]]++;
+
+    int *sep = malloc(m * sizeof(int));
+    zarray_t *log = zarray_create(2 * sizeof(int)); // node, where before
+
+    for (int pass = 0; pass < REFINE_PASSES; pass++) {
+        int nsep = 0;
+        for (int i = 0; i < m; i++) {
+            if (nd->where[nodes[i]] == 2)
+                sep[nsep++] = nodes[i];
+        }
+
+        // visited marks the nodes moved in this pass.
+        nd->visit_stamp++;
+        zarray_clear(log);
+
+        int best_sep = count[2], best_imbalance = abs(count[0] - count[1]);
+        int best_log = 0, since_best = 0;
+
+        while (since_best < REFINE_WINDOW) {
+            int move = -1, move_side = 0, move_cost = 0;
+            for (int i = 0; i < nsep; i++) {
+                int v = sep[i];
+                if (nd->visited[v] == nd->visit_stamp)
+                    continue;
+                for (int side = 0; side < 2; side++) {
+                    int cost = refine_cost(nd, v, side);
+                    if (cost > 0 && count[1 - side] - cost < m / 4)
+                        continue;
+                    // ties go to the smaller side.
+                    if (move < 0 || cost < move_cost ||
+                        (cost == move_cost && count[side] < count[move_side])) {
+                        move = i;
+                        move_side = side;
+                        move_cost = cost;
+                    }
+                }
+            }
+            if (move < 0)
+                break;
+
+            int v = sep[move];
+            int entry[2] = { v, 2 };
+            zarray_add(log, entry);
+            nd->where[v] = move_side;
+            nd->visited[v] = nd->visit_stamp;
+            sep[move] = sep[--nsep];
+            count[2]--;
+            count[move_side]++;
+
+            for (int p = nd->adjp[v]; p < nd->adjp[v + 1]; p++) {
+                int u = nd->adj[p];
+                if (nd->subset[u] != nd->subset_stamp || nd->where[u] != 1 - move_side)
+                    continue;
+                int pulled[2] = { u, 1 - move_side };
+                zarray_add(log, pulled);
+                nd->where[u] = 2;
+                sep[nsep++] = u;
+                count[1 - move_side]--;
+                count[2]++;
+            }
+
+            int imbalance = abs(count[0] - count[1]);
+            if (count[2] < best_sep || (count[2] == best_sep && imbalance < best_imbalance)) {
+                best_sep = count[2];
+                best_imbalance = imbalance;
+                best_log = zarray_size(log);
+                since_best = 0;
+            } else {
+                since_best++;
+            }
+        }
+
+        for (int i = zarray_size(log) - 1; i >= best_log; i--) {
+            int entry[2];
+            zarray_get(log, i, entry);
+            count[nd->where[entry[0]]]--;
+            count[entry[1]]++;
+            nd->where[entry[0]] = entry[1];
+        }
+
+        if (best_log == 0)
+            break;
+    }
+
+    zarray_destroy(log);
+    free(sep);
+}
+
+// Splits nodes[0..m-1] in place into [left | right | separator], such
+// that no node on the left is adjacent to a node on the right.
+// Returns zero if there is no useful split.
+static int bisect(struct dissection *nd, int *nodes, int m, int *nleft, int *nright)
+{
+    nd->subset_stamp++;
+    for (int i = 0; i < m; i++)
+        nd->subset[nodes[i]] = nd->subset_stamp;
+
+    // find a pseudo-peripheral node: keep starting over from the
+    // farthest node while that makes the level structure deeper.
+    int start = nodes[0], last;
+    int reached = bfs(nd, start, &last);
+
+    if (reached < m) {
+        // disconnected: take whole components until about half of
+        // the nodes are on one side, the rest go on the other, and
+        // the separator is empty.
+        for (int i = 0; i < m && reached < m / 2; i++) {
+            if (nd->visited[nodes[i]] != nd->visit_stamp) {
+                int n = bfs_append(nd, nodes[i], reached);
+                if (n == m) {
+                    // that was the last component; leave it on the right.
+                    for (int q = reached; q < n; q++)
+                        nd->visited[nd->queue[q]] = 0;
+                    break;
+                }
+                reached = n;
+            }
+        }
+        int l = 0, r = 0;
+        for (int i = 0; i < m; i++) {
+            if (nd->visited[nodes[i]] == nd->visit_stamp)
+                nodes[l++] = nodes[i];
+            else
+                nd->tmp[r++] = nodes[i];
+        }
+        memcpy(&nodes[l], nd->tmp, r * sizeof(int));
+        *nleft = l;
+        *nright = r;
+        return 1;
+    }
+
+    int depth = nd->level[last], far;
+    bfs(nd, last, &far);
+    for (int iter = 0; iter < 4 && nd->level[far] > depth; iter++) {
+        depth = nd->level[far];
+        bfs(nd, far, &far);
+    }
+    depth = nd->level[far];
+
+    if (depth < 2)
+        return 0;
+
+    // The nodes of one level separate the levels below it from the
+    // levels above it. Take the smallest level that leaves at least a
+    // quarter of the nodes on either side, or the median level if
+    // there is none.
+    int *count = calloc(depth + 1, sizeof(int));
+    for (int i = 0; i < m; i++)
+        count[nd->level[nodes[i]]]++;
+
+    int best = -1, best_imbalance = 0, median = -1, below = count[0];
+    for (int l = 1; l < depth; l++) {
+        int above = m - below - count[l];
+        int imbalance = abs(above - below);
+        if (median < 0 && below + count[l] >= m / 2)
+            median = l;
+        if (below >= m / 4 && above >= m / 4 &&
+            (best < 0 || count[l] < count[best] || (count[l] == count[best] && imbalance < best_imbalance))) {
+            best = l;
+            best_imbalance = imbalance;
+        }
+        below += count[l];
+    }
+    if (best < 0)
+        best = median > 0 ? median : depth - 1;
+    free(count);
+
+    // thin the separator: a node of the level with no neighbors above
+    // it can join the nodes below, and the other way round.
+    for (int side = -1; side <= 1; side += 2) {
+        for (int i = 0; i < m; i++) {
+            int v = nodes[i];
+            if (nd->level[v] != best)
+                continue;
+            int p;
+            for (p = nd->adjp[v]; p < nd->adjp[v + 1]; p++) {
+                int u = nd->adj[p];
+                if (nd->subset[u] == nd->subset_stamp && nd->level[u] == best - side)
+                    break;
+            }
+            if (p == nd->adjp[v + 1])
+                nd->level[v] = best + side;
+        }
+    }
+
+    for (int i = 0; i < m; i++) {
+        int v = nodes[i];
+        nd->where[v] = nd->level[v] < best ? 0 : nd->level[v] > best ? 1 : 2;
+    }
+    refine(nd, nodes, m);
+
+    // the right side goes to the front of tmp, the separator to its back.
+    int l = 0, r = 0, s = 0;
+    for (int i = 0; i < m; i++) {
+        int v = nodes[i];
+        if (nd->where[v] == 0)
+            nodes[l++] = v;
+        else if (nd->where[v] == 1)
+            nd->tmp[r++] = v;
+        else
+            nd->tmp[m - 1 - s++] = v;
+    }
+    memcpy(&nodes[l], nd->tmp, r * sizeof(int));
+    memcpy(&nodes[l + r], &nd->tmp[m - s], s * sizeof(int));
+
+    *nleft = l;
+    *nright = r;
+    return 1;
+}
+
+// Minimum degree ordering of the nodes[0..m-1] of a leaf, in place.
+// The leaf's elimination graph is small enough to keep as a dense
+// matrix; edges to nodes outside the leaf, which are eliminated
+// later, count towards the degree but aren't updated.
+static void order_leaf(struct dissection *nd, int *nodes, int m)
+{
+    nd->subset_stamp++;
+    for (int i = 0; i < m; i++) {
+        nd->subset[nodes[i]] = nd->subset_stamp;
+        nd->local[nodes[i]] = i;
+    }
+
+    uint8_t *adj = calloc(m * m, sizeof(uint8_t));
+    int *degree = calloc(m, sizeof(int));
+    int *external = calloc(m, sizeof(int));
+
+    for (int i = 0; i < m; i++) {
+        int v = nodes[i];
+        for (int p = nd->adjp[v]; p < nd->adjp[v + 1]; p++) {
+            int u = nd->adj[p];
+            if (nd->subset[u] != nd->subset_stamp)
+                external[i]++;
+            else if (u != v && !adj[i * m + nd->local[u]]) {
+                adj[i * m + nd->local[u]] = 1;
+                degree[i]++;
+            }
+        }
+    }
+
+    for (int k = 0; k < m; k++) {
+        int best = -1;
+        for (int i = 0; i < m; i++) {
+            if (degree[i] >= 0 &&
+                (best < 0 || degree[i] + external[i] < degree[best] + external[best]))
+                best = i;
+        }
+        nd->tmp[k] = nodes[best];
+
+        // eliminate: its neighbors become a clique.
+        for (int i = 0; i < m; i++) {
+            if (!adj[best * m + i])
+                continue;
+            adj[i * m + best] = 0;
+            degree[i]--;
+            for (int j = 0; j < m; j++) {
+                if (j != i && adj[best * m + j] && !adj[i * m + j]) {
+                    adj[i * m + j] = 1;
+                    degree[i]++;
+                }
+            }
+        }
+        degree[best] = -1;
+    }
+    memcpy(nodes, nd->tmp, m * sizeof(int));
+
+    free(adj);
+    free(degree);
+    free(external);
+}
+
+// Orders nodes[0..m-1] into tree->ordering[begin..begin+m-1] and
+// returns the index of the subtree's part.
+static int dissect(struct dissection *nd, int *nodes, int m, int begin)
+{
+    april_graph_separator_t part = { .begin = begin, .sep = begin, .end = begin + m,
+                                     .child = { -1, -1 }, .parent = -1 };
+
+    int nleft, nright;
+    if (m > nd->leaf_size && bisect(nd, nodes, m, &nleft, &nright)) {
+        part.child[0] = dissect(nd, nodes, nleft, begin);
+        part.child[1] = dissect(nd, nodes + nleft, nright, begin + nleft);
+        part.sep = begin + nleft + nright;
+    }
+
+    // separators are eliminated in index order, which follows the
+    // trajectory.
+    int *sep = &nd->tree->ordering[part.sep];
+    if (part.child[0] < 0)
+        order_leaf(nd, &nodes[part.sep - begin], part.end - part.sep);
+    else
+        qsort(&nodes[part.sep - begin], part.end - part.sep, sizeof(int), int_compare);
+    memcpy(sep, &nodes[part.sep - begin], (part.end - part.sep) * sizeof(int));
+
+    int idx = zarray_size(nd->tree->parts);
+    for (int i = 0; i < 2; i++) {
+        if (part.child[i] < 0)
+            continue;
+        april_graph_separator_t *child;
+        zarray_get_volatile(nd->tree->parts, part.child[i], &child);
+        child->parent = idx;
+    }
+    zarray_add(nd->tree->parts, &part);
+    return idx;
+}
+
+april_graph_separator_tree_t *april_graph_nested_dissection(april_graph_t *graph, int leaf_size)
+{
+    int nnodes = zarray_size(graph->nodes);
+
+    april_graph_separator_tree_t *tree = calloc(1, sizeof(april_graph_separator_tree_t));
+    tree->nnodes = nnodes;
+    tree->ordering = calloc(nnodes, sizeof(int));
+    tree->parts = zarray_create(sizeof(april_graph_separator_t));
+    tree->root = -1;
+    if (nnodes == 0)
+        return tree;
+
+    struct dissection nd = { .nnodes = nnodes, .tree = tree };
+    nd.leaf_size = leaf_size > 0 ? leaf_size : DEFAULT_LEAF_SIZE;
+    make_adjacency(&nd, graph);
+    nd.subset = calloc(nnodes, sizeof(int));
+    nd.visited = calloc(nnodes, sizeof(int));
+    nd.level = calloc(nnodes, sizeof(int));
+    nd.where = calloc(nnodes, sizeof(int));
+    nd.queue = calloc(nnodes, sizeof(int));
+    nd.tmp = calloc(nnodes, sizeof(int));
+    nd.local = calloc(nnodes, sizeof(int));
+
+    int *nodes = calloc(nnodes, sizeof(int));
+    for (int i = 0; i < nnodes; i++)
+        nodes[i] = i;
+    tree->root = dissect(&nd, nodes, nnodes, 0);
+
+    free(nodes);
+    free(nd.adjp);
+    free(nd.adj);
+    free(nd.subset);
+    free(nd.visited);
+    free(nd.level);
+    free(nd.where);
+    free(nd.queue);
+    free(nd.tmp);
+    free(nd.local);
+    return tree;
+}
+
+void april_graph_separator_tree_destroy(april_graph_separator_tree_t *tree)
+{
+    if (!tree)
+        return;
+
+    free(tree->ordering);
+    zarray_destroy(tree->parts);
+    free(tree);
+}
+
+/////////////////////////////////////////////////////////////
+// factorization
+//
+// This is cs_chol(), an up-looking Cholesky that computes L one row
+// at a time, with the rows visited in the order of the separator
+// tree. Under a nested dissection ordering, row k of L only has
+// nonzeros in the columns of k's subtree: the two subtrees of a part
+// don't share any columns of L, nor any entries of the workspaces
+// indexed by column, and can be factored concurrently. The
+// arithmetic is the same as cs_chol()'s, so the result doesn't
+// depend on the number of threads.
+
+struct chol_state
+{
+    const april_graph_separator_tree_t *tree;
+    const int *xpos;
+    taskpool_t *tp;
+
+    const cs *C;
+    const int *parent;
+    cs *L;
+    int *w;             // ereach() marks
+    int *c;             // next free entry of each column of L
+    double *x;
+
+    int failed;         // not positive definite
+};
+
+struct chol_task
+{
+    struct chol_state *state;
+    int part;
+};
+
+// rows [k0, k1), using the stack s[0..top0-1].
+static void chol_rows(struct chol_state *state, int k0, int k1, int *s, int top0)
+{
+    const int *cp = state->L->p;
+    int *Li = state->L->i, *w = state->w, *c = state->c;
+    double *Lx = state->L->x, *x = state->x;
+
+    for (int k = k0; k < k1; k++) {
+        x[k] = 0;
+        w[k] = k;
+        int top = cs_ereach(state->C, k, state->parent, s, w, x, top0);
+        double d = x[k];
+        x[k] = 0;
+        for ( ; top < top0; top++) {
+            int i = s[top];
+            double lki = x[i] / Lx[cp[i]];
+            x[i] = 0;
+            for (int p = cp[i] + 1; p < c[i]; p++)
+                x[Li[p]] -= Lx[p] * lki;
+            d -= lki * lki;
+            int p = c[i]++;
+            Li[p] = k;
+            Lx[p] = lki;
+        }
+        if (d <= 0) {
+            __atomic_store_n(&state->failed, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        int p = c[k]++;
+        Li[p] = k;
+        Lx[p] = sqrt(d);
+    }
+}
+
+static void chol_part(void *arg);
+
+// 's' is the stack of the task this runs in, big enough for any part
+// of the subtree that the task started at.
+static void chol_subtree(struct chol_state *state, int idx, int *s)
+{
+    april_graph_separator_t *part;
+    zarray_get_volatile(state->tree->parts, idx, &part);
+
+    if (part->child[0] >= 0) {
+        const int *xpos = state->xpos;
+        if (xpos[part->end] - xpos[part->begin] >= CHOL_GRAIN && taskpool_nthreads(state->tp) > 1) {
+            struct chol_task tasks[2] = { { state, part->child[0] }, { state, part->child[1] } };
+            taskpool_group_t group;
+            taskpool_group_init(state->tp, &group);
+            taskpool_spawn(&group, chol_part, &tasks[0]);
+            taskpool_spawn(&group, chol_part, &tasks[1]);
+            taskpool_wait(&group);
+        } else {
+            chol_subtree(state, part->child[0], s);
+            chol_subtree(state, part->child[1], s);
+        }
+    }
+
+    if (__atomic_load_n(&state->failed, __ATOMIC_RELAXED))
+        return;
+
+    // the pattern of a row of this part stays within the subtree.
+    int n = state->xpos[part->end] - state->xpos[part->begin];
+    chol_rows(state, state->xpos[part->sep], state->xpos[part->end], s, n);
+}
+
+static void chol_task_run(struct chol_state *state, int idx)
+{
+    april_graph_separator_t *part;
+    zarray_get_volatile(state->tree->parts, idx, &part);
+
+    int *s = malloc((state->xpos[part->end] - state->xpos[part->begin]) * sizeof(int));
+    chol_subtree(state, idx, s);
+    free(s);
+}
+
+static void chol_part(void *arg)
+{
+    struct chol_task *task = arg;
+    chol_task_run(task->state, task->part);
+}
+
+csn *april_graph_separator_tree_chol(const april_graph_separator_tree_t *tree, const int *xpos,
+                                     const cs *A, const css *S, taskpool_t *tp)
+{
+    if (!A || !S || !S->cp || !S->parent || S->Pinv || tree->root < 0)
+        return NULL;
+    int n = A->n;
+    assert(xpos[tree->nnodes] == n);
+
+    csn *N = cs_calloc(1, sizeof(csn));
+    int *w = cs_malloc(2 * n, sizeof(int));
+    double *x = cs_malloc(n, sizeof(double));
+    if (!N || !w || !x)
+        return cs_ndone(N, NULL, w, x, 0);
+    N->L = cs_spalloc(n, n, S->cp[n], 1, 0);
+    if (!N->L)
+        return cs_ndone(N, NULL, w, x, 0);
+
+    struct chol_state state = { .tree = tree, .xpos = xpos, .tp = tp, .C = A, .parent = S->parent,
+                                .L = N->L, .w = w, .c = w + n, .x = x };
+    memcpy(N->L->p, S->cp, (n + 1) * sizeof(int));
+    memcpy(state.c, S->cp, n * sizeof(int));
+
+    chol_task_run(&state, tree->root);
+
+    return cs_ndone(N, NULL, w, x, !state.failed);
+}
@@ -0,0 +1,187 @@
+/* Copyright (C) 2013-2019, The Regents of The University of Michigan.
+All rights reserved.
+
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*$LICENSE*/
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "aprilsam.h"
+
+// Buffers that can be in use at once: the current one, and those
+// that readers still hold.
+#define ESTIMATES_NBUFS 16
+
+// 'current' holds the index + 1 of the current buffer in the high
+// bits (0: nothing published yet), and the number of readers that
+// have acquired it in the low bits.
+#define COUNT_BITS 40
+#define COUNT_MASK ((UINT64_C(1) << COUNT_BITS) - 1)
+
+struct estimates_buf
+{
+    april_graph_estimate_t estimate; // first, see release()
+
+    int *offsets;
+    double *states;
+    int nodes_alloc;
+    int states_alloc;
+
+    int used;
+    int retired;        // no longer current; ningress is valid
+    uint64_t ningress;  // readers that acquired it while it was current
+    uint64_t negress;   // readers that released it
+};
+
+struct april_graph_estimates
+{
+    uint64_t current;
+    struct estimates_buf *bufs[ESTIMATES_NBUFS];
+    int64_t version;
+};
+
+april_graph_estimates_t *april_graph_estimates_create()
+{
+    april_graph_estimates_t *est = calloc(1, sizeof(april_graph_estimates_t));
+    return est;
+}
+
+void april_graph_estimates_destroy(april_graph_estimates_t *est)
+{
+    if (!est)
+        return;
+
+    for (int i = 0; i < ESTIMATES_NBUFS; i++) {
+        if (est->bufs[i]) {
+            free(est->bufs[i]->offsets);
+            free(est->bufs[i]->states);
+            free(est->bufs[i]);
+        }
+    }
+    free(est);
+}
+
+// A buffer that no reader holds, or -1.
+static int find_free(april_graph_estimates_t *est)
+{
+    int cur = (__atomic_load_n(&est->current, __ATOMIC_RELAXED) >> COUNT_BITS) - 1;
+
+    for (int i = 0; i < ESTIMATES_NBUFS; i++) {
+        struct estimates_buf *buf = est->bufs[i];
+        if (buf == NULL) {
+            est->bufs[i] = calloc(1, sizeof(struct estimates_buf));
+            return i;
+        }
+        if (i == cur)
+            continue;
+        if (!buf->used)
+            return i;
+        if (buf->retired && __atomic_load_n(&buf->negress, __ATOMIC_ACQUIRE) == buf->ningress)
+            return i;
+    }
+    return -1;
+}
+
+int april_graph_estimates_publish(april_graph_estimates_t *est, const april_graph_t *graph)
+{
+    int idx = find_free(est);
+    if (idx < 0)
+        return -1;
+    struct estimates_buf *buf = est->bufs[idx];
+
+    int nnodes = zarray_size(graph->nodes);
+    if (nnodes + 1 > buf->nodes_alloc) {
+        buf->nodes_alloc = 2 * (nnodes + 1);
+        buf->offsets = realloc(buf->offsets, buf->nodes_alloc * sizeof(int));
+    }
+
+    int pos = 0;
+    april_graph_node_t **nodes = (april_graph_node_t**) graph->nodes->data;
+    for (int i = 0; i < nnodes; i++) {
+        buf->offsets[i] = pos;
+        pos += nodes[i]->length;
+    }
+    buf->offsets[nnodes] = pos;
+
+    if (pos > buf->states_alloc) {
+        buf->states_alloc = 2 * pos;
+        buf->states = realloc(buf->states, buf->states_alloc * sizeof(double));
+    }
+    for (int i = 0; i < nnodes; i++)
+        memcpy(&buf->states[buf->offsets[i]], nodes[i]->state, nodes[i]->length * sizeof(double));
+
+    buf->estimate.version = ++est->version;
+    buf->estimate.nnodes = nnodes;
+    buf->estimate.offsets = buf->offsets;
+    buf->estimate.states = buf->states;
+    buf->used = 1;
+    buf->retired = 0;
+    buf->ningress = 0;
+    __atomic_store_n(&buf->negress, 0, __ATOMIC_RELAXED);
+
+    uint64_t old = __atomic_exchange_n(&est->current, (uint64_t) (idx + 1) << COUNT_BITS, __ATOMIC_ACQ_REL);
+    if (old >> COUNT_BITS) {
+        struct estimates_buf *oldbuf = est->bufs[(old >> COUNT_BITS) - 1];
+        oldbuf->ningress = old & COUNT_MASK;
+        oldbuf->retired = 1;
+    }
+
+    return 0;
+}
+
+const april_graph_estimate_t *april_graph_estimates_acquire(april_graph_estimates_t *est)
+{
+    uint64_t cur = __atomic_fetch_add(&est->current, 1, __ATOMIC_ACQUIRE);
+    int idx = cur >> COUNT_BITS;
+
+    // nothing published yet. The count we added is dropped by the
+    // first publish.
+    if (idx == 0)
+        return NULL;
+
+    return &est->bufs[idx - 1]->estimate;
+}
+
+void april_graph_estimates_release(april_graph_estimates_t *est, const april_graph_estimate_t *estimate)
+{
+    if (estimate == NULL)
+        return;
+
+    struct estimates_buf *buf = (struct estimates_buf*) estimate;
+    __atomic_add_fetch(&buf->negress, 1, __ATOMIC_RELEASE);
+}
+
+int april_graph_estimates_get(april_graph_estimates_t *est, int idx, double *state, int64_t *version)
+{
+    const april_graph_estimate_t *estimate = april_graph_estimates_acquire(est);
+    int len = -1;
+
+    if (estimate && idx >= 0 && idx < estimate->nnodes) {
+        len = estimate->offsets[idx + 1] - estimate->offsets[idx];
+        memcpy(state, &estimate->states[estimate->offsets[idx]], len * sizeof(double));
+        if (version)
+            *version = estimate->version;
+    }
+
+    april_graph_estimates_release(est, estimate);
+    return len;
+}
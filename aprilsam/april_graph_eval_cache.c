@@ -0,0 +1,314 @@
+/* Copyright (C) 2013-2019, The Regents of The University of Michigan.
+All rights reserved.
+
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*$LICENSE*/
+
+#include <assert.h>
+#include <string.h>
+
+#include "aprilsam.h"
+
+april_graph_eval_cache_t *april_graph_eval_cache_create()
+{
+    april_graph_eval_cache_t *cache = calloc(1, sizeof(april_graph_eval_cache_t));
+    return cache;
+}
+
+void april_graph_eval_cache_clear(april_graph_eval_cache_t *cache)
+{
+    for (int i = 0; i < cache->nfactors; i++) {
+        if (cache->evals[i])
+            april_graph_factor_eval_destroy(cache->evals[i]);
+        free(cache->lpoints[i]);
+        cache->evals[i] = NULL;
+        cache->lpoints[i] = NULL;
+        cache->factors[i] = NULL;
+    }
+    cache->nfactors = 0;
+
+    for (int i = 0; i < cache->nscratch; i++)
+        april_graph_factor_eval_destroy(cache->scratch[i]);
+    cache->nscratch = 0;
+}
+
+void april_graph_eval_cache_destroy(april_graph_eval_cache_t *cache)
+{
+    if (!cache)
+        return;
+
+    april_graph_eval_cache_clear(cache);
+    free(cache->factors);
+    free(cache->evals);
+    free(cache->lpoints);
+    free(cache);
+}
+
+void april_graph_eval_cache_reserve(april_graph_eval_cache_t *cache, int nfactors)
+{
+    if (cache->nalloc >= nfactors)
+        return;
+
+    int nalloc = cache->nalloc > 64 ? cache->nalloc : 64;
+    while (nalloc < nfactors)
+        nalloc *= 2;
+
+    cache->factors = realloc(cache->factors, nalloc * sizeof(april_graph_factor_t*));
+    cache->evals = realloc(cache->evals, nalloc * sizeof(april_graph_factor_eval_t*));
+    cache->lpoints = realloc(cache->lpoints, nalloc * sizeof(double*));
+
+    // slots beyond nfactors are always kept empty.
+    for (int i = cache->nalloc; i < nalloc; i++) {
+        cache->factors[i] = NULL;
+        cache->evals[i] = NULL;
+        cache->lpoints[i] = NULL;
+    }
+    cache->nalloc = nalloc;
+}
+
+// The linearization key of a factor is the l_point of each of its
+// nodes, followed by their state if the factor's eval reads it:
+// xyt factors are evaluated at l_point only, but some (e.g., xytpos)
+// read state. Factor types we don't know about are assumed to read
+// both.
+static int key_has_state(const april_graph_factor_t *factor)
+{
+    return factor->type != APRIL_GRAPH_FACTOR_XYT_TYPE;
+}
+
+static int lpoint_key_length(april_graph_factor_t *factor, april_graph_t *graph)
+{
+    int len = 0;
+    for (int i = 0; i < factor->nnodes; i++) {
+        april_graph_node_t *node;
+        zarray_get(graph->nodes, factor->nodes[i], &node);
+        len += node->length;
+    }
+    return key_has_state(factor) ? 2 * len : len;
+}
+
+static int lpoint_key_matches(april_graph_factor_t *factor, april_graph_t *graph, const double *key)
+{
+    int state = key_has_state(factor);
+    int pos = 0;
+    for (int i = 0; i < factor->nnodes; i++) {
+        april_graph_node_t *node;
+        zarray_get(graph->nodes, factor->nodes[i], &node);
+        if (memcmp(&key[pos], node->l_point, node->length * sizeof(double)))
+            return 0;
+        pos += node->length;
+        if (!state)
+            continue;
+        if (memcmp(&key[pos], node->state, node->length * sizeof(double)))
+            return 0;
+        pos += node->length;
+    }
+    return 1;
+}
+
+static void lpoint_key_store(april_graph_factor_t *factor, april_graph_t *graph, double *key)
+{
+    int state = key_has_state(factor);
+    int pos = 0;
+    for (int i = 0; i < factor->nnodes; i++) {
+        april_graph_node_t *node;
+        zarray_get(graph->nodes, factor->nodes[i], &node);
+        memcpy(&key[pos], node->l_point, node->length * sizeof(double));
+        pos += node->length;
+        if (!state)
+            continue;
+        memcpy(&key[pos], node->state, node->length * sizeof(double));
+        pos += node->length;
+    }
+}
+
+// Empty slot 'fidx', which must exist.
+static void slot_clear(april_graph_eval_cache_t *cache, int fidx)
+{
+    if (cache->evals[fidx])
+        april_graph_factor_eval_destroy(cache->evals[fidx]);
+    free(cache->lpoints[fidx]);
+    cache->evals[fidx] = NULL;
+    cache->lpoints[fidx] = NULL;
+    cache->factors[fidx] = NULL;
+}
+
+void april_graph_eval_cache_invalidate(april_graph_eval_cache_t *cache, int fidx)
+{
+    if (fidx < cache->nfactors)
+        slot_clear(cache, fidx);
+}
+
+// Bring slot 'fidx', which must exist, up to date. Touches nothing
+// but the slot (and the counters passed in), so different slots can
+// be updated concurrently.
+static april_graph_factor_eval_t *slot_update(april_graph_eval_cache_t *cache, april_graph_t *graph, int fidx,
+                                              int64_t *nevals, int64_t *nhits)
+{
+    april_graph_factor_t *factor;
+    zarray_get(graph->factors, fidx, &factor);
+
+    // a different factor now lives at this index (e.g., the caller
+    // switched graphs); its eval can not be recycled.
+    if (cache->factors[fidx] != factor) {
+        slot_clear(cache, fidx);
+        cache->factors[fidx] = factor;
+    }
+
+    if (cache->evals[fidx] && lpoint_key_matches(factor, graph, cache->lpoints[fidx])) {
+        (*nhits)++;
+        return cache->evals[fidx];
+    }
+
+    if (cache->lpoints[fidx] == NULL)
+        cache->lpoints[fidx] = malloc(lpoint_key_length(factor, graph) * sizeof(double));
+
+    cache->evals[fidx] = factor->eval(factor, graph, cache->evals[fidx]);
+    lpoint_key_store(factor, graph, cache->lpoints[fidx]);
+    (*nevals)++;
+
+    return cache->evals[fidx];
+}
+
+april_graph_factor_eval_t *april_graph_eval_cache_get(april_graph_eval_cache_t *cache, april_graph_t *graph, int fidx)
+{
+    if (fidx >= cache->nfactors) {
+        april_graph_eval_cache_reserve(cache, fidx + 1);
+        cache->nfactors = fidx + 1;
+    }
+
+    return slot_update(cache, graph, fidx, &cache->nevals, &cache->nhits);
+}
+
+struct update_task
+{
+    april_graph_eval_cache_t *cache;
+    april_graph_t *graph;
+};
+
+static void update_range(void *arg, int i0, int i1)
+{
+    struct update_task *task = arg;
+    int64_t nevals = 0, nhits = 0;
+
+    for (int i = i0; i < i1; i++)
+        slot_update(task->cache, task->graph, i, &nevals, &nhits);
+
+    __atomic_add_fetch(&task->cache->nevals, nevals, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&task->cache->nhits, nhits, __ATOMIC_RELAXED);
+}
+
+void april_graph_eval_cache_update(april_graph_eval_cache_t *cache, april_graph_t *graph, taskpool_t *tp)
+{
+    int nfactors = zarray_size(graph->factors);
+    if (nfactors > cache->nfactors) {
+        april_graph_eval_cache_reserve(cache, nfactors);
+        cache->nfactors = nfactors;
+    }
+
+    struct update_task task = { .cache = cache, .graph = graph };
+    taskpool_parallel_for(tp, 0, nfactors, 0, update_range, &task);
+}
+
+april_graph_factor_eval_t *april_graph_eval_cache_peek(const april_graph_eval_cache_t *cache, april_graph_t *graph, int fidx)
+{
+    april_graph_factor_t *factor;
+    zarray_get(graph->factors, fidx, &factor);
+
+    if (fidx < cache->nfactors && cache->factors[fidx] == factor && cache->evals[fidx] &&
+        lpoint_key_matches(factor, graph, cache->lpoints[fidx]))
+        return cache->evals[fidx];
+    return NULL;
+}
+
+april_graph_factor_eval_t *april_graph_eval_cache_get_scratch(april_graph_eval_cache_t *cache, april_graph_t *graph, int fidx)
+{
+    april_graph_factor_eval_t *eval = april_graph_eval_cache_peek(cache, graph, fidx);
+    if (eval) {
+        cache->nhits++;
+        return eval;
+    }
+
+    april_graph_factor_t *factor;
+    zarray_get(graph->factors, fidx, &factor);
+
+    int s = 0;
+    while (s < cache->nscratch && cache->scratch_types[s] != factor->type)
+        s++;
+
+    if (s == cache->nscratch) {
+        if (s == APRIL_GRAPH_EVAL_CACHE_NSCRATCH) {
+            // out of scratch entries: give up the last one. Its eval
+            // has a different layout, so it can't be recycled.
+            s--;
+            april_graph_factor_eval_destroy(cache->scratch[s]);
+        } else {
+            cache->nscratch++;
+        }
+        cache->scratch_types[s] = factor->type;
+        cache->scratch[s] = NULL;
+    }
+
+    cache->scratch[s] = factor->eval(factor, graph, cache->scratch[s]);
+    cache->nevals++;
+
+    return cache->scratch[s];
+}
+
+static size_t eval_memory(const april_graph_factor_eval_t *eval)
+{
+    if (!eval)
+        return 0;
+
+    size_t bytes = sizeof(april_graph_factor_eval_t);
+    bytes += eval->length * sizeof(double);
+    bytes += sizeof(matd_t) + eval->W->nrows * eval->W->ncols * sizeof(double);
+    for (int i = 0; eval->jacobians[i] != NULL; i++) {
+        matd_t *J = eval->jacobians[i];
+        bytes += sizeof(matd_t*) + sizeof(matd_t) + J->nrows * J->ncols * sizeof(double);
+    }
+    return bytes + sizeof(matd_t*); // NULL terminator
+}
+
+size_t april_graph_eval_cache_memory(const april_graph_eval_cache_t *cache)
+{
+    if (!cache)
+        return 0;
+
+    size_t bytes = sizeof(april_graph_eval_cache_t);
+    bytes += cache->nalloc * (sizeof(april_graph_factor_t*) + sizeof(april_graph_factor_eval_t*) + sizeof(double*));
+
+    for (int i = 0; i < cache->nfactors; i++) {
+        const april_graph_factor_eval_t *eval = cache->evals[i];
+        bytes += eval_memory(eval);
+        if (cache->lpoints[i]) {
+            // the key holds l_point (and maybe state) for each scalar
+            // of the factor's nodes, i.e. the Jacobians' columns.
+            int copies = key_has_state(cache->factors[i]) ? 2 : 1;
+            for (int j = 0; eval->jacobians[j] != NULL; j++)
+                bytes += copies * eval->jacobians[j]->ncols * sizeof(double);
+        }
+    }
+
+    for (int i = 0; i < cache->nscratch; i++)
+        bytes += eval_memory(cache->scratch[i]);
+
+    return bytes;
+}
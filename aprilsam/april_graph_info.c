@@ -0,0 +1,315 @@
+/* Copyright (C) 2013-2019, The Regents of The University of Michigan.
+All rights reserved.
+
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*$LICENSE*/
+
+#include <assert.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <string.h>
+
+#include "aprilsam.h"
+
+// Interned information matrices. Entries are allocated individually
+// so that pointers returned by april_graph_info_get() stay valid
+// while the table grows; indices of released entries are recycled.
+//
+// The table is shared by all graphs. Interning and freeing entries
+// take 'info_lock'; april_graph_info_get() doesn't, so the entries
+// live in chunks that never move once allocated. The directory of
+// chunks doubles when it is full; replaced directories are kept,
+// since a reader may still be looking at one.
+struct info_key
+{
+    int dim;
+    const double *data; // dim x dim, row-major
+};
+
+#define INFO_CHUNK_BITS 10
+#define INFO_CHUNK_SIZE (1 << INFO_CHUNK_BITS)
+
+static pthread_mutex_t info_lock = PTHREAD_MUTEX_INITIALIZER;
+static zhash_t *info_hash;           // struct info_key => int
+static april_graph_info_t ***info_chunks; // by index >> INFO_CHUNK_BITS
+static int info_nchunks;
+static zarray_t *retired_chunks;          // april_graph_info_t***
+static int ninfos;
+static zarray_t *free_idxs;
+static uint64_t next_serial = 1;
+
+static april_graph_info_t *info_at(int idx)
+{
+    assert(idx >= 0 && idx < __atomic_load_n(&ninfos, __ATOMIC_ACQUIRE));
+    april_graph_info_t ***chunks = __atomic_load_n(&info_chunks, __ATOMIC_ACQUIRE);
+    april_graph_info_t **chunk = __atomic_load_n(&chunks[idx >> INFO_CHUNK_BITS], __ATOMIC_ACQUIRE);
+    april_graph_info_t *info = __atomic_load_n(&chunk[idx & (INFO_CHUNK_SIZE - 1)], __ATOMIC_ACQUIRE);
+    assert(info);
+    return info;
+}
+
+// zhash stores keys unaligned, so they are copied out before use.
+static uint32_t info_hash_fn(const void *_a)
+{
+    struct info_key a_storage, *a = &a_storage;
+    memcpy(a, _a, sizeof(struct info_key));
+
+    // FNV-1a over the bytes of the (exact) dense matrix.
+    const uint8_t *p = (const uint8_t*) a->data;
+    int len = a->dim * a->dim * sizeof(double);
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static int info_equals_fn(const void *_a, const void *_b)
+{
+    struct info_key a_storage, *a = &a_storage, b_storage, *b = &b_storage;
+    memcpy(a, _a, sizeof(struct info_key));
+    memcpy(b, _b, sizeof(struct info_key));
+
+    if (a->dim != b->dim)
+        return 0;
+    return !memcmp(a->data, b->data, a->dim * a->dim * sizeof(double));
+}
+
+// Fill the packed upper triangles of Ws = (W + W')/2 and of R, where
+// Ws = R'*R if Ws is positive definite. Directions with no
+// information get a zero row in R, and then R'*R only approximates
+// Ws; info->whiten says whether R can stand in for W.
+static void info_factor(april_graph_info_t *info)
+{
+    int dim = info->dim;
+    const double *W = info->Wmat->data;
+
+    info->whiten = 1;
+    for (int i = 0; i < dim; i++) {
+        for (int j = i+1; j < dim; j++) {
+            if (W[i*dim+j] != W[j*dim+i])
+                info->whiten = 0;
+        }
+    }
+
+    for (int i = 0, pos = 0; i < dim; i++) {
+        for (int j = i; j < dim; j++, pos++)
+            info->W[pos] = 0.5 * (W[i*dim+j] + W[j*dim+i]);
+    }
+
+    // dense upper Cholesky on a scratch copy
+    double U[dim*dim];
+    for (int i = 0; i < dim; i++) {
+        for (int j = 0; j < dim; j++)
+            U[i*dim+j] = 0.5 * (W[i*dim+j] + W[j*dim+i]);
+    }
+
+    for (int i = 0; i < dim; i++) {
+        double d = U[i*dim+i];
+        for (int k = 0; k < i; k++)
+            d -= U[k*dim+i] * U[k*dim+i];
+
+        if (d <= 0) {
+            for (int j = i; j < dim; j++)
+                U[i*dim+j] = 0;
+            info->whiten = 0;
+            continue;
+        }
+
+        d = sqrt(d);
+        U[i*dim+i] = d;
+        for (int j = i+1; j < dim; j++) {
+            double v = U[i*dim+j];
+            for (int k = 0; k < i; k++)
+                v -= U[k*dim+i] * U[k*dim+j];
+            U[i*dim+j] = v / d;
+        }
+    }
+
+    for (int i = 0, pos = 0; i < dim; i++) {
+        for (int j = i; j < dim; j++, pos++)
+            info->R[pos] = U[i*dim+j];
+    }
+}
+
+// Double the chunk directory. Called with info_lock held.
+static void grow_chunks()
+{
+    int nchunks = info_nchunks ? 2 * info_nchunks : 16;
+    april_graph_info_t ***chunks = calloc(nchunks, sizeof(april_graph_info_t**));
+    if (info_chunks) {
+        memcpy(chunks, info_chunks, info_nchunks * sizeof(april_graph_info_t**));
+        zarray_add(retired_chunks, &info_chunks);
+    }
+    __atomic_store_n(&info_chunks, chunks, __ATOMIC_RELEASE);
+    info_nchunks = nchunks;
+}
+
+int april_graph_info_intern_data(int dim, const double *W)
+{
+    pthread_mutex_lock(&info_lock);
+
+    if (info_hash == NULL) {
+        info_hash = zhash_create(sizeof(struct info_key), sizeof(int), info_hash_fn, info_equals_fn);
+        free_idxs = zarray_create(sizeof(int));
+        retired_chunks = zarray_create(sizeof(april_graph_info_t***));
+    }
+
+    struct info_key key = { .dim = dim, .data = W };
+
+    int idx;
+    if (zhash_get(info_hash, &key, &idx)) {
+        __atomic_add_fetch(&info_at(idx)->refcnt, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&info_lock);
+        return idx;
+    }
+
+    if (zarray_size(free_idxs) > 0) {
+        zarray_get(free_idxs, zarray_size(free_idxs) - 1, &idx);
+        zarray_remove_index(free_idxs, zarray_size(free_idxs) - 1, 0);
+    } else {
+        idx = ninfos;
+        if (idx == INT_MAX) {
+            pthread_mutex_unlock(&info_lock);
+            return -1;
+        }
+        if ((idx >> INFO_CHUNK_BITS) == info_nchunks)
+            grow_chunks();
+        if (info_chunks[idx >> INFO_CHUNK_BITS] == NULL)
+            __atomic_store_n(&info_chunks[idx >> INFO_CHUNK_BITS],
+                             calloc(INFO_CHUNK_SIZE, sizeof(april_graph_info_t*)), __ATOMIC_RELEASE);
+    }
+
+    int npacked = dim*(dim+1)/2;
+    april_graph_info_t *info = calloc(1, sizeof(april_graph_info_t));
+    info->idx = idx;
+    info->dim = dim;
+    info->refcnt = 1;
+    info->serial = next_serial++;
+    info->W = calloc(npacked, sizeof(double));
+    info->R = calloc(npacked, sizeof(double));
+    info->Wmat = matd_create_data(dim, dim, W);
+    info_factor(info);
+
+    __atomic_store_n(&info_chunks[idx >> INFO_CHUNK_BITS][idx & (INFO_CHUNK_SIZE - 1)], info, __ATOMIC_RELEASE);
+    if (idx == ninfos)
+        __atomic_store_n(&ninfos, ninfos + 1, __ATOMIC_RELEASE);
+    key.data = info->Wmat->data;
+    zhash_put(info_hash, &key, &idx, NULL, NULL);
+
+    pthread_mutex_unlock(&info_lock);
+    return idx;
+}
+
+int april_graph_info_intern(const matd_t *W)
+{
+    assert(W->nrows == W->ncols);
+    return april_graph_info_intern_data(W->nrows, W->data);
+}
+
+void april_graph_info_retain(int idx)
+{
+    __atomic_add_fetch(&info_at(idx)->refcnt, 1, __ATOMIC_RELAXED);
+}
+
+void april_graph_info_release(int idx)
+{
+    april_graph_info_t *info = info_at(idx);
+
+    int refcnt = __atomic_load_n(&info->refcnt, __ATOMIC_RELAXED);
+    while (refcnt > 1) {
+        if (__atomic_compare_exchange_n(&info->refcnt, &refcnt, refcnt - 1, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            return;
+    }
+
+    // Probably the last reference. It only drops to zero under the
+    // lock, which april_graph_info_intern_data() holds to add one.
+    pthread_mutex_lock(&info_lock);
+    if (__atomic_sub_fetch(&info->refcnt, 1, __ATOMIC_ACQ_REL) > 0) {
+        pthread_mutex_unlock(&info_lock);
+        return;
+    }
+
+    struct info_key key = { .dim = info->dim, .data = info->Wmat->data };
+    zhash_remove(info_hash, &key, NULL, NULL);
+    __atomic_store_n(&info_chunks[idx >> INFO_CHUNK_BITS][idx & (INFO_CHUNK_SIZE - 1)], NULL, __ATOMIC_RELEASE);
+    zarray_add(free_idxs, &idx);
+    pthread_mutex_unlock(&info_lock);
+
+    matd_destroy(info->Wmat);
+    free(info->W);
+    free(info->R);
+    free(info);
+}
+
+const april_graph_info_t *april_graph_info_get(int idx)
+{
+    return info_at(idx);
+}
+
+int april_graph_info_count()
+{
+    pthread_mutex_lock(&info_lock);
+    int count = info_hash ? zhash_size(info_hash) : 0;
+    pthread_mutex_unlock(&info_lock);
+    return count;
+}
+
+void april_graph_info_whiten(const april_graph_info_t *info, const double *v, double *out)
+{
+    int dim = info->dim;
+    for (int i = 0, pos = 0; i < dim; i++) {
+        double acc = 0;
+        for (int j = i; j < dim; j++, pos++)
+            acc += info->R[pos] * v[j];
+        out[i] = acc;
+    }
+}
+
+double april_graph_info_chi2(const april_graph_info_t *info, const double *r)
+{
+    // chi^2 = r'*W*r, via X = W*r
+    int dim = info->dim;
+    const double *W = info->Wmat->data;
+
+    double chi2 = 0;
+    for (int i = 0; i < dim; i++) {
+        double X = 0;
+        for (int j = 0; j < dim; j++)
+            X += W[i*dim+j]*r[j];
+        chi2 += r[i]*X;
+    }
+    return chi2;
+}
+
+void april_graph_info_eval_W(april_graph_factor_eval_t *eval, int idx)
+{
+    const april_graph_info_t *info = info_at(idx);
+
+    eval->info = info;
+    if (eval->info_serial == info->serial)
+        return;
+
+    assert(eval->W->nrows == info->dim && eval->W->ncols == info->dim);
+    memcpy(eval->W->data, info->Wmat->data, info->dim * info->dim * sizeof(double));
+    eval->info_serial = info->serial;
+}
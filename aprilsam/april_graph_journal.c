@@ -0,0 +1,414 @@
+/* Copyright (C) 2013-2019, The Regents of The University of Michigan.
+All rights reserved.
+
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*$LICENSE*/
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "aprilsam.h"
+#include "./common/io_util.h"
+
+/** Graph journal, version 1.
+
+    header: u32 magic, u32 version
+    record: u8 type, length (encode_len), payload, u32 checksum
+
+    The checksum is Adler-32 over type, length and payload. A crash
+    can leave a partial record at the end of the file; reading stops
+    at the first record that doesn't check out, and opening the
+    journal for writing truncates it there.
+**/
+
+#define JOURNAL_MAGIC 0x4150524a  // "APRJ"
+#define JOURNAL_VERSION 1
+#define JOURNAL_HEADER_SIZE 8
+
+#define RECORD_NODE     1   // stype-encoded node, appended to graph->nodes
+#define RECORD_FACTOR   2   // stype-encoded factor, appended to graph->factors
+#define RECORD_STATE    3   // u32 node index, u32 length, length x f64
+#define RECORD_SNAPSHOT 4   // stype-encoded graph, replacing everything before it
+
+#define RECORD_OVERHEAD 9   // type, length, checksum; more for payloads >= 4GB
+
+// records are collected in memory and written once this much is pending.
+#define JOURNAL_BUFSIZE (64 * 1024)
+
+struct april_graph_journal
+{
+    char *path;
+    int fd;
+
+    uint8_t *buf;
+    size_t buflen, bufalloc;
+
+    // bytes at the start of buf that a failed flush already wrote.
+    size_t written;
+};
+
+static uint32_t adler32(const uint8_t *data, size_t len)
+{
+    uint32_t a = 1, b = 0;
+
+    while (len > 0) {
+        // largest n such that the sums can't overflow before the modulo.
+        size_t n = len < 5552 ? len : 5552;
+        len -= n;
+        while (n--) {
+            a += *data++;
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+    }
+
+    return (b << 16) | a;
+}
+
+// fsync() the directory that contains 'path'.
+static int sync_dir(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    char *dir = slash ? strndup(path, slash == path ? 1 : slash - path) : strdup(".");
+
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    free(dir);
+    if (fd < 0)
+        return -1;
+
+    int res = fsync(fd);
+    close(fd);
+    return res ? -1 : 0;
+}
+
+// Returns a pointer to 'len' payload bytes at the end of the buffer,
+// which the caller must fill before calling end_record().
+static uint8_t *begin_record(april_graph_journal_t *j, int type, uint64_t len)
+{
+    size_t need = j->buflen + 1 + encode_len_size(len) + len + 4;
+    if (need > j->bufalloc) {
+        while (j->bufalloc < need)
+            j->bufalloc *= 2;
+        j->buf = realloc(j->buf, j->bufalloc);
+    }
+
+    uint64_t pos = j->buflen;
+    encode_u8(j->buf, &pos, type);
+    encode_len(j->buf, &pos, len);
+    return &j->buf[pos];
+}
+
+// Returns zero on success. The record stays buffered if it couldn't
+// be written, and goes out with the next flush.
+static int end_record(april_graph_journal_t *j, uint64_t len)
+{
+    uint64_t hdrlen = 1 + encode_len_size(len);
+    uint64_t pos = j->buflen + hdrlen + len;
+    encode_u32(j->buf, &pos, adler32(&j->buf[j->buflen], hdrlen + len));
+    j->buflen = pos;
+
+    if (j->buflen >= JOURNAL_BUFSIZE)
+        return april_graph_journal_flush(j, 0);
+    return 0;
+}
+
+static int append_object(april_graph_journal_t *j, int type, const stype_t *stype, const void *obj)
+{
+    uint64_t len = 0;
+    stype_encode_object(NULL, &len, stype, obj);
+
+    uint8_t *payload = begin_record(j, type, len);
+    uint64_t pos = 0;
+    stype_encode_object(payload, &pos, stype, obj);
+    return end_record(j, len);
+}
+
+// Walks the records of a journal, applying them to *graph unless it
+// is NULL. Returns the length of the valid prefix of the file, or 0
+// if the header is wrong.
+static uint64_t journal_scan(const uint8_t *data, uint64_t datalen, april_graph_t **graph, int *nrecords)
+{
+    uint64_t pos = 0;
+    if (decode_u32(data, &pos, datalen) != JOURNAL_MAGIC ||
+        decode_u32(data, &pos, datalen) != JOURNAL_VERSION)
+        return 0;
+
+    *nrecords = 0;
+
+    while (pos + RECORD_OVERHEAD <= datalen) {
+        uint64_t rpos = pos;
+        int type = decode_u8(data, &rpos, datalen);
+        uint64_t len = decode_len(data, &rpos, datalen);
+        if (rpos + 4 > datalen || len > datalen - rpos - 4)
+            break;
+
+        uint64_t cpos = rpos + len;
+        if (decode_u32(data, &cpos, datalen) != adler32(&data[pos], rpos - pos + len))
+            break;
+
+        if (graph) {
+            uint64_t opos = 0;
+            const uint8_t *payload = &data[rpos];
+
+            switch (type) {
+                case RECORD_NODE: {
+                    april_graph_node_t *node = stype_decode_object(payload, &opos, len, NULL);
+                    if (node)
+                        zarray_add((*graph)->nodes, &node);
+                    break;
+                }
+                case RECORD_FACTOR: {
+                    april_graph_factor_t *factor = stype_decode_object(payload, &opos, len, NULL);
+                    if (factor)
+                        zarray_add((*graph)->factors, &factor);
+                    break;
+                }
+                case RECORD_STATE: {
+                    int idx = decode_u32(payload, &opos, len);
+                    int length = decode_u32(payload, &opos, len);
+                    if (idx >= zarray_size((*graph)->nodes))
+                        break;
+                    april_graph_node_t *node;
+                    zarray_get((*graph)->nodes, idx, &node);
+                    for (int i = 0; i < length && i < node->length; i++)
+                        node->state[i] = decode_f64(payload, &opos, len);
+                    break;
+                }
+                case RECORD_SNAPSHOT: {
+                    april_graph_t *snapshot = stype_decode_object(payload, &opos, len, NULL);
+                    if (snapshot) {
+                        april_graph_destroy(*graph);
+                        *graph = snapshot;
+                    }
+                    break;
+                }
+                default:
+                    // from a newer version; skip it.
+                    break;
+            }
+        }
+
+        pos = cpos;
+        (*nrecords)++;
+    }
+
+    return pos;
+}
+
+april_graph_journal_t *april_graph_journal_open(const char *path)
+{
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        printf("april_graph_journal_open: can't open %s\n", path);
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st)) {
+        close(fd);
+        return NULL;
+    }
+
+    // a file shorter than the header is a journal whose creation was
+    // interrupted, and starts over.
+    uint64_t valid = 0;
+    if (st.st_size >= JOURNAL_HEADER_SIZE) {
+        uint8_t *data;
+        long datalen;
+        int nrecords;
+        if (ioutils_read_file(path, (void**) &data, &datalen, -1)) {
+            close(fd);
+            return NULL;
+        }
+        valid = journal_scan(data, datalen, NULL, &nrecords);
+        free(data);
+
+        if (valid == 0) {
+            printf("april_graph_journal_open: %s is not a graph journal\n", path);
+            close(fd);
+            return NULL;
+        }
+    }
+
+    // drop a partial record left by a crash.
+    if (valid < (uint64_t) st.st_size && ftruncate(fd, valid)) {
+        close(fd);
+        return NULL;
+    }
+    lseek(fd, valid, SEEK_SET);
+
+    april_graph_journal_t *j = calloc(1, sizeof(april_graph_journal_t));
+    j->path = strdup(path);
+    j->fd = fd;
+    j->bufalloc = JOURNAL_BUFSIZE + 1024;
+    j->buf = malloc(j->bufalloc);
+
+    if (valid == 0) {
+        uint64_t pos = 0;
+        encode_u32(j->buf, &pos, JOURNAL_MAGIC);
+        encode_u32(j->buf, &pos, JOURNAL_VERSION);
+        j->buflen = pos;
+    }
+
+    return j;
+}
+
+int april_graph_journal_add_node(april_graph_journal_t *j, const april_graph_node_t *node)
+{
+    return append_object(j, RECORD_NODE, node->stype, node);
+}
+
+int april_graph_journal_add_factor(april_graph_journal_t *j, const april_graph_factor_t *factor)
+{
+    return append_object(j, RECORD_FACTOR, factor->stype, factor);
+}
+
+int april_graph_journal_update_state(april_graph_journal_t *j, const april_graph_node_t *node, int idx)
+{
+    uint64_t len = 8 + 8 * node->length;
+    uint8_t *payload = begin_record(j, RECORD_STATE, len);
+
+    uint64_t pos = 0;
+    encode_u32(payload, &pos, idx);
+    encode_u32(payload, &pos, node->length);
+    for (int i = 0; i < node->length; i++)
+        encode_f64(payload, &pos, node->state[i]);
+
+    return end_record(j, len);
+}
+
+int april_graph_journal_flush(april_graph_journal_t *j, int sync)
+{
+    // after a short write, pick up where it stopped rather than
+    // writing the start of the buffer a second time.
+    while (j->written < j->buflen) {
+        ssize_t res = write(j->fd, &j->buf[j->written], j->buflen - j->written);
+        if (res < 0 && errno == EINTR)
+            continue;
+        if (res <= 0)
+            return -1;
+        j->written += res;
+    }
+    j->buflen = 0;
+    j->written = 0;
+
+    if (sync && fdatasync(j->fd))
+        return -1;
+
+    return 0;
+}
+
+int april_graph_journal_compact(april_graph_journal_t *j, april_graph_t *graph)
+{
+    // The snapshot goes into a new journal, which atomically replaces
+    // the old one: a crash leaves one or the other, never a mix.
+    char *tmp = sprintf_alloc("%s.tmp", j->path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        free(tmp);
+        return -1;
+    }
+
+    // Records still in the buffer are covered by the snapshot, but
+    // if the snapshot can't be put in place, the old journal needs
+    // them; write them out first. A large snapshot is written out
+    // while it is being added, so the new file has to be in place
+    // before it is.
+    if (april_graph_journal_flush(j, 0)) {
+        close(fd);
+        unlink(tmp);
+        free(tmp);
+        return -1;
+    }
+
+    int oldfd = j->fd;
+    j->fd = fd;
+
+    uint64_t pos = 0;
+    encode_u32(j->buf, &pos, JOURNAL_MAGIC);
+    encode_u32(j->buf, &pos, JOURNAL_VERSION);
+    j->buflen = pos;
+
+    if (append_object(j, RECORD_SNAPSHOT, graph->stype, graph) ||
+        april_graph_journal_flush(j, 1) || rename(tmp, j->path)) {
+        // keep appending to the old journal.
+        j->fd = oldfd;
+        j->buflen = 0;
+        j->written = 0;
+        close(fd);
+        unlink(tmp);
+        free(tmp);
+        return -1;
+    }
+
+    close(oldfd);
+    free(tmp);
+
+    // the rename itself is only durable once the directory is synced.
+    return sync_dir(j->path);
+}
+
+void april_graph_journal_close(april_graph_journal_t *j)
+{
+    if (!j)
+        return;
+
+    april_graph_journal_flush(j, 1);
+    close(j->fd);
+    free(j->buf);
+    free(j->path);
+    free(j);
+}
+
+april_graph_t *april_graph_journal_replay(const char *path, int *nrecords)
+{
+    uint8_t *data;
+    long datalen;
+
+    if (ioutils_read_file(path, (void**) &data, &datalen, -1)) {
+        printf("april_graph_journal_replay: can't read %s\n", path);
+        return NULL;
+    }
+
+    april_graph_t *graph = april_graph_create();
+    int n = 0;
+    uint64_t valid = journal_scan(data, datalen, &graph, &n);
+    free(data);
+
+    if (valid == 0) {
+        printf("april_graph_journal_replay: %s is not a graph journal\n", path);
+        april_graph_destroy(graph);
+        return NULL;
+    }
+
+    if (valid < (uint64_t) datalen)
+        printf("april_graph_journal_replay: ignoring %"PRIu64" bytes of incomplete records at the end of %s\n",
+               (uint64_t) datalen - valid, path);
+
+    if (nrecords)
+        *nrecords = n;
+    return graph;
+}
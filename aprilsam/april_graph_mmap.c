@@ -0,0 +1,531 @@
+/* Copyright (C) 2013-2019, The Regents of The University of Michigan.
+All rights reserved.
+
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*$LICENSE*/
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "aprilsam.h"
+
+/** Columnar graph file, version 1.
+
+    header | section table | sections
+
+    All integers and doubles are stored in host byte order; the
+    header records it so that a file from a host of the other
+    endianness is rejected instead of misread. Every section starts at
+    a multiple of 8 bytes, so the doubles in a mapped file are aligned
+    and can be used in place.
+**/
+
+#define COLUMNAR_MAGIC "APRGRAPH"
+#define COLUMNAR_VERSION 1
+#define COLUMNAR_BYTE_ORDER 0x01020304
+
+// one entry per node
+#define SECTION_NODE_TYPE     1   // int32
+#define SECTION_NODE_FLAGS    2   // uint8, see NODE_HAS_*
+#define SECTION_NODE_STATE    3   // 3 x double
+#define SECTION_NODE_INIT     4   // 3 x double, zero if absent
+#define SECTION_NODE_TRUTH    5   // 3 x double, zero if absent
+
+// one entry per factor
+#define SECTION_FACTOR_TYPE   6   // int32
+#define SECTION_FACTOR_FLAGS  7   // uint8, see FACTOR_HAS_*
+#define SECTION_FACTOR_NODES  8   // 2 x int32; unused endpoints are -1
+#define SECTION_FACTOR_Z      9   // 3 x double
+#define SECTION_FACTOR_ZTRUTH 10  // 3 x double, zero if absent
+#define SECTION_FACTOR_INFO   11  // int32, index into SECTION_INFO
+
+#define SECTION_INFO          12  // 9 x double per distinct W
+#define SECTION_ATTR          13  // optional, see encode_attrs()
+#define NSECTIONS             13
+
+#define NODE_HAS_INIT    1
+#define NODE_HAS_TRUTH   2
+#define FACTOR_HAS_ZTRUTH 1
+
+#define ATTR_GRAPH  0
+#define ATTR_NODE   1
+#define ATTR_FACTOR 2
+
+struct columnar_header
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t nnodes;
+    uint64_t nfactors;
+    uint64_t ninfos;
+    uint32_t nsections;
+    uint32_t reserved;
+};
+
+struct columnar_section
+{
+    uint32_t id;
+    uint32_t reserved;
+    uint64_t offset;
+    uint64_t size;
+};
+
+static uint64_t align8(uint64_t v)
+{
+    return (v + 7) & ~((uint64_t) 7);
+}
+
+// The attribute section is a sequence of records:
+//   u8 kind (ATTR_*), u32 index, stype-encoded april_graph_attr_t
+// with one record for the graph and for each node and factor that
+// has attributes. Returns the size; data can be NULL.
+static uint64_t encode_attrs(april_graph_t *graph, uint8_t *data)
+{
+    uint64_t pos = 0;
+
+    if (graph->attr) {
+        encode_u8(data, &pos, ATTR_GRAPH);
+        encode_u32(data, &pos, 0);
+        stype_encode_object(data, &pos, graph->attr->stype, graph->attr);
+    }
+
+    for (int i = 0; i < zarray_size(graph->nodes); i++) {
+        april_graph_node_t *node;
+        zarray_get(graph->nodes, i, &node);
+        if (node->attr) {
+            encode_u8(data, &pos, ATTR_NODE);
+            encode_u32(data, &pos, i);
+            stype_encode_object(data, &pos, node->attr->stype, node->attr);
+        }
+    }
+
+    for (int i = 0; i < zarray_size(graph->factors); i++) {
+        april_graph_factor_t *factor;
+        zarray_get(graph->factors, i, &factor);
+        if (factor->attr) {
+            encode_u8(data, &pos, ATTR_FACTOR);
+            encode_u32(data, &pos, i);
+            stype_encode_object(data, &pos, factor->attr->stype, factor->attr);
+        }
+    }
+
+    return pos;
+}
+
+static int write_padded(FILE *f, const void *data, uint64_t size)
+{
+    static const uint8_t zeros[8];
+
+    if (size && fwrite(data, 1, size, f) != size)
+        return -1;
+    if (align8(size) != size && fwrite(zeros, 1, align8(size) - size, f) != align8(size) - size)
+        return -1;
+    return 0;
+}
+
+int april_graph_save_columnar(april_graph_t *graph, const char *path)
+{
+    size_t nnodes = zarray_size(graph->nodes);
+    size_t nfactors = zarray_size(graph->factors);
+
+    for (int i = 0; i < nnodes; i++) {
+        april_graph_node_t *node;
+        zarray_get(graph->nodes, i, &node);
+        if (node->type != APRIL_GRAPH_NODE_XYT_TYPE) {
+            printf("april_graph_save_columnar: unsupported node type %d\n", node->type);
+            return -1;
+        }
+    }
+
+    for (int i = 0; i < nfactors; i++) {
+        april_graph_factor_t *factor;
+        zarray_get(graph->factors, i, &factor);
+        if (factor->type != APRIL_GRAPH_FACTOR_XYT_TYPE && factor->type != APRIL_GRAPH_FACTOR_XYTPOS_TYPE) {
+            printf("april_graph_save_columnar: unsupported factor type %d\n", factor->type);
+            return -1;
+        }
+    }
+
+    int32_t *node_type = calloc(nnodes, sizeof(int32_t));
+    uint8_t *node_flags = calloc(nnodes, sizeof(uint8_t));
+    double *node_state = calloc(3 * nnodes, sizeof(double));
+    double *node_init = calloc(3 * nnodes, sizeof(double));
+    double *node_truth = calloc(3 * nnodes, sizeof(double));
+
+    for (int i = 0; i < nnodes; i++) {
+        april_graph_node_t *node;
+        zarray_get(graph->nodes, i, &node);
+        node_type[i] = node->type;
+        memcpy(&node_state[3*i], node->state, 3 * sizeof(double));
+        if (node->init) {
+            node_flags[i] |= NODE_HAS_INIT;
+            memcpy(&node_init[3*i], node->init, 3 * sizeof(double));
+        }
+        if (node->truth) {
+            node_flags[i] |= NODE_HAS_TRUTH;
+            memcpy(&node_truth[3*i], node->truth, 3 * sizeof(double));
+        }
+    }
+
+    int32_t *factor_type = calloc(nfactors, sizeof(int32_t));
+    uint8_t *factor_flags = calloc(nfactors, sizeof(uint8_t));
+    int32_t *factor_nodes = calloc(2 * nfactors, sizeof(int32_t));
+    double *factor_z = calloc(3 * nfactors, sizeof(double));
+    double *factor_ztruth = calloc(3 * nfactors, sizeof(double));
+    int32_t *factor_info = calloc(nfactors, sizeof(int32_t));
+
+    // information matrices are stored once each, in order of first use.
+    zhash_t *info_idxs = zhash_create(sizeof(uint32_t), sizeof(uint32_t), zhash_uint32_hash, zhash_uint32_equals);
+    zarray_t *infos = zarray_create(9 * sizeof(double));
+
+    for (int i = 0; i < nfactors; i++) {
+        april_graph_factor_t *factor;
+        zarray_get(graph->factors, i, &factor);
+
+        factor_type[i] = factor->type;
+        factor_nodes[2*i + 0] = factor->nodes[0];
+        factor_nodes[2*i + 1] = factor->nnodes > 1 ? factor->nodes[1] : -1;
+        memcpy(&factor_z[3*i], factor->u.common.z, 3 * sizeof(double));
+        if (factor->u.common.ztruth) {
+            factor_flags[i] |= FACTOR_HAS_ZTRUTH;
+            memcpy(&factor_ztruth[3*i], factor->u.common.ztruth, 3 * sizeof(double));
+        }
+
+        uint32_t info = factor->u.common.info;
+        uint32_t idx;
+        if (!zhash_get(info_idxs, &info, &idx)) {
+            idx = zarray_size(infos);
+            zhash_put(info_idxs, &info, &idx, NULL, NULL);
+            zarray_add(infos, factor->u.common.W->data);
+        }
+        factor_info[i] = idx;
+    }
+
+    uint64_t attrlen = encode_attrs(graph, NULL);
+    uint8_t *attrs = NULL;
+    if (attrlen > 0) {
+        attrs = malloc(attrlen);
+        encode_attrs(graph, attrs);
+    }
+
+    const void *section_data[NSECTIONS + 1] = {
+        [SECTION_NODE_TYPE] = node_type,
+        [SECTION_NODE_FLAGS] = node_flags,
+        [SECTION_NODE_STATE] = node_state,
+        [SECTION_NODE_INIT] = node_init,
+        [SECTION_NODE_TRUTH] = node_truth,
+        [SECTION_FACTOR_TYPE] = factor_type,
+        [SECTION_FACTOR_FLAGS] = factor_flags,
+        [SECTION_FACTOR_NODES] = factor_nodes,
+        [SECTION_FACTOR_Z] = factor_z,
+        [SECTION_FACTOR_ZTRUTH] = factor_ztruth,
+        [SECTION_FACTOR_INFO] = factor_info,
+        [SECTION_INFO] = infos->data,
+        [SECTION_ATTR] = attrs,
+    };
+
+    uint64_t section_size[NSECTIONS + 1] = {
+        [SECTION_NODE_TYPE] = nnodes * sizeof(int32_t),
+        [SECTION_NODE_FLAGS] = nnodes * sizeof(uint8_t),
+        [SECTION_NODE_STATE] = 3 * nnodes * sizeof(double),
+        [SECTION_NODE_INIT] = 3 * nnodes * sizeof(double),
+        [SECTION_NODE_TRUTH] = 3 * nnodes * sizeof(double),
+        [SECTION_FACTOR_TYPE] = nfactors * sizeof(int32_t),
+        [SECTION_FACTOR_FLAGS] = nfactors * sizeof(uint8_t),
+        [SECTION_FACTOR_NODES] = 2 * nfactors * sizeof(int32_t),
+        [SECTION_FACTOR_Z] = 3 * nfactors * sizeof(double),
+        [SECTION_FACTOR_ZTRUTH] = 3 * nfactors * sizeof(double),
+        [SECTION_FACTOR_INFO] = nfactors * sizeof(int32_t),
+        [SECTION_INFO] = zarray_size(infos) * 9 * sizeof(double),
+        [SECTION_ATTR] = attrlen,
+    };
+
+    struct columnar_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, COLUMNAR_MAGIC, sizeof(header.magic));
+    header.version = COLUMNAR_VERSION;
+    header.byte_order = COLUMNAR_BYTE_ORDER;
+    header.nnodes = nnodes;
+    header.nfactors = nfactors;
+    header.ninfos = zarray_size(infos);
+    header.nsections = NSECTIONS;
+
+    struct columnar_section sections[NSECTIONS];
+    uint64_t offset = align8(sizeof(header) + sizeof(sections));
+    for (int i = 0; i < NSECTIONS; i++) {
+        sections[i].id = i + 1;
+        sections[i].reserved = 0;
+        sections[i].offset = offset;
+        sections[i].size = section_size[i + 1];
+        offset += align8(sections[i].size);
+    }
+
+    int ret = -1;
+    FILE *f = fopen(path, "wb");
+    if (f == NULL)
+        goto cleanup;
+
+    if (write_padded(f, &header, sizeof(header)) ||
+        write_padded(f, sections, sizeof(sections)))
+        goto cleanup;
+
+    for (int i = 0; i < NSECTIONS; i++) {
+        if (write_padded(f, section_data[i + 1], sections[i].size))
+            goto cleanup;
+    }
+
+    ret = 0;
+
+  cleanup:
+    if (f && fclose(f))
+        ret = -1;
+
+    free(node_type);
+    free(node_flags);
+    free(node_state);
+    free(node_init);
+    free(node_truth);
+    free(factor_type);
+    free(factor_flags);
+    free(factor_nodes);
+    free(factor_z);
+    free(factor_ztruth);
+    free(factor_info);
+    free(attrs);
+    zhash_destroy(info_idxs);
+    zarray_destroy(infos);
+
+    return ret;
+}
+
+// returns a pointer to section 'id' if it exists and holds exactly
+// 'size' bytes, NULL otherwise.
+static void *find_section(april_graph_mmap_t *gm, const struct columnar_section *sections, int nsections,
+                          uint32_t id, uint64_t size)
+{
+    for (int i = 0; i < nsections; i++) {
+        if (sections[i].id != id)
+            continue;
+        if (sections[i].size != size || sections[i].offset % 8 ||
+            sections[i].offset > gm->size || sections[i].size > gm->size - sections[i].offset)
+            return NULL;
+        return (uint8_t*) gm->base + sections[i].offset;
+    }
+    return NULL;
+}
+
+static int decode_attrs(april_graph_mmap_t *gm, const uint8_t *data, uint64_t datalen)
+{
+    uint64_t pos = 0;
+
+    while (pos < datalen) {
+        int kind = decode_u8(data, &pos, datalen);
+        uint32_t idx = decode_u32(data, &pos, datalen);
+        april_graph_attr_t *attr = stype_decode_object(data, &pos, datalen, NULL);
+
+        april_graph_attr_t **dest = NULL;
+        if (kind == ATTR_GRAPH)
+            dest = &gm->graph->attr;
+        else if (kind == ATTR_NODE && idx < gm->nnodes)
+            dest = &gm->nodes[idx].attr;
+        else if (kind == ATTR_FACTOR && idx < gm->nfactors)
+            dest = &gm->factors[idx].attr;
+
+        if (dest == NULL) {
+            april_graph_attr_destroy(attr);
+            return -1;
+        }
+        april_graph_attr_destroy(*dest);
+        *dest = attr;
+    }
+
+    return 0;
+}
+
+april_graph_mmap_t *april_graph_mmap_open(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size < (off_t) sizeof(struct columnar_header)) {
+        close(fd);
+        return NULL;
+    }
+
+    // Private, writable pages: the solver updates node states in
+    // place, and those writes must never reach the file.
+    void *base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return NULL;
+
+    april_graph_mmap_t *gm = calloc(1, sizeof(april_graph_mmap_t));
+    gm->base = base;
+    gm->size = st.st_size;
+
+    const struct columnar_header *header = base;
+    // not an error worth reporting: callers may fall back to other formats.
+    if (memcmp(header->magic, COLUMNAR_MAGIC, sizeof(header->magic)))
+        goto fail;
+    if (header->byte_order != COLUMNAR_BYTE_ORDER) {
+        printf("april_graph_mmap_open: %s was written with a different byte order\n", path);
+        goto fail;
+    }
+    if (header->version != COLUMNAR_VERSION) {
+        printf("april_graph_mmap_open: %s has unsupported version %u\n", path, header->version);
+        goto fail;
+    }
+    if (header->nnodes > INT_MAX || header->nfactors > INT_MAX || header->ninfos > INT_MAX ||
+        header->nsections > (gm->size - sizeof(*header)) / sizeof(struct columnar_section))
+        goto fail;
+
+    gm->nnodes = header->nnodes;
+    gm->nfactors = header->nfactors;
+    int ninfos = header->ninfos;
+    int nsections = header->nsections;
+    const struct columnar_section *sections = (const void*) (header + 1);
+
+    int32_t *node_type = find_section(gm, sections, nsections, SECTION_NODE_TYPE, gm->nnodes * sizeof(int32_t));
+    uint8_t *node_flags = find_section(gm, sections, nsections, SECTION_NODE_FLAGS, gm->nnodes * sizeof(uint8_t));
+    double *node_state = find_section(gm, sections, nsections, SECTION_NODE_STATE, 3 * gm->nnodes * sizeof(double));
+    double *node_init = find_section(gm, sections, nsections, SECTION_NODE_INIT, 3 * gm->nnodes * sizeof(double));
+    double *node_truth = find_section(gm, sections, nsections, SECTION_NODE_TRUTH, 3 * gm->nnodes * sizeof(double));
+    int32_t *factor_type = find_section(gm, sections, nsections, SECTION_FACTOR_TYPE, gm->nfactors * sizeof(int32_t));
+    uint8_t *factor_flags = find_section(gm, sections, nsections, SECTION_FACTOR_FLAGS, gm->nfactors * sizeof(uint8_t));
+    int32_t *factor_nodes = find_section(gm, sections, nsections, SECTION_FACTOR_NODES, 2 * gm->nfactors * sizeof(int32_t));
+    double *factor_z = find_section(gm, sections, nsections, SECTION_FACTOR_Z, 3 * gm->nfactors * sizeof(double));
+    double *factor_ztruth = find_section(gm, sections, nsections, SECTION_FACTOR_ZTRUTH, 3 * gm->nfactors * sizeof(double));
+    int32_t *factor_info = find_section(gm, sections, nsections, SECTION_FACTOR_INFO, gm->nfactors * sizeof(int32_t));
+    double *info = find_section(gm, sections, nsections, SECTION_INFO, ninfos * 9 * sizeof(double));
+
+    // empty columns of an empty graph map to the start of the data,
+    // which is fine as nothing will read them.
+    if (!node_type || !node_flags || !node_state || !node_init || !node_truth ||
+        !factor_type || !factor_flags || !factor_nodes || !factor_z || !factor_ztruth ||
+        !factor_info || !info) {
+        printf("april_graph_mmap_open: %s is missing sections or is truncated\n", path);
+        goto fail;
+    }
+
+    for (int i = 0; i < gm->nnodes; i++) {
+        if (node_type[i] != APRIL_GRAPH_NODE_XYT_TYPE)
+            goto fail;
+    }
+
+    for (int i = 0; i < gm->nfactors; i++) {
+        int a = factor_nodes[2*i + 0], b = factor_nodes[2*i + 1];
+        if (factor_info[i] < 0 || factor_info[i] >= ninfos || a < 0 || a >= gm->nnodes)
+            goto fail;
+        if (factor_type[i] == APRIL_GRAPH_FACTOR_XYT_TYPE) {
+            if (b < 0 || b >= gm->nnodes)
+                goto fail;
+        } else if (factor_type[i] != APRIL_GRAPH_FACTOR_XYTPOS_TYPE) {
+            goto fail;
+        }
+    }
+
+    // Only the linearization point and the last delta, which start
+    // out as a copy of the state and zero, live on the heap.
+    gm->nodes = calloc(gm->nnodes, sizeof(april_graph_node_t));
+    gm->lin = calloc(6 * (size_t) gm->nnodes, sizeof(double));
+    for (int i = 0; i < gm->nnodes; i++) {
+        double *l_point = &gm->lin[6*i];
+        double *delta_X = &gm->lin[6*i + 3];
+        memcpy(l_point, &node_state[3*i], 3 * sizeof(double));
+        april_graph_node_xyt_init_mapped(&gm->nodes[i], &node_state[3*i],
+                                         (node_flags[i] & NODE_HAS_INIT) ? &node_init[3*i] : NULL,
+                                         (node_flags[i] & NODE_HAS_TRUTH) ? &node_truth[3*i] : NULL,
+                                         l_point, delta_X);
+    }
+
+    int *info_idxs = calloc(ninfos, sizeof(int));
+    for (int i = 0; i < ninfos; i++)
+        info_idxs[i] = april_graph_info_intern_data(3, &info[9*i]);
+
+    gm->factors = calloc(gm->nfactors, sizeof(april_graph_factor_t));
+    for (int i = 0; i < gm->nfactors; i++) {
+        int idx = info_idxs[factor_info[i]];
+        double *ztruth = (factor_flags[i] & FACTOR_HAS_ZTRUTH) ? &factor_ztruth[3*i] : NULL;
+        april_graph_info_retain(idx);
+        if (factor_type[i] == APRIL_GRAPH_FACTOR_XYT_TYPE)
+            april_graph_factor_xyt_init_mapped(&gm->factors[i], &factor_nodes[2*i], &factor_z[3*i], ztruth, idx);
+        else
+            april_graph_factor_xytpos_init_mapped(&gm->factors[i], &factor_nodes[2*i], &factor_z[3*i], ztruth, idx);
+    }
+
+    // the factors hold their own references now.
+    for (int i = 0; i < ninfos; i++)
+        april_graph_info_release(info_idxs[i]);
+    free(info_idxs);
+
+    gm->graph = april_graph_create();
+    zarray_ensure_capacity(gm->graph->nodes, gm->nnodes);
+    for (int i = 0; i < gm->nnodes; i++) {
+        april_graph_node_t *node = &gm->nodes[i];
+        zarray_add(gm->graph->nodes, &node);
+    }
+    zarray_ensure_capacity(gm->graph->factors, gm->nfactors);
+    for (int i = 0; i < gm->nfactors; i++) {
+        april_graph_factor_t *factor = &gm->factors[i];
+        zarray_add(gm->graph->factors, &factor);
+    }
+
+    // attributes are small and rare; they are decoded onto the heap.
+    for (int i = 0; i < nsections; i++) {
+        if (sections[i].id == SECTION_ATTR && sections[i].size > 0) {
+            const uint8_t *attrs = find_section(gm, sections, nsections, SECTION_ATTR, sections[i].size);
+            if (!attrs || decode_attrs(gm, attrs, sections[i].size)) {
+                printf("april_graph_mmap_open: %s has a corrupt attribute section\n", path);
+                goto fail;
+            }
+        }
+    }
+
+    return gm;
+
+  fail:
+    april_graph_mmap_close(gm);
+    return NULL;
+}
+
+void april_graph_mmap_close(april_graph_mmap_t *gm)
+{
+    if (!gm)
+        return;
+
+    // the mapped nodes and factors release only what they own (info
+    // references, attributes); the rest goes with the mapping.
+    if (gm->graph)
+        april_graph_destroy(gm->graph);
+    free(gm->nodes);
+    free(gm->factors);
+    free(gm->lin);
+    munmap(gm->base, gm->size);
+    free(gm);
+}
@@ -0,0 +1,675 @@
+/* Copyright (C) 2013-2019, The Regents of The University of Michigan.
+All rights reserved.
+
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*$LICENSE*/
+
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "aprilsam.h"
+#include "common/time_util.h"
+
+// A queued node or factor.
+struct item
+{
+    struct item *next;
+    int64_t utime;      // when it was queued
+    int idx;            // the node's index in the graph
+    april_graph_node_t *node;
+    april_graph_factor_t *factor;
+};
+
+struct april_graph_scheduler
+{
+    pthread_t *threads;
+    int nthreads;
+
+    // Threads with nothing to run wait for 'wake'. A producer that
+    // notifies a session claims one of the 'nidle' threads and posts,
+    // like a single optimizer's producers do, so that adding never
+    // takes a lock.
+    sem_t wake;
+    int nidle;
+
+    pthread_mutex_t lock;   // protects everything below, and the
+                            // 'running' and 'vruntime' of sessions
+    pthread_cond_t done;    // a step finished
+    zarray_t *sessions;     // april_graph_optimizer_t*
+    int64_t vclock;         // vruntime of the last session picked; never decreases
+    int stop;
+};
+
+struct april_graph_optimizer
+{
+    april_graph_t *graph;
+    april_graph_cholesky_param_t *param;
+    int capacity;
+
+    // An intrusive MPSC queue: a producer exchanges 'head' for its
+    // item and then links the previous head to it; the optimizer
+    // thread pops at 'tail'. 'stub' keeps the queue from running
+    // empty, so that producers never touch 'tail'.
+    struct item *head;
+    struct item *tail;
+    struct item stub;
+
+    int depth;              // queued, not drained yet
+    int next_idx;           // the index of the next node added
+    int64_t npushed;
+    int64_t nrejected;
+
+    // Drained items that can't join the graph yet: nodes after a
+    // node that is still in the queue, and factors on such nodes.
+    zarray_t *nodes;        // struct item*
+    zarray_t *factors;
+    zarray_t *batch;        // items added in the current step
+
+    void (*prepare)(april_graph_t *graph, int node0, int factor0, void *user);
+    void *prepare_user;
+
+    april_graph_estimates_t *estimates;
+
+    // Without a scheduler, a thread of our own.
+    pthread_t thread;
+    sem_t wake;
+    int idle;               // the thread is (about to be) waiting for 'wake'
+    int stop;
+
+    // With one, items were added since the last step started.
+    april_graph_scheduler_t *sched;
+    int notified;
+    int running;
+    int64_t vruntime;       // us spent in steps
+
+    int64_t ndrained;       // items taken off the queue
+
+    pthread_mutex_t lock;   // protects stats and nsettled
+    pthread_cond_t cond;    // broadcast after every step
+    april_graph_optimizer_stats_t stats;
+    double latency_sum;
+    int64_t nsettled;       // items solved or held back
+};
+
+static void queue_push(april_graph_optimizer_t *opt, struct item *item)
+{
+    __atomic_store_n(&item->next, NULL, __ATOMIC_RELAXED);
+    struct item *prev = __atomic_exchange_n(&opt->head, item, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, item, __ATOMIC_RELEASE);
+}
+
+// Returns NULL if the queue is empty, or if the next item's producer
+// hasn't linked it yet.
+static struct item *queue_pop(april_graph_optimizer_t *opt)
+{
+    struct item *tail = opt->tail;
+    struct item *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+    if (tail == &opt->stub) {
+        if (next == NULL)
+            return NULL;
+        opt->tail = next;
+        tail = next;
+        next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+    }
+
+    if (next) {
+        opt->tail = next;
+        return tail;
+    }
+
+    // 'tail' is the last item; put the stub behind it so that it can
+    // be taken.
+    if (tail != __atomic_load_n(&opt->head, __ATOMIC_ACQUIRE))
+        return NULL;
+    queue_push(opt, &opt->stub);
+
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (next) {
+        opt->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+// Takes one of the scheduler's idle threads, which the caller then
+// wakes. Returns 0 if none is idle.
+static int claim_idle(april_graph_scheduler_t *sched)
+{
+    int nidle = __atomic_load_n(&sched->nidle, __ATOMIC_SEQ_CST);
+    while (nidle > 0) {
+        if (__atomic_compare_exchange_n(&sched->nidle, &nidle, nidle - 1, 1,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+            return 1;
+    }
+    return 0;
+}
+
+static int push_item(april_graph_optimizer_t *opt, struct item *item)
+{
+    // Counted before it is queued: every item ahead of it in the queue
+    // is counted then too, which april_graph_optimizer_flush() needs.
+    __atomic_add_fetch(&opt->npushed, 1, __ATOMIC_SEQ_CST);
+    queue_push(opt, item);
+
+    april_graph_scheduler_t *sched = opt->sched;
+    if (sched) {
+        if (!__atomic_exchange_n(&opt->notified, 1, __ATOMIC_SEQ_CST) && claim_idle(sched))
+            sem_post(&sched->wake);
+    } else if (__atomic_exchange_n(&opt->idle, 0, __ATOMIC_SEQ_CST)) {
+        sem_post(&opt->wake);
+    }
+    return 0;
+}
+
+// Takes a slot in the queue, unless it is full.
+static int reserve_slot(april_graph_optimizer_t *opt)
+{
+    // a CAS, so that producers racing for the last slot can't both
+    // get it.
+    int depth = __atomic_load_n(&opt->depth, __ATOMIC_RELAXED);
+    do {
+        if (opt->capacity > 0 && depth >= opt->capacity) {
+            __atomic_add_fetch(&opt->nrejected, 1, __ATOMIC_RELAXED);
+            return -1;
+        }
+    } while (!__atomic_compare_exchange_n(&opt->depth, &depth, depth + 1, 1,
+                                          __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+    return 0;
+}
+
+int april_graph_optimizer_add_node(april_graph_optimizer_t *opt, april_graph_node_t *node)
+{
+    if (reserve_slot(opt))
+        return -1;
+
+    struct item *item = calloc(1, sizeof(struct item));
+    item->utime = utime_now();
+    item->node = node;
+    item->idx = __atomic_fetch_add(&opt->next_idx, 1, __ATOMIC_RELAXED);
+
+    push_item(opt, item);
+    return item->idx;
+}
+
+int april_graph_optimizer_add_factor(april_graph_optimizer_t *opt, april_graph_factor_t *factor)
+{
+    int nnodes = __atomic_load_n(&opt->next_idx, __ATOMIC_RELAXED);
+    for (int i = 0; i < factor->nnodes; i++) {
+        if (factor->nodes[i] < 0 || factor->nodes[i] >= nnodes)
+            return -1;
+    }
+
+    if (reserve_slot(opt))
+        return -1;
+
+    struct item *item = calloc(1, sizeof(struct item));
+    item->utime = utime_now();
+    item->idx = -1;
+    item->factor = factor;
+
+    return push_item(opt, item);
+}
+
+static int item_idx_compare(const void *_a, const void *_b)
+{
+    const struct item *a = *(struct item**) _a;
+    const struct item *b = *(struct item**) _b;
+    return a->idx - b->idx;
+}
+
+// Moves everything in the queue into the graph, as far as possible,
+// and records the items added in opt->batch.
+static int drain(april_graph_optimizer_t *opt)
+{
+    struct item *item;
+    int n = 0;
+    while ((item = queue_pop(opt)) != NULL) {
+        zarray_add(item->node ? opt->nodes : opt->factors, &item);
+        n++;
+    }
+    __atomic_sub_fetch(&opt->depth, n, __ATOMIC_SEQ_CST);
+    opt->ndrained += n;
+
+    april_graph_t *graph = opt->graph;
+    zarray_clear(opt->batch);
+
+    // Nodes join in index order; a gap is a node whose producer
+    // hasn't queued it yet. A node also waits for a factor on it, as
+    // it would make the system singular otherwise. 'ready' is the
+    // number of nodes that can join.
+    zarray_sort(opt->nodes, item_idx_compare);
+    int nnodes = zarray_size(graph->nodes);
+    int ready = 0;
+    while (ready < zarray_size(opt->nodes)) {
+        zarray_get(opt->nodes, ready, &item);
+        if (item->idx != nnodes + ready)
+            break;
+        ready++;
+    }
+
+    int *covered = calloc(ready + 1, sizeof(int));
+    while (ready > 0) {
+        memset(covered, 0, ready * sizeof(int));
+        for (int i = 0; i < zarray_size(opt->factors); i++) {
+            zarray_get(opt->factors, i, &item);
+            april_graph_factor_t *factor = item->factor;
+            int k = 0;
+            while (k < factor->nnodes && factor->nodes[k] < nnodes + ready)
+                k++;
+            if (k < factor->nnodes)
+                continue;
+            for (k = 0; k < factor->nnodes; k++) {
+                if (factor->nodes[k] >= nnodes)
+                    covered[factor->nodes[k] - nnodes] = 1;
+            }
+        }
+
+        int n = 0;
+        while (n < ready && covered[n])
+            n++;
+        if (n == ready)
+            break;
+        ready = n;
+    }
+    free(covered);
+
+    for (int i = 0; i < zarray_size(opt->nodes); i++) {
+        zarray_get(opt->nodes, i, &item);
+        if (i < ready) {
+            zarray_add(graph->nodes, &item->node);
+            zarray_add(opt->batch, &item);
+        } else {
+            zarray_set(opt->nodes, i - ready, &item, NULL);
+        }
+    }
+    opt->nodes->size -= ready;
+
+    int nleft = 0;
+    for (int i = 0; i < zarray_size(opt->factors); i++) {
+        zarray_get(opt->factors, i, &item);
+        int k = 0;
+        while (k < item->factor->nnodes && item->factor->nodes[k] < zarray_size(graph->nodes))
+            k++;
+        if (k == item->factor->nnodes) {
+            zarray_add(graph->factors, &item->factor);
+            zarray_add(opt->batch, &item);
+        } else {
+            zarray_set(opt->factors, nleft++, &item, NULL);
+        }
+    }
+    opt->factors->size = nleft;
+
+    return zarray_size(opt->batch);
+}
+
+static void step(april_graph_optimizer_t *opt, int node0, int factor0)
+{
+    int64_t utime0 = utime_now();
+    if (opt->prepare)
+        opt->prepare(opt->graph, node0, factor0, opt->prepare_user);
+    if (opt->param->chol)
+        april_graph_cholesky_inc(opt->graph, opt->param);
+    else
+        april_graph_cholesky(opt->graph, opt->param);
+    int64_t utime1 = utime_now();
+
+    // the items are solved once readers can see the result.
+    april_graph_estimates_publish(opt->estimates, opt->graph);
+    int64_t utime2 = utime_now();
+
+    int n = zarray_size(opt->batch);
+    double sum = 0, max = 0;
+    for (int i = 0; i < n; i++) {
+        struct item *item;
+        zarray_get(opt->batch, i, &item);
+        double latency = (utime2 - item->utime) / 1.0E3;
+        sum += latency;
+        if (latency > max)
+            max = latency;
+        free(item);
+    }
+    zarray_clear(opt->batch);
+
+    pthread_mutex_lock(&opt->lock);
+    april_graph_optimizer_stats_t *stats = &opt->stats;
+    stats->nsolved += n;
+    stats->nheld = zarray_size(opt->nodes) + zarray_size(opt->factors);
+    opt->nsettled = opt->ndrained;
+    stats->nsteps++;
+    stats->last_batch = n;
+    stats->step_time = (utime1 - utime0) / 1.0E3;
+    opt->latency_sum += sum;
+    stats->latency_mean = opt->latency_sum / stats->nsolved;
+    stats->latency_last = sum / n;
+    if (max > stats->latency_max)
+        stats->latency_max = max;
+    stats->busy_time += (utime1 - utime0) / 1.0E3;
+    pthread_cond_broadcast(&opt->cond);
+    pthread_mutex_unlock(&opt->lock);
+}
+
+// Adds what's queued and takes a step, if anything was added.
+static int run_once(april_graph_optimizer_t *opt)
+{
+    int node0 = zarray_size(opt->graph->nodes);
+    int factor0 = zarray_size(opt->graph->factors);
+    int64_t ndrained = opt->ndrained;
+
+    if (!drain(opt)) {
+        // everything drained is held back; that settles it for flush.
+        if (opt->ndrained != ndrained) {
+            pthread_mutex_lock(&opt->lock);
+            opt->stats.nheld = zarray_size(opt->nodes) + zarray_size(opt->factors);
+            opt->nsettled = opt->ndrained;
+            pthread_cond_broadcast(&opt->cond);
+            pthread_mutex_unlock(&opt->lock);
+        }
+        return 0;
+    }
+
+    step(opt, node0, factor0);
+    return 1;
+}
+
+static void *optimizer_main(void *arg)
+{
+    april_graph_optimizer_t *opt = arg;
+
+    while (!__atomic_load_n(&opt->stop, __ATOMIC_ACQUIRE)) {
+        if (run_once(opt))
+            continue;
+
+        // Announce that we're going to wait before looking at the
+        // queue once more: a producer that queues an item afterwards
+        // sees 'idle' and posts.
+        __atomic_store_n(&opt->idle, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&opt->depth, __ATOMIC_SEQ_CST) > 0 || __atomic_load_n(&opt->stop, __ATOMIC_SEQ_CST)) {
+            __atomic_store_n(&opt->idle, 0, __ATOMIC_SEQ_CST);
+            // a producer may be between taking a slot and linking
+            // its item.
+            sched_yield();
+            continue;
+        }
+        sem_wait(&opt->wake);
+    }
+
+    return NULL;
+}
+
+static void optimizer_free(april_graph_optimizer_t *opt);
+
+static april_graph_optimizer_t *optimizer_create(april_graph_t *graph, april_graph_cholesky_param_t *param,
+                                                 int capacity)
+{
+    april_graph_optimizer_t *opt = calloc(1, sizeof(april_graph_optimizer_t));
+    opt->graph = graph;
+    opt->param = param;
+    opt->capacity = capacity;
+
+    opt->head = &opt->stub;
+    opt->tail = &opt->stub;
+    opt->next_idx = zarray_size(graph->nodes);
+
+    opt->nodes = zarray_create(sizeof(struct item*));
+    opt->factors = zarray_create(sizeof(struct item*));
+    opt->batch = zarray_create(sizeof(struct item*));
+
+    opt->estimates = april_graph_estimates_create();
+    april_graph_estimates_publish(opt->estimates, graph);
+
+    sem_init(&opt->wake, 0, 0);
+    pthread_mutex_init(&opt->lock, NULL);
+    pthread_cond_init(&opt->cond, NULL);
+
+    return opt;
+}
+
+april_graph_optimizer_t *april_graph_optimizer_create(april_graph_t *graph, april_graph_cholesky_param_t *param,
+                                                      int capacity)
+{
+    april_graph_optimizer_t *opt = optimizer_create(graph, param, capacity);
+    if (pthread_create(&opt->thread, NULL, optimizer_main, opt)) {
+        optimizer_free(opt);
+        return NULL;
+    }
+    return opt;
+}
+
+void april_graph_optimizer_set_prepare(april_graph_optimizer_t *opt,
+                                       void (*f)(april_graph_t *graph, int node0, int factor0, void *user),
+                                       void *user)
+{
+    opt->prepare = f;
+    opt->prepare_user = user;
+}
+
+static void item_destroy(struct item *item)
+{
+    if (item->node)
+        item->node->destroy(item->node);
+    if (item->factor)
+        item->factor->destroy(item->factor);
+    free(item);
+}
+
+void april_graph_optimizer_destroy(april_graph_optimizer_t *opt)
+{
+    if (!opt)
+        return;
+
+    april_graph_scheduler_t *sched = opt->sched;
+    if (sched) {
+        pthread_mutex_lock(&sched->lock);
+        zarray_remove_value(sched->sessions, &opt, 0);
+        while (opt->running)
+            pthread_cond_wait(&sched->done, &sched->lock);
+        pthread_mutex_unlock(&sched->lock);
+    } else {
+        __atomic_store_n(&opt->stop, 1, __ATOMIC_RELEASE);
+        sem_post(&opt->wake);
+        pthread_join(opt->thread, NULL);
+    }
+
+    optimizer_free(opt);
+}
+
+// Frees an optimizer whose thread (if any) has stopped.
+static void optimizer_free(april_graph_optimizer_t *opt)
+{
+    struct item *item;
+    while ((item = queue_pop(opt)) != NULL) {
+        if (item != &opt->stub)
+            item_destroy(item);
+    }
+    for (int i = 0; i < zarray_size(opt->nodes); i++) {
+        zarray_get(opt->nodes, i, &item);
+        item_destroy(item);
+    }
+    for (int i = 0; i < zarray_size(opt->factors); i++) {
+        zarray_get(opt->factors, i, &item);
+        item_destroy(item);
+    }
+    zarray_destroy(opt->nodes);
+    zarray_destroy(opt->factors);
+    zarray_destroy(opt->batch);
+    april_graph_estimates_destroy(opt->estimates);
+
+    sem_destroy(&opt->wake);
+    pthread_mutex_destroy(&opt->lock);
+    pthread_cond_destroy(&opt->cond);
+    free(opt);
+}
+
+void april_graph_optimizer_flush(april_graph_optimizer_t *opt)
+{
+    int64_t npushed = __atomic_load_n(&opt->npushed, __ATOMIC_SEQ_CST);
+
+    pthread_mutex_lock(&opt->lock);
+    while (opt->nsettled < npushed)
+        pthread_cond_wait(&opt->cond, &opt->lock);
+    pthread_mutex_unlock(&opt->lock);
+}
+
+void april_graph_optimizer_stats(april_graph_optimizer_t *opt, april_graph_optimizer_stats_t *stats)
+{
+    pthread_mutex_lock(&opt->lock);
+    *stats = opt->stats;
+    pthread_mutex_unlock(&opt->lock);
+
+    stats->npushed = __atomic_load_n(&opt->npushed, __ATOMIC_RELAXED);
+    stats->nrejected = __atomic_load_n(&opt->nrejected, __ATOMIC_RELAXED);
+    stats->depth = __atomic_load_n(&opt->depth, __ATOMIC_RELAXED);
+}
+
+april_graph_estimates_t *april_graph_optimizer_estimates(april_graph_optimizer_t *opt)
+{
+    return opt->estimates;
+}
+
+/////////////////////////////////////////////////////////////
+// scheduler
+
+// The notified session with the least vruntime that isn't running,
+// or NULL. Call with the lock held.
+static april_graph_optimizer_t *pick_session(april_graph_scheduler_t *sched)
+{
+    april_graph_optimizer_t *best = NULL;
+
+    for (int i = 0; i < zarray_size(sched->sessions); i++) {
+        april_graph_optimizer_t *opt;
+        zarray_get(sched->sessions, i, &opt);
+        if (opt->running || !__atomic_load_n(&opt->notified, __ATOMIC_SEQ_CST))
+            continue;
+        if (best == NULL || opt->vruntime < best->vruntime)
+            best = opt;
+    }
+    return best;
+}
+
+static void *scheduler_main(void *arg)
+{
+    april_graph_scheduler_t *sched = arg;
+
+    pthread_mutex_lock(&sched->lock);
+    while (!sched->stop) {
+        april_graph_optimizer_t *opt = pick_session(sched);
+        if (opt == NULL) {
+            // Announce that we're going to wait before looking once
+            // more: a producer that notifies afterwards sees nidle > 0.
+            __atomic_add_fetch(&sched->nidle, 1, __ATOMIC_SEQ_CST);
+            int busy = pick_session(sched) != NULL || sched->stop;
+            pthread_mutex_unlock(&sched->lock);
+
+            // If a producer claimed us in the meantime, its post is
+            // ours to take.
+            if (!busy || !claim_idle(sched))
+                sem_wait(&sched->wake);
+
+            pthread_mutex_lock(&sched->lock);
+            continue;
+        }
+
+        // don't let a session that has been idle catch up.
+        if (opt->vruntime < sched->vclock)
+            opt->vruntime = sched->vclock;
+        sched->vclock = opt->vruntime;
+        opt->running = 1;
+        pthread_mutex_unlock(&sched->lock);
+
+        // a producer that queues an item from now on notifies again.
+        __atomic_store_n(&opt->notified, 0, __ATOMIC_SEQ_CST);
+        int64_t utime0 = utime_now();
+        run_once(opt);
+        int64_t utime1 = utime_now();
+
+        pthread_mutex_lock(&sched->lock);
+        opt->vruntime += utime1 - utime0;
+        opt->running = 0;
+        pthread_cond_broadcast(&sched->done);
+    }
+    pthread_mutex_unlock(&sched->lock);
+
+    return NULL;
+}
+
+april_graph_scheduler_t *april_graph_scheduler_create(int nthreads)
+{
+    april_graph_scheduler_t *sched = calloc(1, sizeof(april_graph_scheduler_t));
+    sched->nthreads = nthreads > 1 ? nthreads : 1;
+    sched->sessions = zarray_create(sizeof(april_graph_optimizer_t*));
+
+    sem_init(&sched->wake, 0, 0);
+    pthread_mutex_init(&sched->lock, NULL);
+    pthread_cond_init(&sched->done, NULL);
+
+    sched->threads = calloc(sched->nthreads, sizeof(pthread_t));
+    for (int i = 0; i < sched->nthreads; i++) {
+        if (pthread_create(&sched->threads[i], NULL, scheduler_main, sched)) {
+            // stop the threads that did start.
+            sched->nthreads = i;
+            april_graph_scheduler_destroy(sched);
+            return NULL;
+        }
+    }
+
+    return sched;
+}
+
+void april_graph_scheduler_destroy(april_graph_scheduler_t *sched)
+{
+    if (!sched)
+        return;
+
+    pthread_mutex_lock(&sched->lock);
+    assert(zarray_size(sched->sessions) == 0);
+    sched->stop = 1;
+    pthread_mutex_unlock(&sched->lock);
+
+    for (int i = 0; i < sched->nthreads; i++)
+        sem_post(&sched->wake);
+    for (int i = 0; i < sched->nthreads; i++)
+        pthread_join(sched->threads[i], NULL);
+
+    zarray_destroy(sched->sessions);
+    sem_destroy(&sched->wake);
+    pthread_mutex_destroy(&sched->lock);
+    pthread_cond_destroy(&sched->done);
+    free(sched->threads);
+    free(sched);
+}
+
+april_graph_optimizer_t *april_graph_scheduler_add(april_graph_scheduler_t *sched, april_graph_t *graph,
+                                                   april_graph_cholesky_param_t *param, int capacity)
+{
+    april_graph_optimizer_t *opt = optimizer_create(graph, param, capacity);
+    opt->sched = sched;
+
+    pthread_mutex_lock(&sched->lock);
+    opt->vruntime = sched->vclock;
+    zarray_add(sched->sessions, &opt);
+    pthread_mutex_unlock(&sched->lock);
+
+    return opt;
+}
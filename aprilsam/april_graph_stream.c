@@ -0,0 +1,200 @@
+/* Copyright (C) 2013-2019, The Regents of The University of Michigan.
+All rights reserved.
+
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*$LICENSE*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "aprilsam.h"
+
+// A window onto the file: bytes [pos, len) of buf have been read but
+// not consumed yet.
+struct stream
+{
+    int fd;
+    uint8_t *buf;
+    size_t alloc;
+    size_t pos, len;
+};
+
+// Make sure that at least 'need' unconsumed bytes are buffered,
+// reading as much as fits. The buffer only grows beyond its initial
+// size for an object that is larger than it.
+static int stream_fill(struct stream *s, size_t need)
+{
+    if (s->len - s->pos >= need)
+        return 0;
+
+    memmove(s->buf, &s->buf[s->pos], s->len - s->pos);
+    s->len -= s->pos;
+    s->pos = 0;
+
+    if (need > s->alloc) {
+        s->alloc = need;
+        s->buf = realloc(s->buf, s->alloc);
+    }
+
+    while (s->len < need) {
+        ssize_t res = read(s->fd, &s->buf[s->len], s->alloc - s->len);
+        if (res < 0 && errno == EINTR)
+            continue;
+        if (res <= 0)
+            return -1;
+        s->len += res;
+    }
+
+    return 0;
+}
+
+// Size of the serialized object at the current position (see
+// stype_encode_object: magic, name, length, payload, magic), or 0 if
+// the file ends first.
+static size_t stream_object_size(struct stream *s)
+{
+    uint64_t pos = 8;
+    if (stream_fill(s, pos + 4))
+        return 0;
+    size_t namelen = decode_u32(&s->buf[s->pos], &pos, s->len - s->pos);
+
+    // the length is 4 bytes, or 12 with the 64-bit escape.
+    if (stream_fill(s, 8 + 4 + namelen + 4))
+        return 0;
+    pos = 8 + 4 + namelen;
+    if (decode_u32(&s->buf[s->pos], &pos, s->len - s->pos) == ENCODE_LEN_ESCAPE &&
+        stream_fill(s, 8 + 4 + namelen + 12))
+        return 0;
+    pos = 8 + 4 + namelen;
+    uint64_t length = decode_len(&s->buf[s->pos], &pos, s->len - s->pos);
+
+    return pos + length + 8;
+}
+
+// Decode the next object with stype_decode_object. Returns 0 on
+// success; *obj may still be NULL (an encoded NULL or an unknown type).
+static int stream_decode_object(struct stream *s, void **obj)
+{
+    size_t size = stream_object_size(s);
+    if (size == 0 || stream_fill(s, size))
+        return -1;
+
+    uint64_t pos = 0;
+    *obj = stype_decode_object(&s->buf[s->pos], &pos, size, NULL);
+    s->pos += size;
+    return pos == size ? 0 : -1;
+}
+
+int april_graph_read_stream(int fd, size_t bufsize,
+                            int (*on_node)(april_graph_node_t *node, int idx, void *user),
+                            int (*on_factor)(april_graph_factor_t *factor, int idx, void *user),
+                            void *user, april_graph_attr_t **attr)
+{
+    struct stream s = { .fd = fd };
+    s.alloc = bufsize > 4096 ? bufsize : 4096;
+    s.buf = malloc(s.alloc);
+
+    int ret = -1;
+    int nnodes = 0, nfactors = 0;
+
+    if (attr)
+        *attr = NULL;
+
+    // The graph is one object whose payload is a sequence of tagged
+    // node (1) and factor (2) objects, a 0 tag, and the graph's
+    // attributes. Only the header of the graph object is parsed by
+    // hand; its length is not needed.
+    uint64_t pos = 0;
+    if (stream_fill(&s, 8 + 4))
+        goto cleanup;
+    uint64_t magic = decode_u64(&s.buf[s.pos], &pos, s.len - s.pos);
+    size_t namelen = decode_u32(&s.buf[s.pos], &pos, s.len - s.pos);
+    if (stream_fill(&s, 8 + 4 + namelen + 4))
+        goto cleanup;
+    if (namelen != strlen("april_graph_t") || memcmp(&s.buf[s.pos + 12], "april_graph_t", namelen)) {
+        printf("april_graph_read_stream: not a serialized april_graph_t\n");
+        goto cleanup;
+    }
+    pos = 8 + 4 + namelen;
+    if (decode_u32(&s.buf[s.pos], &pos, s.len - s.pos) == ENCODE_LEN_ESCAPE) {
+        if (stream_fill(&s, pos + 8))
+            goto cleanup;
+        pos += 8;
+    }
+    s.pos += pos;
+
+    while (1) {
+        if (stream_fill(&s, 1))
+            goto cleanup;
+        int tag = s.buf[s.pos++];
+        if (tag == 0)
+            break;
+        if (tag != 1 && tag != 2)
+            goto cleanup;
+
+        void *obj;
+        if (stream_decode_object(&s, &obj))
+            goto cleanup;
+
+        // an object of an unregistered type decodes to NULL, but
+        // still takes up its index.
+        int res = 0;
+        if (tag == 1) {
+            if (obj && on_node)
+                res = on_node(obj, nnodes, user);
+            else if (obj)
+                ((april_graph_node_t*) obj)->destroy(obj);
+            nnodes++;
+        } else {
+            if (obj && on_factor)
+                res = on_factor(obj, nfactors, user);
+            else if (obj)
+                ((april_graph_factor_t*) obj)->destroy(obj);
+            nfactors++;
+        }
+
+        if (res) {
+            ret = res;
+            goto cleanup;
+        }
+    }
+
+    void *graph_attr;
+    if (stream_decode_object(&s, &graph_attr))
+        goto cleanup;
+    if (attr)
+        *attr = graph_attr;
+    else
+        april_graph_attr_destroy(graph_attr);
+
+    pos = 0;
+    if (stream_fill(&s, 8) || decode_u64(&s.buf[s.pos], &pos, 8) != magic) {
+        printf("april_graph_read_stream: magic mismatch at end of graph\n");
+        goto cleanup;
+    }
+
+    ret = 0;
+
+  cleanup:
+    free(s.buf);
+    return ret;
+}
@@ -0,0 +1,499 @@
+/* Copyright (C) 2013-2019, The Regents of The University of Michigan.
+All rights reserved.
+
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*$LICENSE*/
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "aprilsam.h"
+
+// Files are only split in pieces at least this large; below that,
+// handing a piece to another thread costs more than it saves.
+#define TORO_MIN_CHUNK (256 * 1024)
+
+#define RECORD_VERTEX 1
+#define RECORD_EDGE   2
+
+// One parsed line. For edges, W is the packed upper triangle of the
+// information matrix in row-major order (I11 I12 I13 I22 I23 I33),
+// whatever order the file used.
+struct toro_record
+{
+    int kind;
+    int a, b;      // vertex: a is the id; edge: a -> b
+    double z[3];   // vertex: x, y, theta
+    double W[6];
+};
+
+struct toro_chunk
+{
+    const char *p, *end;
+
+    zarray_t *records;  // struct toro_record
+    int nskipped;       // lines with an unrecognized tag
+
+    const char *error;  // start of the first malformed line, or NULL
+};
+
+static const double pow10_table[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+static inline const char *skip_blanks(const char *p, const char *end)
+{
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+        p++;
+    return p;
+}
+
+static inline const char *token_end(const char *p, const char *end)
+{
+    while (p < end && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n')
+        p++;
+    return p;
+}
+
+// Returns the position after the number, or NULL if there isn't one.
+static const char *parse_int(const char *p, const char *end, int *v)
+{
+    p = skip_blanks(p, end);
+
+    int neg = 0;
+    if (p < end && (*p == '-' || *p == '+'))
+        neg = (*p++ == '-');
+
+    const char *digits = p;
+    int64_t acc = 0;
+    while (p < end && *p >= '0' && *p <= '9' && acc <= INT32_MAX)
+        acc = 10*acc + (*p++ - '0');
+
+    if (p == digits || acc > INT32_MAX || token_end(p, end) != p)
+        return NULL;
+
+    *v = neg ? -acc : acc;
+    return p;
+}
+
+// Decimal numbers with at most 19 significant digits and a small
+// exponent (i.e., everything these datasets contain) are converted
+// with a single correctly rounded multiplication or division, which
+// gives the same result as strtod. Anything else goes to strtod.
+static const char *parse_double(const char *p, const char *end, double *v)
+{
+    p = skip_blanks(p, end);
+    const char *start = p;
+
+    int neg = 0;
+    if (p < end && (*p == '-' || *p == '+'))
+        neg = (*p++ == '-');
+
+    uint64_t mant = 0;
+    int ndigits = 0, exp10 = 0, any = 0;
+
+    while (p < end && *p >= '0' && *p <= '9') {
+        if (ndigits < 19) {
+            mant = 10*mant + (*p - '0');
+            if (mant)
+                ndigits++;
+        } else {
+            exp10++;
+        }
+        p++;
+        any = 1;
+    }
+
+    if (p < end && *p == '.') {
+        p++;
+        while (p < end && *p >= '0' && *p <= '9') {
+            if (ndigits < 19) {
+                mant = 10*mant + (*p - '0');
+                if (mant)
+                    ndigits++;
+                exp10--;
+            }
+            p++;
+            any = 1;
+        }
+    }
+
+    if (any && p < end && (*p == 'e' || *p == 'E')) {
+        const char *q = p + 1;
+        int eneg = 0, e = 0, eany = 0;
+        if (q < end && (*q == '-' || *q == '+'))
+            eneg = (*q++ == '-');
+        while (q < end && *q >= '0' && *q <= '9') {
+            if (e < 10000)
+                e = 10*e + (*q - '0');
+            q++;
+            eany = 1;
+        }
+        if (eany) {
+            exp10 += eneg ? -e : e;
+            p = q;
+        }
+    }
+
+    if (any && token_end(p, end) == p && mant < (1ULL << 53) &&
+        exp10 >= -22 && exp10 <= 22) {
+        double d = mant;
+        d = exp10 < 0 ? d / pow10_table[-exp10] : d * pow10_table[exp10];
+        *v = neg ? -d : d;
+        return p;
+    }
+
+    // slow path: long mantissas, large exponents, inf and nan.
+    p = token_end(start, end);
+    char buf[64];
+    if (p == start || p - start >= (long) sizeof(buf))
+        return NULL;
+
+    memcpy(buf, start, p - start);
+    buf[p - start] = 0;
+
+    char *stop;
+    *v = strtod(buf, &stop);
+    return *stop == 0 ? p : NULL;
+}
+
+static const char *parse_doubles(const char *p, const char *end, double *v, int n)
+{
+    for (int i = 0; i < n && p; i++)
+        p = parse_double(p, end, &v[i]);
+    return p;
+}
+
+static inline int tag_is(const char *tag, long len, const char *name)
+{
+    return len == (long) strlen(name) && !memcmp(tag, name, len);
+}
+
+static void parse_chunk(struct toro_chunk *chunk)
+{
+    const char *p = chunk->p, *end = chunk->end;
+
+    while (p < end) {
+        const char *line = p;
+        p = skip_blanks(p, end);
+
+        const char *tag = p;
+        p = token_end(p, end);
+        long taglen = p - tag;
+
+        struct toro_record rec = { 0 };
+        double v[6];
+
+        if (tag_is(tag, taglen, "VERTEX2") || tag_is(tag, taglen, "VERTEX_SE2")) {
+            rec.kind = RECORD_VERTEX;
+            if ((p = parse_int(p, end, &rec.a)))
+                p = parse_doubles(p, end, rec.z, 3);
+        } else if (tag_is(tag, taglen, "EDGE2")) {
+            // IDout IDin dx dy dth I11 I12 I22 I33 I13 I23
+            rec.kind = RECORD_EDGE;
+            if ((p = parse_int(p, end, &rec.a)) && (p = parse_int(p, end, &rec.b)) &&
+                (p = parse_doubles(p, end, rec.z, 3)) && (p = parse_doubles(p, end, v, 6))) {
+                double W[6] = { v[0], v[1], v[4], v[2], v[5], v[3] };
+                memcpy(rec.W, W, sizeof(W));
+            }
+        } else if (tag_is(tag, taglen, "EDGE_SE2")) {
+            // IDout IDin dx dy dth I11 I12 I13 I22 I23 I33
+            rec.kind = RECORD_EDGE;
+            if ((p = parse_int(p, end, &rec.a)) && (p = parse_int(p, end, &rec.b)) &&
+                (p = parse_doubles(p, end, rec.z, 3)))
+                p = parse_doubles(p, end, rec.W, 6);
+        } else if (taglen > 0 && tag[0] != '#') {
+            // e.g., g2o's FIX, or 3D and landmark types.
+            chunk->nskipped++;
+        }
+
+        if (p == NULL) {
+            chunk->error = line;
+            return;
+        }
+
+        if (rec.kind)
+            zarray_add(chunk->records, &rec);
+
+        // anything else on the line is ignored.
+        const char *nl = memchr(p, '\n', end - p);
+        p = nl ? nl + 1 : end;
+    }
+}
+
+static void parse_chunks(void *arg, int c0, int c1)
+{
+    struct toro_chunk *chunks = arg;
+    for (int c = c0; c < c1; c++)
+        parse_chunk(&chunks[c]);
+}
+
+// Vertex ids are dense in practice, and are then mapped to node
+// indices with a plain array. Sparse ids (the largest more than twice
+// the number of vertices) go through a hash instead, so that a single
+// huge id can't make us allocate an array for it.
+struct idmap
+{
+    int *array;     // by id, -1 if unused; NULL if sparse
+    int maxid;
+    zhash_t *hash;  // int id => int index, if sparse
+};
+
+static int idmap_init(struct idmap *m, int maxid, int nvertices)
+{
+    memset(m, 0, sizeof(struct idmap));
+    m->maxid = maxid;
+
+    if (maxid / 2 >= nvertices) {
+        m->hash = zhash_create(sizeof(int), sizeof(int), zhash_int_hash, zhash_int_equals);
+        return 0;
+    }
+
+    m->array = malloc(((size_t) maxid + 1) * sizeof(int));
+    if (m->array == NULL)
+        return -1;
+    for (int i = 0; i <= maxid; i++)
+        m->array[i] = -1;
+    return 0;
+}
+
+static void idmap_destroy(struct idmap *m)
+{
+    free(m->array);
+    if (m->hash)
+        zhash_destroy(m->hash);
+}
+
+// the node index of vertex 'id', or -1.
+static int idmap_get(const struct idmap *m, int id)
+{
+    if (id < 0 || id > m->maxid)
+        return -1;
+    if (m->array)
+        return m->array[id];
+
+    int idx;
+    return zhash_get(m->hash, &id, &idx) ? idx : -1;
+}
+
+static void idmap_put(struct idmap *m, int id, int idx)
+{
+    if (m->array)
+        m->array[id] = idx;
+    else
+        zhash_put(m->hash, &id, &idx, NULL, NULL);
+}
+
+static int build_graph(april_graph_t *graph, struct toro_chunk *chunks, int nchunks)
+{
+    int maxid = -1, nvertices = 0;
+
+    for (int c = 0; c < nchunks; c++) {
+        for (int i = 0; i < zarray_size(chunks[c].records); i++) {
+            struct toro_record *rec;
+            zarray_get_volatile(chunks[c].records, i, &rec);
+            if (rec->kind != RECORD_VERTEX)
+                continue;
+            if (rec->a < 0) {
+                printf("april_graph_import_toro: negative vertex id %d\n", rec->a);
+                return -1;
+            }
+            maxid = imax(maxid, rec->a);
+            nvertices++;
+        }
+    }
+
+    struct idmap idmap;
+    if (idmap_init(&idmap, maxid, nvertices)) {
+        printf("april_graph_import_toro: out of memory for vertex ids up to %d\n", maxid);
+        return -1;
+    }
+
+    int ret = -1;
+    int node0 = zarray_size(graph->nodes);
+    int factor0 = zarray_size(graph->factors);
+    zarray_ensure_capacity(graph->nodes, node0 + nvertices);
+
+    for (int c = 0; c < nchunks; c++) {
+        for (int i = 0; i < zarray_size(chunks[c].records); i++) {
+            struct toro_record *rec;
+            zarray_get_volatile(chunks[c].records, i, &rec);
+            if (rec->kind != RECORD_VERTEX)
+                continue;
+            if (idmap_get(&idmap, rec->a) >= 0) {
+                printf("april_graph_import_toro: duplicate vertex id %d\n", rec->a);
+                goto cleanup;
+            }
+            idmap_put(&idmap, rec->a, zarray_size(graph->nodes));
+
+            april_graph_node_t *node = april_graph_node_xyt_create(rec->z, rec->z, rec->z);
+            zarray_add(graph->nodes, &node);
+        }
+    }
+
+    // consecutive edges usually share their information matrix, so
+    // the last one is reused without going through the intern table.
+    double lastW[6];
+    int lastinfo = -1;
+
+    for (int c = 0; c < nchunks; c++) {
+        for (int i = 0; i < zarray_size(chunks[c].records); i++) {
+            struct toro_record *rec;
+            zarray_get_volatile(chunks[c].records, i, &rec);
+            if (rec->kind != RECORD_EDGE)
+                continue;
+
+            int a = idmap_get(&idmap, rec->a), b = idmap_get(&idmap, rec->b);
+            if (a < 0 || b < 0) {
+                printf("april_graph_import_toro: edge %d -> %d refers to an unknown vertex\n", rec->a, rec->b);
+                goto cleanup;
+            }
+
+            int info;
+            if (lastinfo >= 0 && !memcmp(lastW, rec->W, sizeof(lastW))) {
+                info = lastinfo;
+                april_graph_info_retain(info);
+            } else {
+                const double *w = rec->W;
+                double W[9] = { w[0], w[1], w[2],
+                                w[1], w[3], w[4],
+                                w[2], w[4], w[5] };
+                info = april_graph_info_intern_data(3, W);
+                if (info < 0)
+                    goto cleanup;
+                memcpy(lastW, rec->W, sizeof(lastW));
+                lastinfo = info;
+            }
+
+            april_graph_factor_t *factor = april_graph_factor_xyt_create_info(a, b, rec->z, NULL, info);
+            zarray_add(graph->factors, &factor);
+        }
+    }
+
+    ret = 0;
+
+  cleanup:
+    // on error, leave the graph as it was.
+    if (ret) {
+        for (int i = factor0; i < zarray_size(graph->factors); i++) {
+            april_graph_factor_t *factor;
+            zarray_get(graph->factors, i, &factor);
+            factor->destroy(factor);
+        }
+        zarray_truncate(graph->factors, factor0);
+
+        for (int i = node0; i < zarray_size(graph->nodes); i++) {
+            april_graph_node_t *node;
+            zarray_get(graph->nodes, i, &node);
+            node->destroy(node);
+        }
+        zarray_truncate(graph->nodes, node0);
+    }
+
+    idmap_destroy(&idmap);
+    return ret;
+}
+
+int april_graph_import_toro(april_graph_t *graph, const char *path, int npieces)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        printf("april_graph_import_toro: can't open %s\n", path);
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st)) {
+        close(fd);
+        return -1;
+    }
+
+    size_t size = st.st_size;
+    const char *base = "";
+    if (size > 0) {
+        base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (base == MAP_FAILED) {
+            printf("april_graph_import_toro: can't map %s\n", path);
+            close(fd);
+            return -1;
+        }
+        madvise((void*) base, size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    taskpool_t *tp = april_graph_taskpool(graph);
+    if (npieces <= 0)
+        npieces = taskpool_nthreads(tp);
+
+    // split at line boundaries.
+    int nchunks = 1;
+    while (nchunks < npieces && (nchunks + 1) * (size_t) TORO_MIN_CHUNK <= size)
+        nchunks++;
+
+    struct toro_chunk chunks[nchunks];
+    const char *end = base + size;
+    const char *p = base;
+
+    for (int c = 0; c < nchunks; c++) {
+        const char *q = end;
+        if (c + 1 < nchunks) {
+            q = base + (c + 1) * (size / nchunks);
+            if (q < p)
+                q = p;
+            const char *nl = memchr(q, '\n', end - q);
+            q = nl ? nl + 1 : end;
+        }
+
+        chunks[c] = (struct toro_chunk) { .p = p, .end = q,
+                                          .records = zarray_create(sizeof(struct toro_record)) };
+        p = q;
+    }
+
+    taskpool_parallel_for(tp, 0, nchunks, 1, parse_chunks, chunks);
+
+    int ret = 0, nskipped = 0;
+    for (int c = 0; c < nchunks; c++) {
+        nskipped += chunks[c].nskipped;
+        if (chunks[c].error && ret == 0) {
+            int line = 1;
+            for (const char *q = base; q < chunks[c].error; q++)
+                line += (*q == '\n');
+            printf("april_graph_import_toro: %s:%d: malformed record\n", path, line);
+            ret = -1;
+        }
+    }
+
+    if (nskipped > 0)
+        printf("april_graph_import_toro: skipped %d unrecognized lines\n", nskipped);
+
+    if (ret == 0)
+        ret = build_graph(graph, chunks, nchunks);
+
+    for (int c = 0; c < nchunks; c++)
+        zarray_destroy(chunks[c].records);
+    if (size > 0)
+        munmap((void*) base, size);
+
+    return ret;
+}
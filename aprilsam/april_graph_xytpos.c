@@ -32,6 +32,8 @@ $LICENSE_LGPL
 /////////////////////////////////////////////////////////////////////////////////////////
 // XYTPos Factor
 
+static void xytpos_factor_destroy(april_graph_factor_t *factor);
+
 static april_graph_factor_t* xytpos_factor_copy(april_graph_factor_t *factor)
 {
     april_graph_factor_t * next = calloc(1, sizeof(april_graph_factor_t));
@@ -51,11 +53,13 @@ static april_graph_factor_t* xytpos_factor_copy(april_graph_factor_t *factor)
     }
     next->copy = factor->copy;
     next->eval = factor->eval;
-    next->destroy = factor->destroy;
+    next->destroy = xytpos_factor_destroy; // the copy owns its arrays, even if factor is mapped
 
     next->u.common.z = doubles_dup(factor->u.common.z, 3);
     next->u.common.ztruth = doubles_dup(factor->u.common.ztruth, 3);
-    next->u.common.W = matd_copy(factor->u.common.W);
+    next->u.common.info = factor->u.common.info;
+    next->u.common.W = factor->u.common.W;
+    april_graph_info_retain(next->u.common.info);
     return next;
 
 }
@@ -84,19 +88,11 @@ static april_graph_factor_eval_t* xytpos_factor_eval(april_graph_factor_t *facto
     eval->r[1] = factor->u.common.z[1] - na->state[1];
     eval->r[2] = mod2pi(factor->u.common.z[2] - na->state[2]);
 
-    memcpy(eval->W->data, factor->u.common.W->data, 3*3*sizeof(double));
+    // copies W only if eval->W holds a different one
+    april_graph_info_eval_W(eval, factor->u.common.info);
 
-    // chi^2 = r'*W*r, via X = W*r
-    double X[3] = { MATD_EL(eval->W, 0, 0)*eval->r[0] +
-                    MATD_EL(eval->W, 0, 1)*eval->r[1] +
-                    MATD_EL(eval->W, 0, 2)*eval->r[2],
-                    MATD_EL(eval->W, 1, 0)*eval->r[0] +
-                    MATD_EL(eval->W, 1, 1)*eval->r[1] +
-                    MATD_EL(eval->W, 1, 2)*eval->r[2],
-                    MATD_EL(eval->W, 2, 0)*eval->r[0] +
-                    MATD_EL(eval->W, 2, 1)*eval->r[1] +
-                    MATD_EL(eval->W, 2, 2)*eval->r[2] };
-    eval->chi2 = eval->r[0]*X[0] + eval->r[1]*X[1] + eval->r[2]*X[2];
+    // chi^2 = r'*W*r
+    eval->chi2 = april_graph_info_chi2(eval->info, eval->r);
 
     return eval;
 }
@@ -108,7 +104,7 @@ static void xytpos_factor_destroy(april_graph_factor_t *factor)
     free(factor->nodes);
     free(factor->u.common.z);
     free(factor->u.common.ztruth);
-    matd_destroy(factor->u.common.W);
+    april_graph_info_release(factor->u.common.info);
     if(factor->attr) {
         zhash_iterator_t zit;
         april_graph_attr_t *attr = factor->attr;
@@ -130,7 +126,16 @@ static void xytpos_factor_destroy(april_graph_factor_t *factor)
 }
 
 
-static void april_graph_factor_xytpos_encode(const stype_t *stype, uint8_t *data, uint32_t *datapos, const void *obj)
+/** Encoding of a factor: u32 a, f64 z[3], u8 flags, f64 ztruth[3]
+    if FACTOR_HAS_ZTRUTH, W, then the attributes. W is its upper
+    triangle (6 x f64, row-major) if FACTOR_W_SYMMETRIC, otherwise all
+    9 entries. Before FACTOR_W_SYMMETRIC (version 1), the flags byte
+    was only a ztruth flag and W was always 9 entries, which is still
+    how those files decode. */
+#define FACTOR_HAS_ZTRUTH  1
+#define FACTOR_W_SYMMETRIC 2
+
+static void april_graph_factor_xytpos_encode(const stype_t *stype, uint8_t *data, uint64_t *datapos, const void *obj)
 {
     const april_graph_factor_t *factor = obj;
 
@@ -139,23 +144,26 @@ static void april_graph_factor_xytpos_encode(const stype_t *stype, uint8_t *data
     for (int i = 0; i < 3; i++)
         encode_f64(data, datapos, factor->u.common.z[i]);
 
-    if (factor->u.common.ztruth) {
-        encode_u8(data, datapos, 1);
+    const double *W = factor->u.common.W->data;
+    int symmetric = W[1] == W[3] && W[2] == W[6] && W[5] == W[7];
+    encode_u8(data, datapos, (factor->u.common.ztruth ? FACTOR_HAS_ZTRUTH : 0) |
+                             (symmetric ? FACTOR_W_SYMMETRIC : 0));
 
+    if (factor->u.common.ztruth) {
         for (int i = 0; i < 3; i++)
             encode_f64(data, datapos, factor->u.common.ztruth[i]);
-    } else {
-        encode_u8(data, datapos, 0);
     }
 
-    for (int i = 0; i < 9; i++)
-        encode_f64(data, datapos, factor->u.common.W->data[i]);
+    for (int i = 0; i < 3; i++) {
+        for (int j = symmetric ? i : 0; j < 3; j++)
+            encode_f64(data, datapos, W[3*i + j]);
+    }
 
     april_graph_attr_t *attr = factor->attr;
     stype_encode_object(data, datapos, attr ? attr->stype : NULL, attr);
 }
 
-static void *april_graph_factor_xytpos_decode(const stype_t *stype, const uint8_t *data, uint32_t *datapos, uint32_t datalen)
+static void *april_graph_factor_xytpos_decode(const stype_t *stype, const uint8_t *data, uint64_t *datapos, uint64_t datalen)
 {
     int a = decode_u32(data, datapos, datalen);
 
@@ -163,23 +171,31 @@ static void *april_graph_factor_xytpos_decode(const stype_t *stype, const uint8_
     for (int i = 0; i < 3; i++)
         z[i] = decode_f64(data, datapos, datalen);
 
+    int flags = decode_u8(data, datapos, datalen);
+
     double *ztruth = NULL;
-    if (decode_u8(data, datapos, datalen)) {
-        ztruth = malloc(2*sizeof(double));
+    if (flags & FACTOR_HAS_ZTRUTH) {
+        ztruth = malloc(3*sizeof(double));
         for (int i = 0; i < 3; i++)
             ztruth[i] = decode_f64(data, datapos, datalen);
     }
 
-    matd_t *W = matd_create(3, 3);
-    for (int i = 0; i < 9; i++)
-        W->data[i] = decode_f64(data, datapos, datalen);
+    int symmetric = flags & FACTOR_W_SYMMETRIC;
+    double W[9];
+    for (int i = 0; i < 3; i++) {
+        for (int j = symmetric ? i : 0; j < 3; j++) {
+            W[3*i + j] = decode_f64(data, datapos, datalen);
+            if (symmetric)
+                W[3*j + i] = W[3*i + j];
+        }
+    }
 
-    april_graph_factor_t *factor = april_graph_factor_xytpos_create(a, z, ztruth, W);
+    april_graph_factor_t *factor = april_graph_factor_xytpos_create_info(a, z, ztruth,
+                                                                         april_graph_info_intern_data(3, W));
     april_graph_attr_destroy(factor->attr);
     factor->attr = stype_decode_object(data, datapos, datalen, NULL);
 
     free(ztruth);
-    matd_destroy(W);
     return factor;
 }
 
@@ -188,7 +204,7 @@ const stype_t stype_april_factor_xytpos = { .name = "april_graph_factor_xytpos",
                                          .decode = april_graph_factor_xytpos_decode,
                                          .copy = NULL };
 
-april_graph_factor_t *april_graph_factor_xytpos_create(int a, double *z, double *ztruth, matd_t *W)
+april_graph_factor_t *april_graph_factor_xytpos_create_info(int a, const double *z, const double *ztruth, int info)
 {
     april_graph_factor_t *factor = calloc(1, sizeof(april_graph_factor_t));
 
@@ -204,12 +220,48 @@ april_graph_factor_t *april_graph_factor_xytpos_create(int a, double *z, double
 
     factor->u.common.z = doubles_dup(z, 3);
     factor->u.common.ztruth = doubles_dup(ztruth, 3);
-    factor->u.common.W = matd_copy(W);
+    factor->u.common.info = info;
+    factor->u.common.W = april_graph_info_get(info)->Wmat;
 
     factor->stype = &stype_april_factor_xytpos;
     return factor;
 }
 
+april_graph_factor_t *april_graph_factor_xytpos_create(int a, double *z, double *ztruth, matd_t *W)
+{
+    return april_graph_factor_xytpos_create_info(a, z, ztruth, april_graph_info_intern(W));
+}
+
+// nodes, z and ztruth belong to whoever mapped them, as does the
+// factor structure itself.
+static void xytpos_factor_destroy_mapped(april_graph_factor_t *factor)
+{
+    april_graph_info_release(factor->u.common.info);
+    april_graph_attr_destroy(factor->attr);
+    factor->attr = NULL;
+}
+
+void april_graph_factor_xytpos_init_mapped(april_graph_factor_t *factor, int *nodes, double *z, double *ztruth, int info)
+{
+    memset(factor, 0, sizeof(april_graph_factor_t));
+
+    factor->type = APRIL_GRAPH_FACTOR_XYTPOS_TYPE;
+    factor->nnodes = 1;
+    factor->nodes = nodes;
+    factor->length = 3;
+
+    factor->copy = xytpos_factor_copy;
+    factor->eval = xytpos_factor_eval;
+    factor->destroy = xytpos_factor_destroy_mapped;
+
+    factor->u.common.z = z;
+    factor->u.common.ztruth = ztruth;
+    factor->u.common.info = info;
+    factor->u.common.W = april_graph_info_get(info)->Wmat;
+
+    factor->stype = &stype_april_factor_xytpos;
+}
+
 
 void april_graph_xytpos_stype_init()
 {
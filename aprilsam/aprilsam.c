@@ -27,6 +27,7 @@ License along with this library; if not, see <http://www.gnu.org/licenses/>.
 #include <string.h>
 #include <float.h>
 #include <limits.h>
+#include <pthread.h>
 
 #include "aprilsam.h"
 
@@ -38,6 +39,11 @@ void APRILSAM_VERSION()
     printf("\n");
 }
 
+taskpool_t *april_graph_taskpool(const april_graph_t *graph)
+{
+    return graph->taskpool ? graph->taskpool : taskpool_get_default();
+}
+
 /** POSE Graph for xyt
    convert matrix column id to graph node id Assume all node just xyt!!!!! */
 static int *heap_minimum_degree_ordering(smatd_t *mat, april_graph_t *g);
@@ -53,6 +59,7 @@ void april_graph_cholesky_param_init(april_graph_cholesky_param_t *param)
     param->chol = NULL;
     param->A = NULL;
     param->tr = NULL;
+    param->chi2_refresh = 100;
     if(param->delta_x) {
         free(param->delta_x);
         param->delta_x = NULL;
@@ -67,6 +74,7 @@ void april_graph_cholesky_param_destory(april_graph_cholesky_param_t *param)
 {
     if(!param)
         return;
+    april_graph_cholesky_batch_cancel(param);
     if(param->chol)
         smatd_chol_destroy(param->chol);
     if(param->A)
@@ -81,10 +89,310 @@ void april_graph_cholesky_param_destory(april_graph_cholesky_param_t *param)
         free(param->y);
     if(param->ordering)
         free(param->ordering);
+    if(param->idxs)
+        free(param->idxs);
+    april_graph_eval_cache_destroy(param->eval_cache);
+    if(param->tp)
+        timeprofile_destroy(param->tp);
+    free(param->changes.nodes);
+    free(param->changes.mark);
+    free(param->changes.reported);
+    free(param->changes.touched);
+    free(param->changes.touched_mark);
+    april_graph_chi2_tracker_destroy(param->chi2);
     free(param);
 }
 
-void april_graph_cholesky(april_graph_t *graph, april_graph_cholesky_param_t *_param)
+// next capacity for a buffer that must hold 'need' elements.
+static int grow_capacity(int alloc, int need)
+{
+    if (alloc < 64)
+        alloc = 64;
+    while (alloc < need)
+        alloc *= 2;
+    return alloc;
+}
+
+// realloc() a buffer of 'alloc' elements to 'nalloc' elements,
+// zeroing the new ones.
+static void *grow_buffer(void *p, int alloc, int nalloc, size_t elsz)
+{
+    p = realloc(p, nalloc * elsz);
+    memset((char*) p + alloc * elsz, 0, (nalloc - alloc) * elsz);
+    return p;
+}
+
+// Give each of the rows [row0, row1) of m storage for param's fill
+// estimate (or a handful of entries) up front, so that fill-in does
+// not allocate during the incremental step. A row that outgrows it
+// doubles, so fill-in allocates amortized O(1).
+static void smatd_reserve_rows(april_graph_cholesky_param_t *param, smatd_t *m, int row0, int row1)
+{
+    int nz = param->reserve_row_nz > 1 ? param->reserve_row_nz : 1;
+    for (int i = row0; i < row1; i++)
+        svecd_ensure_capacity(&m->rows[i], nz);
+}
+
+// Make sure that the solver-side arrays can hold 'nnodes' nodes and
+// 'xlen' scalars. B, y, delta_x and the row headers of chol->u and A
+// share the capacity param->xalloc; ordering and idxs share
+// param->nalloc. Capacities double, so appending nodes costs
+// amortized O(1) instead of a copy of every buffer.
+static void cholesky_param_ensure_capacity(april_graph_cholesky_param_t *param, int nnodes, int xlen)
+{
+    if (nnodes > param->nalloc) {
+        int nalloc = grow_capacity(param->nalloc, nnodes);
+        param->ordering = grow_buffer(param->ordering, param->nalloc, nalloc, sizeof(int));
+        param->idxs = grow_buffer(param->idxs, param->nalloc, nalloc, sizeof(int));
+        param->nalloc = nalloc;
+    }
+
+    if (xlen > param->xalloc) {
+        int xalloc = grow_capacity(param->xalloc, xlen);
+        param->B = grow_buffer(param->B, param->xalloc, xalloc, sizeof(double));
+        param->y = grow_buffer(param->y, param->xalloc, xalloc, sizeof(double));
+        param->delta_x = grow_buffer(param->delta_x, param->xalloc, xalloc, sizeof(double));
+        if (param->chol) {
+            param->chol->u->rows = grow_buffer(param->chol->u->rows, param->xalloc, xalloc, sizeof(svecd_t));
+            smatd_reserve_rows(param, param->chol->u, param->xalloc, xalloc);
+        }
+        if (param->A) {
+            param->A->rows = grow_buffer(param->A->rows, param->xalloc, xalloc, sizeof(svecd_t));
+            smatd_reserve_rows(param, param->A, param->xalloc, xalloc);
+        }
+        param->xalloc = xalloc;
+    }
+
+    if (param->tr)
+        search_tree_reserve(param->tr, nnodes);
+}
+
+// Grow the per-node arrays of the changed set to hold nodes
+// [0, nnodes).
+static void changes_ensure_nodes(april_graph_changes_t *changes, int nnodes)
+{
+    if (nnodes <= changes->mark_alloc)
+        return;
+
+    const int len = APRIL_GRAPH_CHANGES_MAX_LENGTH;
+    int mark_alloc = grow_capacity(changes->mark_alloc, nnodes);
+    changes->mark = grow_buffer(changes->mark, changes->mark_alloc, mark_alloc, sizeof(int));
+    changes->touched_mark = grow_buffer(changes->touched_mark, changes->mark_alloc, mark_alloc, sizeof(int));
+    changes->reported = realloc(changes->reported, len * mark_alloc * sizeof(double));
+    for (int i = len * changes->mark_alloc; i < len * mark_alloc; i++)
+        changes->reported[i] = NAN;
+    changes->mark_alloc = mark_alloc;
+}
+
+// Room for every one of nnodes nodes to be in the changed set.
+static void changes_reserve(april_graph_changes_t *changes, int nnodes)
+{
+    changes_ensure_nodes(changes, nnodes);
+    if (nnodes > changes->alloc) {
+        changes->alloc = grow_capacity(changes->alloc, nnodes);
+        changes->nodes = realloc(changes->nodes, changes->alloc * sizeof(int));
+    }
+    if (nnodes > changes->touched_alloc) {
+        changes->touched_alloc = grow_capacity(changes->touched_alloc, nnodes);
+        changes->touched = realloc(changes->touched, changes->touched_alloc * sizeof(int));
+    }
+}
+
+void april_graph_cholesky_reserve(april_graph_cholesky_param_t *param, int nnodes, int nfactors)
+{
+    param->reserve_nnodes = nnodes;
+    param->reserve_nfactors = nfactors;
+    changes_reserve(&param->changes, nnodes);
+
+    if (!param->eval_cache)
+        param->eval_cache = april_graph_eval_cache_create();
+    april_graph_eval_cache_reserve(param->eval_cache, nfactors);
+
+    // without a factorization there is nothing to grow yet; the batch
+    // solver applies the reservation when it creates the buffers.
+    if (param->chol)
+        cholesky_param_ensure_capacity(param, nnodes, 3 * nnodes); // HARD CODE: xyt_node, so 3 here.
+}
+
+// Start a new solver step with an empty set of changed nodes.
+static void changes_begin(april_graph_changes_t *changes)
+{
+    changes->step++;
+    changes->n = 0;
+    changes->ntouched = 0;
+}
+
+// node->update(node, dstate), adding node 'idx' to the touched nodes,
+// and to the changed set if its state is now more than changes->eps
+// from the one it was last reported with.
+static void changes_update_node(april_graph_changes_t *changes, april_graph_node_t *node, int idx, double *dstate)
+{
+    assert(node->length <= APRIL_GRAPH_CHANGES_MAX_LENGTH);
+
+    changes_ensure_nodes(changes, idx + 1);
+    double *reported = &changes->reported[APRIL_GRAPH_CHANGES_MAX_LENGTH * idx];
+    if (isnan(reported[0]))
+        memcpy(reported, node->state, node->length * sizeof(double));
+
+    node->update(node, dstate);
+
+    if (changes->touched_mark[idx] != changes->step) {
+        changes->touched_mark[idx] = changes->step;
+        if (changes->ntouched == changes->touched_alloc) {
+            changes->touched_alloc = grow_capacity(changes->touched_alloc, changes->ntouched + 1);
+            changes->touched = realloc(changes->touched, changes->touched_alloc * sizeof(int));
+        }
+        changes->touched[changes->ntouched++] = idx;
+    }
+
+    // a node already in the set is reported with its final state.
+    if (changes->mark[idx] == changes->step) {
+        memcpy(reported, node->state, node->length * sizeof(double));
+        return;
+    }
+
+    int changed = 0;
+    for (int i = 0; i < node->length; i++) {
+        double d = node->state[i] - reported[i];
+        if (node->type == APRIL_GRAPH_NODE_XYT_TYPE && i == 2)
+            d = mod2pi(d);
+        changed |= fabs(d) > changes->eps;
+    }
+
+    if (!changed)
+        return;
+
+    changes->mark[idx] = changes->step;
+    memcpy(reported, node->state, node->length * sizeof(double));
+
+    if (changes->n == changes->alloc) {
+        changes->alloc = grow_capacity(changes->alloc, changes->n + 1);
+        changes->nodes = realloc(changes->nodes, changes->alloc * sizeof(int));
+    }
+    changes->nodes[changes->n++] = idx;
+}
+
+// Add the contribution of one evaluated factor to the normal
+// equations: J'WJ into the upper triangle of A (and A2, if non-NULL)
+// and J'Wr into B (and y, if non-NULL). Works directly on the eval's
+// Jacobians so that no temporary matrices are allocated.
+static void add_factor_eval(april_graph_factor_t *factor, april_graph_factor_eval_t *eval, int *idxs,
+                            smatd_t *A, smatd_t *A2, double *B, double *y)
+{
+    int len = eval->length;
+    const double *W = eval->W->data;
+
+    // With a square root of W (W = R'*R), pre-whiten: J'WJ = (RJ)'(RJ)
+    // and J'Wr = (RJ)'(Rr). RJ holds the whitened Jacobians side by
+    // side, len x ncols.
+    const april_graph_info_t *info = eval->info;
+    int whiten = info && info->whiten && info->dim == len;
+    int ncols = 0;
+    for (int z = 0; z < factor->nnodes; z++)
+        ncols += eval->jacobians[z]->ncols;
+    double RJ[whiten ? len * ncols : 1];
+    double Rr[len];
+    const double *r = eval->r;
+    if (whiten) {
+        for (int z = 0, col0 = 0; z < factor->nnodes; col0 += eval->jacobians[z]->ncols, z++) {
+            matd_t *J = eval->jacobians[z];
+            for (int col = 0; col < J->ncols; col++) {
+                double v[len], Rv[len];
+                for (int k = 0; k < len; k++)
+                    v[k] = MATD_EL(J, k, col);
+                april_graph_info_whiten(info, v, Rv);
+                for (int k = 0; k < len; k++)
+                    RJ[k*ncols + col0 + col] = Rv[k];
+            }
+        }
+        april_graph_info_whiten(info, eval->r, Rr);
+        r = Rr;
+    }
+
+    for (int z0 = 0, col0 = 0; z0 < factor->nnodes; col0 += eval->jacobians[z0]->ncols, z0++) {
+        int n0 = factor->nodes[z0];
+        matd_t *Ja = eval->jacobians[z0];
+        int na = Ja->ncols;
+
+        // JatW = Ja' * W (na x len), or (R*Ja)' when whitening
+        double JatW[na * len];
+        for (int row = 0; row < na; row++) {
+            for (int col = 0; col < len; col++) {
+                if (whiten) {
+                    JatW[row*len + col] = RJ[col*ncols + col0 + row];
+                    continue;
+                }
+                double acc = 0;
+                for (int k = 0; k < len; k++)
+                    acc += MATD_EL(Ja, k, row) * W[k*len + col];
+                JatW[row*len + col] = acc;
+            }
+        }
+
+        for (int z1 = 0, col1 = 0; z1 < factor->nnodes; col1 += eval->jacobians[z1]->ncols, z1++) {
+            int n1 = factor->nodes[z1];
+            matd_t *Jb = eval->jacobians[z1];
+
+            // the right-hand side: Jb, or R*Jb when whitening
+            const double *Jbd = whiten ? &RJ[col1] : Jb->data;
+            int stride = whiten ? ncols : Jb->ncols;
+
+            for (int row = 0; row < na; row++) {
+                for (int col = 0; col < Jb->ncols; col++) {
+                    int a = row+idxs[n0];
+                    int b = col+idxs[n1];
+                    if(a > b)
+                        continue;
+                    double acc = 0;
+                    for (int k = 0; k < len; k++)
+                        acc += JatW[row*len + k] * Jbd[k*stride + col];
+                    smatd_set(A, a, b, smatd_get(A, a, b) + acc);
+                    if (A2)
+                        smatd_set(A2, a, b, smatd_get(A2, a, b) + acc);
+                }
+            }
+        }
+
+        for (int row = 0; row < na; row++) {
+            double acc = 0;
+            for (int k = 0; k < len; k++)
+                acc += JatW[row*len + k] * r[k];
+            B[idxs[n0]+row] += acc;
+            if (y)
+                y[idxs[n0]+row] += acc;
+        }
+    }
+}
+
+// Bring the running chi2 up to date with the step that just ended.
+static void chi2_step(april_graph_t *graph, april_graph_cholesky_param_t *param)
+{
+    if (!param->track_chi2)
+        return;
+
+    if (!param->chi2)
+        param->chi2 = april_graph_chi2_tracker_create();
+    april_graph_chi2_tracker_update(param->chi2, graph, param->eval_cache, &param->changes, param->chi2_refresh);
+}
+
+double april_graph_cholesky_chi2(const april_graph_cholesky_param_t *param)
+{
+    if (!param->track_chi2 || !param->chi2)
+        return -1;
+    return april_graph_chi2_tracker_total(param->chi2);
+}
+
+static void cholesky_batch(april_graph_t *graph, april_graph_cholesky_param_t *_param);
+
+void april_graph_cholesky(april_graph_t *graph, april_graph_cholesky_param_t *param)
+{
+    april_graph_cholesky_batch_cancel(param);
+    changes_begin(&param->changes);
+    cholesky_batch(graph, param);
+    chi2_step(graph, param);
+}
+
+static void cholesky_batch(april_graph_t *graph, april_graph_cholesky_param_t *_param)
 {
     // nothing to do
     if (zarray_size(graph->nodes) == 0 || zarray_size(graph->factors) == 0)
@@ -99,26 +407,33 @@ void april_graph_cholesky(april_graph_t *graph, april_graph_cholesky_param_t *_p
 
         int *allocated_ordering = NULL; // we'll free this one.
         int *use_ordering = param->ordering; // this could be from .param or one we create.
+        april_graph_separator_tree_t *septree = NULL;
 
-        // make symbolic matrix for variable nreordering.
-        smatd_t *Asym = smatd_create(zarray_size(graph->nodes), zarray_size(graph->nodes));
-        for (int fidx = 0; fidx < zarray_size(graph->factors); fidx++) {
-            april_graph_factor_t *factor;
-            zarray_get(graph->factors, fidx, &factor);
-
-            for (int i = 0; i < factor->nnodes; i++) {
-                for (int j = 0; j < factor->nnodes; j++) {
-                    smatd_set(Asym, factor->nodes[i], factor->nodes[j], 1);
+        //check filling
+        if (param->nested_dissection) {
+            // works on the graph's adjacency directly.
+            septree = april_graph_nested_dissection(graph, 0);
+            allocated_ordering = calloc(zarray_size(graph->nodes), sizeof(int));
+            memcpy(allocated_ordering, septree->ordering, zarray_size(graph->nodes) * sizeof(int));
+        } else if(1) {
+            // make symbolic matrix for variable nreordering.
+            smatd_t *Asym = smatd_create(zarray_size(graph->nodes), zarray_size(graph->nodes));
+            for (int fidx = 0; fidx < zarray_size(graph->factors); fidx++) {
+                april_graph_factor_t *factor;
+                zarray_get(graph->factors, fidx, &factor);
+
+                for (int i = 0; i < factor->nnodes; i++) {
+                    for (int j = 0; j < factor->nnodes; j++) {
+                        smatd_set(Asym, factor->nodes[i], factor->nodes[j], 1);
+                    }
                 }
             }
-        }
 
-        timeprofile_stamp(tp, "make symbolic");
+            timeprofile_stamp(tp, "make symbolic");
 
-        //check filling
-        if(1) {
             //allocated_ordering = exact_minimum_degree_ordering(Asym);
             allocated_ordering = heap_minimum_degree_ordering(Asym, graph);
+            smatd_destroy(Asym);
         } else {
             allocated_ordering = calloc(zarray_size(graph->nodes), sizeof(int));
             for (int i = 0; i < zarray_size(graph->nodes); i++) {
@@ -135,7 +450,6 @@ void april_graph_cholesky(april_graph_t *graph, april_graph_cholesky_param_t *_p
         }
 
         use_ordering = allocated_ordering;
-        smatd_destroy(Asym);
 
         // idxs[j]: what index in x do the state variables for node j start at?
         int *idxs = calloc(zarray_size(graph->nodes), sizeof(int));
@@ -151,47 +465,15 @@ void april_graph_cholesky(april_graph_t *graph, april_graph_cholesky_param_t *_p
         // we'll solve normal equations, Ax = B
         smatd_t *A = smatd_create(xlen, xlen);
         double  *B = calloc(xlen, sizeof(double));
+        if (!param->eval_cache)
+            param->eval_cache = april_graph_eval_cache_create();
+        // evaluate in parallel, then accumulate in factor order, so
+        // that A and B don't depend on the number of threads.
+        april_graph_eval_cache_update(param->eval_cache, graph, april_graph_taskpool(graph));
         for (int i = 0; i < zarray_size(graph->factors); i++) {
             april_graph_factor_t *factor;
             zarray_get(graph->factors, i, &factor);
-            april_graph_factor_eval_t *eval = factor->eval(factor, graph, NULL);
-
-            for (int z0 = 0; z0 < factor->nnodes; z0++) {
-                int n0 = factor->nodes[z0];
-
-                matd_t *JatW = matd_op("M'*M", eval->jacobians[z0], eval->W);
-
-                for (int z1 = 0; z1 < factor->nnodes; z1++) {
-                    int n1 = factor->nodes[z1];
-
-                    matd_t *JatWJb = matd_op("M*M", JatW, eval->jacobians[z1]);
-
-                    for (int row = 0; row < JatWJb->nrows; row++) {
-                        for (int col = 0; col < JatWJb->ncols; col++) {
-                            if(row+idxs[n0] > col+idxs[n1])
-                                continue;
-                            int a = row+idxs[n0];
-                            int b = col+idxs[n1];
-                            double v = smatd_get(A, a, b);
-                            double new_v = v + MATD_EL(JatWJb, row, col);
-                            smatd_set(A, a, b, new_v);
-                        }
-                    }
-
-                    matd_destroy(JatWJb);
-                }
-
-                matd_t *R = matd_create_data(eval->length, 1, eval->r);
-                matd_t *JatWr = matd_op("M*M", JatW, R);
-                for (int row = 0; row < JatWr->nrows; row++)
-                    B[idxs[n0]+row] += MATD_EL(JatWr, row, 0);
-
-                matd_destroy(R);
-                matd_destroy(JatW);
-                matd_destroy(JatWr);
-            }
-
-            april_graph_factor_eval_destroy(eval);
+            add_factor_eval(factor, param->eval_cache->evals[i], idxs, A, NULL, B, NULL);
         }
 
         if (param->tikhanov > 0) {
@@ -231,7 +513,18 @@ void april_graph_cholesky(april_graph_t *graph, april_graph_cholesky_param_t *_p
             css *S ;
             csn *N ;
             S = cs_schol (A, order) ;		/* ordering and symbolic analysis */
-            N = cs_chol (A, S) ;		/* numeric Cholesky factorization */
+            if (septree) {
+                // xpos[i]: first scalar of the i'th node of the ordering.
+                int *xpos = calloc(zarray_size(graph->nodes) + 1, sizeof(int));
+                for (int i = 0; i < zarray_size(graph->nodes); i++)
+                    xpos[i] = idxs[allocated_ordering[i]];
+                xpos[zarray_size(graph->nodes)] = xlen;
+                N = april_graph_separator_tree_chol(septree, xpos, A, S, april_graph_taskpool(graph));
+                free(xpos);
+                april_graph_separator_tree_destroy(septree);
+            } else {
+                N = cs_chol (A, S) ;		/* numeric Cholesky factorization */
+            }
             //convert N to chol->u
             cs *L = N->L;
             for(int k = 0; k < xlen; k++) {
@@ -269,6 +562,7 @@ void april_graph_cholesky(april_graph_t *graph, april_graph_cholesky_param_t *_p
         param->tr = search_tree_create_from_smat(chol->u, allocated_ordering, idxs, graph);
         param->tr->delta_xy = param->delta_xy;
         param->tr->delta_theta = param->delta_theta;
+        param->tr->changes = &param->changes;
         timeprofile_stamp(tp, "generate tree");
 
         if(param->B) {
@@ -280,21 +574,51 @@ void april_graph_cholesky(april_graph_t *graph, april_graph_cholesky_param_t *_p
             smatd_destroy(param->A);
         }
         param->A = A;
+        if(param->lean) {
+            smatd_destroy(A);
+            param->A = NULL;
+        }
         if(param->ordering)
             free(param->ordering);
 
         param->ordering = allocated_ordering;
         param->nreordering = zarray_size(graph->nodes);
         param->factor_num = zarray_size(graph->factors);
+
+        // The buffers above were allocated to fit exactly; record that
+        // as their capacity and then grow them for any reservation.
+        if(param->y) {
+            free(param->y);
+        }
+        param->y = calloc(xlen, sizeof(double));
+        if(param->delta_x) {
+            free(param->delta_x);
+        }
+        param->delta_x = calloc(xlen, sizeof(double));
+        // the incremental steps extend idxs as nodes are appended.
+        if(param->idxs) {
+            free(param->idxs);
+        }
+        param->idxs = idxs;
+        param->nalloc = zarray_size(graph->nodes);
+        param->xalloc = xlen;
+        {
+            int nnodes = zarray_size(graph->nodes);
+            if (param->reserve_nnodes > nnodes)
+                nnodes = param->reserve_nnodes;
+            cholesky_param_ensure_capacity(param, nnodes, 3 * nnodes); // HARD CODE: xyt_node, so 3 here.
+        }
+        // the factorization's rows were also allocated to fit exactly.
+        if (param->reserve_row_nz) {
+            smatd_reserve_rows(param, param->chol->u, 0, xlen);
+            if (param->A)
+                smatd_reserve_rows(param, param->A, 0, xlen);
+        }
         {
             timeprofile_t *tp = timeprofile_create();
             timeprofile_stamp(tp, "begin");
 
-            if(param->y) {
-                free(param->y);
-            }
-            param->y = calloc(param->chol->u->ncols, sizeof(double));
-            double *x = calloc(param->chol->u->ncols, sizeof(double));
+            double *x = param->delta_x;
             smatd_chol_solve_full(param->chol, param->B, param->y, x);
             int *use_ordering = param->ordering;
             int *idxs = calloc(param->nreordering, sizeof(int));
@@ -311,7 +635,7 @@ void april_graph_cholesky(april_graph_t *graph, april_graph_cholesky_param_t *_p
             for (int i = param->nreordering - 1; i >= 0; i--) {
                 april_graph_node_t *node;
                 zarray_get(graph->nodes, i, &node);
-                node->update(node, &x[idxs[i]]);
+                changes_update_node(&param->changes, node, i, &x[idxs[i]]);
             }
             timeprofile_stamp(tp, "solve");
             if (param->show_timing)
@@ -357,16 +681,9 @@ void april_graph_cholesky(april_graph_t *graph, april_graph_cholesky_param_t *_p
                     timeprofile_display(tp);
                 timeprofile_destroy(tp);
             }
-            free(x);
             free(idxs);
             cs_spfree(CS_A);
-            if(param->delta_x) {
-                free(param->delta_x);
-                param->delta_x = x;
-            }
-
         }
-        free(idxs);
         timeprofile_destroy(tp);
     }
     else {
@@ -374,11 +691,209 @@ void april_graph_cholesky(april_graph_t *graph, april_graph_cholesky_param_t *_p
     }
 }
 
+/////////////////////////////////////////////////////////////
+// Background batch re-factorization
+
+struct april_graph_batch_job
+{
+    pthread_t thread;
+
+    // copies of the graph's nodes when the job started. The factors
+    // are borrowed from the graph: they are only read, and the
+    // factors appended later don't show up here.
+    april_graph_t *snapshot;
+
+    april_graph_cholesky_param_t *param; // the new factorization
+    double batch_time;                   // ms
+    int done;
+};
+
+static void *batch_job_main(void *arg)
+{
+    april_graph_batch_job_t *job = arg;
+
+    int64_t utime0 = utime_now();
+    cholesky_batch(job->snapshot, job->param);
+    job->batch_time = (utime_now() - utime0) / 1.0E3;
+
+    __atomic_store_n(&job->done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static void batch_job_free(april_graph_batch_job_t *job);
+
+// Returns zero on success, or non-zero if the thread couldn't be
+// started, in which case nothing changes.
+static int batch_job_start(april_graph_t *graph, april_graph_cholesky_param_t *param)
+{
+    april_graph_batch_job_t *job = calloc(1, sizeof(april_graph_batch_job_t));
+
+    april_graph_t *snapshot = calloc(1, sizeof(april_graph_t));
+    snapshot->nodes = zarray_create(sizeof(april_graph_node_t*));
+    snapshot->factors = zarray_copy(graph->factors);
+    snapshot->taskpool = graph->taskpool;
+    zarray_ensure_capacity(snapshot->nodes, zarray_size(graph->nodes));
+    for (int i = 0; i < zarray_size(graph->nodes); i++) {
+        april_graph_node_t *node;
+        zarray_get(graph->nodes, i, &node);
+        april_graph_node_t *copy = node->copy(node);
+        zarray_add(snapshot->nodes, &copy);
+    }
+    job->snapshot = snapshot;
+
+    april_graph_cholesky_param_t *bp = calloc(1, sizeof(april_graph_cholesky_param_t));
+    april_graph_cholesky_param_init(bp);
+    bp->tikhanov = param->tikhanov;
+    bp->lean = param->lean;
+    bp->l_thresh = param->l_thresh;
+    bp->delta_thresh = param->delta_thresh;
+    bp->nthreshold = param->nthreshold;
+    bp->delta_xy = param->delta_xy;
+    bp->delta_theta = param->delta_theta;
+    bp->reserve_nnodes = param->reserve_nnodes;
+    bp->reserve_nfactors = param->reserve_nfactors;
+    bp->reserve_row_nz = param->reserve_row_nz;
+    bp->nested_dissection = param->nested_dissection;
+    job->param = bp;
+
+    if (pthread_create(&job->thread, NULL, batch_job_main, job)) {
+        batch_job_free(job);
+        return -1;
+    }
+    param->job = job;
+    return 0;
+}
+
+// Frees everything a job whose thread has stopped still owns.
+static void batch_job_free(april_graph_batch_job_t *job)
+{
+    april_graph_cholesky_param_destory(job->param);
+    for (int i = 0; i < zarray_size(job->snapshot->nodes); i++) {
+        april_graph_node_t *node;
+        zarray_get(job->snapshot->nodes, i, &node);
+        node->destroy(node);
+    }
+    zarray_destroy(job->snapshot->nodes);
+    zarray_destroy(job->snapshot->factors);
+    free(job->snapshot);
+    free(job);
+}
+
+static void batch_job_destroy(april_graph_batch_job_t *job)
+{
+    pthread_join(job->thread, NULL);
+    batch_job_free(job);
+}
+
+// Replace the factorization in 'param' with the finished job's. The
+// nodes in the snapshot take its linearization points and solution;
+// nodes and factors that arrived since are left for the incremental
+// step to add on top.
+static void batch_job_swap_in(april_graph_t *graph, april_graph_cholesky_param_t *param)
+{
+    april_graph_batch_job_t *job = param->job;
+    param->job = NULL;
+    pthread_join(job->thread, NULL);
+
+    april_graph_cholesky_param_t *bp = job->param;
+    int nnodes = zarray_size(job->snapshot->nodes);
+
+    for (int i = 0; i < nnodes; i++) {
+        april_graph_node_t *node, *snap;
+        zarray_get(graph->nodes, i, &node);
+        zarray_get(job->snapshot->nodes, i, &snap);
+        memcpy(node->l_point, snap->l_point, node->length * sizeof(double));
+        changes_update_node(&param->changes, node, i, snap->delta_X);
+    }
+
+    if (param->chol)
+        smatd_chol_destroy(param->chol);
+    if (param->A)
+        smatd_destroy(param->A);
+    if (param->tr)
+        search_tree_destroy(param->tr);
+    free(param->B);
+    free(param->y);
+    free(param->delta_x);
+    free(param->ordering);
+    free(param->idxs);
+
+    param->chol = bp->chol;
+    param->A = bp->A;
+    param->tr = bp->tr;
+    param->B = bp->B;
+    param->y = bp->y;
+    param->delta_x = bp->delta_x;
+    param->ordering = bp->ordering;
+    param->idxs = bp->idxs;
+    param->xalloc = bp->xalloc;
+    param->nalloc = bp->nalloc;
+    param->nreordering = bp->nreordering;
+    param->factor_num = bp->factor_num;
+    param->batch_time = job->batch_time;
+
+    // the tree still points at the snapshot.
+    search_tree_t *tr = param->tr;
+    april_graph_node_t **nodes_array = (april_graph_node_t**)graph->nodes->data;
+    for (int i = 0; i < tr->nnodes; i++) {
+        tr->nodes[i].g_node = nodes_array[i];
+        tr->nodes[i].g_node->UID = i;
+    }
+    tr->changes = &param->changes;
+
+    bp->chol = NULL;
+    bp->A = NULL;
+    bp->tr = NULL;
+    bp->B = NULL;
+    bp->y = NULL;
+    bp->delta_x = NULL;
+    bp->ordering = NULL;
+    bp->idxs = NULL;
+    batch_job_free(job);
+}
+
+int april_graph_cholesky_batch_pending(const april_graph_cholesky_param_t *param)
+{
+    return param->job != NULL;
+}
+
+void april_graph_cholesky_batch_wait(april_graph_t *graph, april_graph_cholesky_param_t *param)
+{
+    if (param->job) {
+        changes_begin(&param->changes);
+        batch_job_swap_in(graph, param);
+        chi2_step(graph, param);
+    }
+}
+
+void april_graph_cholesky_batch_cancel(april_graph_cholesky_param_t *param)
+{
+    if (param->job) {
+        batch_job_destroy(param->job);
+        param->job = NULL;
+    }
+}
+
+static void cholesky_inc(april_graph_t *graph, april_graph_cholesky_param_t *param);
+
 void april_graph_cholesky_inc(april_graph_t *graph, april_graph_cholesky_param_t *param)
+{
+    changes_begin(&param->changes);
+    cholesky_inc(graph, param);
+    chi2_step(graph, param);
+}
+
+static void cholesky_inc(april_graph_t *graph, april_graph_cholesky_param_t *param)
 {
     // nothing to do
     if (zarray_size(graph->nodes) == 0 || zarray_size(graph->factors) == 0)
         return;
+    // a finished background batch replaces the factorization; the
+    // factors added since it started are replayed below. Whether it
+    // has finished depends on timing, so a deterministic solver
+    // always waits for it in the step after the one that started it.
+    if (param->job && (param->deterministic || __atomic_load_n(&param->job->done, __ATOMIC_ACQUIRE)))
+        batch_job_swap_in(graph, param);
     if(!param->chol)
         return;
     if(param->factor_num == zarray_size(graph->factors))
@@ -386,49 +901,39 @@ void april_graph_cholesky_inc(april_graph_t *graph, april_graph_cholesky_param_t
 
     // Use chol instead of long variable name param->chol
     smatd_chol_t *chol = param->chol;
-    timeprofile_t *tp = timeprofile_create();
+    if (!param->tp)
+        param->tp = timeprofile_create();
+    timeprofile_t *tp = param->tp;
+    timeprofile_clear(tp);
     timeprofile_stamp(tp, "begin");
 
+    // Augment reward B, y, chol->u, ordering and idxs if number of nodes gets larger
+    int nnodes_graph = zarray_size(graph->nodes);
+    cholesky_param_ensure_capacity(param, nnodes_graph, 3 * nnodes_graph); // HARD CODE: xyt_node, so 3 here.
+
     // Ordering is already augmented, same size as number of nodes
-    int *use_ordering = realloc(param->ordering, sizeof(int)*zarray_size(graph->nodes));
-    for(int i = param->nreordering; i < zarray_size(graph->nodes); i++) {
+    int *use_ordering = param->ordering;
+    for(int i = param->nreordering; i < nnodes_graph; i++) {
         use_ordering[i] = i;
     }
-    param->ordering = use_ordering;
 
     // idxs[j]: what index in x do the state variables for node j start at?
-    int *idxs = calloc(zarray_size(graph->nodes), sizeof(int));
-    int xlen = 0;
-    for (int i = 0; i < zarray_size(graph->nodes); i++) {
+    // Entries of nodes already in the factorization don't move; new
+    // nodes are ordered last, so their states go after the current x.
+    int *idxs = param->idxs;
+    int xlen = chol->u->nrows;
+    for (int i = param->nreordering; i < nnodes_graph; i++) {
         april_graph_node_t *node;
         zarray_get(graph->nodes, use_ordering[i], &node);
         idxs[use_ordering[i]] = xlen;
         xlen += node->length;
     }
     assert(xlen > 0);
+    assert(xlen <= param->xalloc);
     //timeprofile_stamp(tp, "augment ordering");
-    // Augment reward B, y, and chol->u if number of nodes gets larger
-    if(zarray_size(graph->nodes) > param->nreordering) {
-        //TODO: Could be smart if we pre-allocate lots of memory of A, B, etc...
-        double *B = calloc(xlen, sizeof(double));
-        memcpy(B, param->B, sizeof(double)*chol->u->nrows);
-        free(param->B);
-        param->B = B;
-
-        double *y = calloc(xlen, sizeof(double));
-        memcpy(y, param->y, sizeof(double)*chol->u->nrows);
-        free(param->y);
-        param->y= y;
-
-        svecd_t *rows = calloc(xlen, sizeof(svecd_t));
-        memcpy(rows, chol->u->rows, sizeof(svecd_t) * chol->u->nrows);
-        free(chol->u->rows);
-        chol->u->rows = rows;
-
-        //XXX: Why use realloc not working?
-        //chol->u->rows = realloc(chol->u->rows, xlen * sizeof(svecd_t));
-        //param->B = realloc(param->B, sizeof(double) * xlen);
-
+    if(nnodes_graph > param->nreordering) {
+        // New rows are already zeroed, we only need to extend the
+        // matrix dimensions.
         chol->u->nrows = xlen;
         chol->u->ncols = xlen;
 
@@ -437,15 +942,13 @@ void april_graph_cholesky_inc(april_graph_t *graph, april_graph_cholesky_param_t
         }
         //XXX: This part is used for keeping previous information matrix; it seems not helping a lot for current
         //testing, and will investigate this later.
-        svecd_t *A_rows = calloc(xlen, sizeof(svecd_t));
-        memcpy(A_rows, param->A->rows, sizeof(svecd_t) * param->A->nrows);
-        free(param->A->rows);
-        param->A->rows = A_rows;
-        param->A->nrows = xlen;
-        param->A->ncols = xlen;
+        if(param->A) {
+            param->A->nrows = xlen;
+            param->A->ncols = xlen;
 
-        for (int i = 0; i < chol->u->nrows; i++) {
-            param->A->rows[i].length = param->A->ncols;
+            for (int i = 0; i < chol->u->nrows; i++) {
+                param->A->rows[i].length = param->A->ncols;
+            }
         }
     }
 
@@ -456,19 +959,11 @@ void april_graph_cholesky_inc(april_graph_t *graph, april_graph_cholesky_param_t
     tr->nnodes = zarray_size(graph->nodes);
     int root_id = tr->root->id;
     april_graph_node_t **nodes_array = (april_graph_node_t**)graph->nodes->data;
-    if (tr->nnodes >= tr->nalloc) {
-        tr->nalloc = tr->nnodes * 2;
-        search_tree_node_t *tmp = calloc(tr->nalloc, sizeof(search_tree_node_t));
-        memcpy(tmp, tr->nodes, nnodes * sizeof(search_tree_node_t));
-        free(tr->nodes);
-        tr->nodes = tmp;
-        tr->linearized_nodes = realloc(tr->linearized_nodes, tr->nalloc * sizeof(int));
-    }
+    search_tree_reserve(tr, tr->nnodes);
     tr->root = &(tr->nodes[use_ordering[root_id]]);
     for(int i = nnodes; i < tr->nnodes; i++) {
-        tr->nodes[i].nalloc = 8;
+        // search_tree_reserve() already gave the node a children array.
         tr->nodes[i].nchildren = 0;
-        tr->nodes[i].children = calloc(tr->nodes[i].nalloc, sizeof(int));
         tr->nodes[i].parent = -1;
         tr->nodes[i].g_node = nodes_array[i];
         tr->nodes[i].g_node->UID = i;
@@ -505,40 +1000,15 @@ void april_graph_cholesky_inc(april_graph_t *graph, april_graph_cholesky_param_t
     // we'll solve normal equations, Ax = B
     double  *B = param->B;
     //Add new information into A and B.
+    if (!param->eval_cache)
+        param->eval_cache = april_graph_eval_cache_create();
     for (int i = param->factor_num; i < zarray_size(graph->factors); i++) {
         april_graph_factor_t *factor;
         zarray_get(graph->factors, i, &factor);
-        april_graph_factor_eval_t *eval = factor->eval(factor, graph, NULL);
-        for (int z0 = 0; z0 < factor->nnodes; z0++) {
-            int n0 = factor->nodes[z0];
-            matd_t *JatW = matd_op("M'*M", eval->jacobians[z0], eval->W);
-            for (int z1 = 0; z1 < factor->nnodes; z1++) {
-                int n1 = factor->nodes[z1];
-                matd_t *JatWJb = matd_op("M*M", JatW, eval->jacobians[z1]);
-                for (int row = 0; row < JatWJb->nrows; row++) {
-                    for (int col = 0; col < JatWJb->ncols; col++) {
-                        if(row+idxs[n0] > col+idxs[n1])
-                            continue;
-                        double v = smatd_get(chol->u, row+idxs[n0], col+idxs[n1]);
-                        smatd_set(chol->u, row+idxs[n0], col+idxs[n1], v + MATD_EL(JatWJb, row, col));
-                        v = smatd_get(param->A, row+idxs[n0], col+idxs[n1]);
-                        smatd_set(param->A, row+idxs[n0], col+idxs[n1], v + MATD_EL(JatWJb, row, col));
-                    }
-                }
-                matd_destroy(JatWJb);
-            }
-            matd_t *R = matd_create_data(eval->length, 1, eval->r);
-            matd_t *JatWr = matd_op("M*M", JatW, R);
-            for (int row = 0; row < JatWr->nrows; row++) {
-                B[idxs[n0]+row] += MATD_EL(JatWr, row, 0);
-                param->y[idxs[n0]+row] += MATD_EL(JatWr, row, 0);
-                assert(idxs[n0]+row < xlen);
-            }
-            matd_destroy(R);
-            matd_destroy(JatW);
-            matd_destroy(JatWr);
-        }
-        april_graph_factor_eval_destroy(eval);
+        april_graph_factor_eval_t *eval = april_graph_eval_cache_get_scratch(param->eval_cache, graph, i);
+        for (int z0 = 0; z0 < factor->nnodes; z0++)
+            assert(idxs[factor->nodes[z0]] + eval->jacobians[z0]->ncols <= xlen);
+        add_factor_eval(factor, eval, idxs, chol->u, param->A, B, param->y);
     }
     // We have param->factor_num factors
     param->factor_num = zarray_size(graph->factors);
@@ -554,20 +1024,25 @@ void april_graph_cholesky_inc(april_graph_t *graph, april_graph_cholesky_param_t
         timeprofile_display(tp);
     }
     //HACK: takes longer than 150 ms
-    if(1.0E-3 * timeprofile_total_utime(tp) > param->batch_time / 3) {
+    if(!param->deterministic && 1.0E-3 * timeprofile_total_utime(tp) > param->batch_time / 3) {
         param->tr->start_over = INT_MAX;
     }
-    timeprofile_destroy(tp);
 
     param->nreordering = zarray_size(graph->nodes);
     april_graph_cholesky_inc_solver(graph, param, idxs);
-    free(idxs);
 
-    if(param->tr->start_over > param->nthreshold) {
+    // without a thread for the background batch, run it right here.
+    if(param->tr->start_over > param->nthreshold && param->background &&
+       (param->job || !batch_job_start(graph, param))) {
+        param->tr->start_over = 0;
+    } else if(param->tr->start_over > param->nthreshold) {
         free(param->ordering);
         param->ordering = NULL;
+        param->nalloc = 0;
+        free(param->idxs);
+        param->idxs = NULL;
         int64_t utime0 = utime_now();
-        april_graph_cholesky(graph, param);
+        cholesky_batch(graph, param);
         int64_t utime1 = utime_now();
         param->batch_time = (utime1 - utime0) / 1.0E3;
         param->tr->start_over = 0;
@@ -578,24 +1053,89 @@ void april_graph_cholesky_inc(april_graph_t *graph, april_graph_cholesky_param_t
 void april_graph_cholesky_inc_solver(april_graph_t *graph, april_graph_cholesky_param_t *param, int *idxs)
 {
     if(param->nreordering) {
-        timeprofile_t *tp = timeprofile_create();
+        if (!param->tp)
+            param->tp = timeprofile_create();
+        timeprofile_t *tp = param->tp;
+        timeprofile_clear(tp);
         timeprofile_stamp(tp, "begin");
-        double *x = calloc(param->chol->u->ncols, sizeof(double));
-        smatd_chol_solve_tr(param->chol, param->B, param->y, x, param->tr);
+        // delta_x has capacity for chol->u->ncols; the tree solver only
+        // reads entries it has written during this solve.
+        smatd_chol_solve_tr(param->chol, param->B, param->y, param->delta_x, param->tr);
         assert(param->nreordering <= zarray_size(graph->nodes));
         timeprofile_stamp(tp, "solve");
         if (param->show_timing)
             timeprofile_display(tp);
-        timeprofile_destroy(tp);
-        if(param->delta_x) {
-            free(param->delta_x);
-            param->delta_x = x;
-        } else {
-            free(x);
-        }
     }
 }
 
+smatd_t *april_graph_cholesky_information(const april_graph_cholesky_param_t *param)
+{
+    if (!param->chol)
+        return NULL;
+
+    smatd_t *u = param->chol->u;
+    smatd_t *ut = smatd_transpose(u);
+    smatd_t *utu = smatd_multiply(ut, u);
+    smatd_t *A = smatd_upper_right(utu);
+    smatd_destroy(ut);
+    smatd_destroy(utu);
+    return A;
+}
+
+// bytes held by a matrix whose row array has room for 'nrows' rows.
+static size_t smatd_memory(const smatd_t *m, int nrows)
+{
+    if (!m)
+        return 0;
+
+    size_t bytes = sizeof(smatd_t) + nrows * sizeof(svecd_t);
+    for (int i = 0; i < nrows; i++)
+        bytes += m->rows[i].alloc * (sizeof(int) + sizeof(double));
+    return bytes;
+}
+
+void april_graph_cholesky_memory(const april_graph_cholesky_param_t *param, april_graph_cholesky_memory_t *mem)
+{
+    memset(mem, 0, sizeof(april_graph_cholesky_memory_t));
+
+    // rows of chol->u and A beyond nrows are allocated too (see
+    // cholesky_param_ensure_capacity).
+    if (param->chol) {
+        int nrows = param->xalloc > param->chol->u->nrows ? param->xalloc : param->chol->u->nrows;
+        mem->u = sizeof(smatd_chol_t) + smatd_memory(param->chol->u, nrows);
+    }
+    if (param->A) {
+        int nrows = param->xalloc > param->A->nrows ? param->xalloc : param->A->nrows;
+        mem->A = smatd_memory(param->A, nrows);
+    }
+
+    mem->vectors = 3 * param->xalloc * sizeof(double) + 2 * param->nalloc * sizeof(int) +
+        (param->changes.alloc + param->changes.touched_alloc + 2 * param->changes.mark_alloc) * sizeof(int) +
+        APRIL_GRAPH_CHANGES_MAX_LENGTH * param->changes.mark_alloc * sizeof(double);
+
+    if (param->tr) {
+        const search_tree_t *tr = param->tr;
+        mem->tree = sizeof(search_tree_t) + tr->nalloc * (sizeof(search_tree_node_t) + sizeof(int));
+        for (int i = 0; i < tr->nalloc; i++)
+            mem->tree += tr->nodes[i].nalloc * sizeof(int);
+    }
+
+    mem->eval_cache = april_graph_eval_cache_memory(param->eval_cache);
+
+    mem->total = mem->u + mem->A + mem->vectors + mem->tree + mem->eval_cache;
+}
+
+void april_graph_cholesky_memory_print(const april_graph_cholesky_memory_t *mem)
+{
+    printf("solver memory:\n");
+    printf("  %-12s %12.1f KB\n", "chol->u", mem->u / 1024.0);
+    printf("  %-12s %12.1f KB\n", "A", mem->A / 1024.0);
+    printf("  %-12s %12.1f KB\n", "vectors", mem->vectors / 1024.0);
+    printf("  %-12s %12.1f KB\n", "tree", mem->tree / 1024.0);
+    printf("  %-12s %12.1f KB\n", "eval cache", mem->eval_cache / 1024.0);
+    printf("  %-12s %12.1f KB\n", "total", mem->total / 1024.0);
+}
+
 search_tree_t *search_tree_create(int nnodes)
 {
     search_tree_t *tr = calloc(1, sizeof(search_tree_t));
@@ -674,6 +1214,29 @@ static void print_node(search_tree_t *tr, search_tree_node_t* node)
     }
 }
 
+void search_tree_reserve(search_tree_t *tr, int nnodes)
+{
+    if (nnodes <= tr->nalloc)
+        return;
+
+    int nalloc = tr->nalloc > 0 ? tr->nalloc : 1;
+    while (nalloc < nnodes)
+        nalloc *= 2;
+
+    // root points into the array that is about to move.
+    int root = tr->root ? tr->root - tr->nodes : -1;
+    tr->nodes = grow_buffer(tr->nodes, tr->nalloc, nalloc, sizeof(search_tree_node_t));
+    tr->linearized_nodes = grow_buffer(tr->linearized_nodes, tr->nalloc, nalloc, sizeof(int));
+    for (int i = tr->nalloc; i < nalloc; i++) {
+        tr->nodes[i].nalloc = 8;
+        tr->nodes[i].children = calloc(tr->nodes[i].nalloc, sizeof(int));
+        tr->nodes[i].parent = -1;
+    }
+    if (root >= 0)
+        tr->root = &tr->nodes[root];
+    tr->nalloc = nalloc;
+}
+
 void search_tree_print(search_tree_t *tr)
 {
     printf("root id: %d, nnodes:%d\n", tr->root->g_node->UID, tr->nnodes);
@@ -770,7 +1333,10 @@ static void solve_node(search_tree_t *tr, search_tree_node_t* node, smatd_t *u,
                     }
                 }
             }
-            node->g_node->update(node->g_node, &x[i]);
+            if (tr->changes)
+                changes_update_node(tr->changes, node->g_node, node->g_node->UID, &x[i]);
+            else
+                node->g_node->update(node->g_node, &x[i]);
         }
     }
     for (int i = 0; i < node->nchildren; i++) {
@@ -837,14 +1403,8 @@ static void recursive_reconstruct_u(smatd_chol_t *chol, search_tree_t *tr, searc
 void smatd_chol_reconstruct_tr(smatd_chol_t *chol, int *ordering, search_tree_t *tr, double *y)
 {
     //call reconstruct_y before reconstruct_u
-    timeprofile_t *tp = timeprofile_create();
-    //timeprofile_stamp(tp, "begin");
     recursive_reconstruct_y(chol, y, tr, tr->root);
-    //timeprofile_stamp(tp, "y");
     recursive_reconstruct_u(chol, tr, tr->root);
-    //timeprofile_stamp(tp, "u");
-    timeprofile_display(tp);
-    timeprofile_destroy(tp);
 }
 
 static void recursive_chol_decomp(smatd_chol_t *chol, search_tree_t *tr, search_tree_node_t *node)
@@ -24,6 +24,7 @@ License along with this library; if not, see <http://www.gnu.org/licenses/>.
 #ifndef _APRIL_GRAPH_H
 #define _APRIL_GRAPH_H
 
+#include <stdint.h>
 #include <stdlib.h>
 
 #include "./common/doubles.h"
@@ -32,6 +33,7 @@ License along with this library; if not, see <http://www.gnu.org/licenses/>.
 #include "./common/smatd.h"
 #include "./common/string_util.h"
 #include "./common/stype.h"
+#include "./common/taskpool.h"
 #include "./common/timeprofile.h"
 #include "./common/zarray.h"
 #include "./common/zhash.h"
@@ -69,8 +71,16 @@ struct april_graph
 
     april_graph_attr_t *attr;
     const stype_t *stype;
+
+    // pool for parallel work on this graph; NULL: taskpool_get_default().
+    taskpool_t *taskpool;
 };
 
+// the graph's task pool.
+taskpool_t *april_graph_taskpool(const april_graph_t *graph);
+
+typedef struct april_graph_info april_graph_info_t;
+
 /** april_graph_factor_eval */
 typedef struct april_graph_factor_eval april_graph_factor_eval_t;
 struct april_graph_factor_eval
@@ -86,8 +96,56 @@ struct april_graph_factor_eval
     int length;
     double *r; // residual (length x 1)
     matd_t *W; // information matrix of observation (length x length)
+
+    // Set by factors with an interned W (see april_graph_info_eval_W()):
+    // the entry, and the serial number of the entry W was copied from.
+    const april_graph_info_t *info;
+    uint64_t info_serial;
+};
+
+/** april_graph_info
+    Interned, reference-counted information matrices. Most factors
+    share one of a handful of covariances, so each distinct W is stored
+    once, along with the packed upper triangles of its symmetric part
+    and of a square root R (W = R'*R). Factors hold an index into
+    this table.
+
+    When W is symmetric positive definite, the solver pre-whitens
+    with R: J'WJ and J'Wr are accumulated as (RJ)'(RJ) and (RJ)'(Rr).
+    Otherwise R is only an approximation and W is used as is. */
+struct april_graph_info
+{
+    int idx;
+    int dim;
+    int refcnt;
+    uint64_t serial; // unique over the life of the process
+
+    double *W;     // packed upper triangle (row-major) of (W+W')/2
+    double *R;     // packed upper triangular square-root information
+    int whiten;    // non-zero if W is symmetric positive definite, so that W = R'*R
+    matd_t *Wmat;  // the exact dense W, shared by all users
 };
 
+// Returns the index of W in the table, adding a reference (and the
+// entry, if needed), or -1 if the table already has INT_MAX entries.
+// The caller keeps ownership of W.
+int april_graph_info_intern(const matd_t *W);
+int april_graph_info_intern_data(int dim, const double *W);
+void april_graph_info_retain(int idx);
+void april_graph_info_release(int idx);
+const april_graph_info_t *april_graph_info_get(int idx);
+
+// number of distinct information matrices currently in use.
+int april_graph_info_count();
+
+// out = R*v (pre-whitening). v and out are dim x 1.
+void april_graph_info_whiten(const april_graph_info_t *info, const double *v, double *out);
+// r'*W*r, computed with the dense W.
+double april_graph_info_chi2(const april_graph_info_t *info, const double *r);
+// Point eval at the interned W 'idx', copying it into eval->W only
+// if eval->W doesn't already hold it.
+void april_graph_info_eval_W(april_graph_factor_eval_t *eval, int idx);
+
 #define APRIL_GRAPH_FACTOR_XYT_TYPE 1
 #define APRIL_GRAPH_FACTOR_XYTPOS_TYPE 2
 
@@ -127,7 +185,8 @@ struct april_graph_factor
         struct {
             double *z;
             double *ztruth;
-            matd_t *W;
+            matd_t *W;     // shared with every factor using the same info; do not modify
+            int     info;  // index of the interned information matrix (april_graph_info)
             void   *impl;
         } common;
 
@@ -187,6 +246,91 @@ void april_graph_destroy(april_graph_t *graph);
 
 void april_graph_factor_eval_destroy(april_graph_factor_eval_t *eval);
 
+/** april_graph_eval_cache
+    Persistent eval objects, one per factor index, owned by the
+    solver. Each slot remembers the linearization point of the
+    factor's nodes when it was last evaluated (and their state, for
+    factors whose eval reads it, e.g. xytpos); as long as those are
+    unchanged, the Jacobians and residual are reused without
+    calling factor->eval again. Otherwise the slot's eval object is
+    recycled through factor->eval.
+
+    A slot recognizes its factor only by address. A factor that is
+    modified in place, or freed and replaced by one that may get the
+    same address, must be invalidated with
+    april_graph_eval_cache_invalidate() before the next lookup. */
+#define APRIL_GRAPH_EVAL_CACHE_NSCRATCH 8
+
+typedef struct april_graph_eval_cache april_graph_eval_cache_t;
+struct april_graph_eval_cache
+{
+    int nfactors;  // number of slots in use
+    int nalloc;
+
+    april_graph_factor_t **factors;     // factor each slot was evaluated for
+    april_graph_factor_eval_t **evals;
+    double **lpoints;                   // per node: l_point, then state unless xyt
+
+    // Evals shared by all factors of one type, for
+    // april_graph_eval_cache_get_scratch().
+    int nscratch;
+    int scratch_types[APRIL_GRAPH_EVAL_CACHE_NSCRATCH];
+    april_graph_factor_eval_t *scratch[APRIL_GRAPH_EVAL_CACHE_NSCRATCH];
+
+    int64_t nevals; // calls to factor->eval
+    int64_t nhits;  // lookups answered without evaluating
+};
+
+april_graph_eval_cache_t *april_graph_eval_cache_create();
+void april_graph_eval_cache_destroy(april_graph_eval_cache_t *cache);
+void april_graph_eval_cache_clear(april_graph_eval_cache_t *cache);
+void april_graph_eval_cache_reserve(april_graph_eval_cache_t *cache, int nfactors);
+// Drop the eval of factor 'fidx', e.g. after the factor was replaced.
+void april_graph_eval_cache_invalidate(april_graph_eval_cache_t *cache, int fidx);
+
+// Returns an eval of factor 'fidx' that is consistent with the current
+// linearization point. The eval belongs to the cache and remains valid
+// until the next call for the same factor index.
+april_graph_factor_eval_t *april_graph_eval_cache_get(april_graph_eval_cache_t *cache, april_graph_t *graph, int fidx);
+
+// Bring the slots of all factors of the graph up to date, evaluating
+// the stale ones in parallel on 'tp'. Afterwards, cache->evals[i] is
+// the eval of factor i.
+void april_graph_eval_cache_update(april_graph_eval_cache_t *cache, april_graph_t *graph, taskpool_t *tp);
+
+// Like april_graph_eval_cache_get(), but a factor without a valid
+// slot is evaluated into a scratch eval shared by all factors of the
+// same type rather than into a slot of its own. The eval is only
+// valid until the next call. Once every factor type has been seen,
+// this never allocates.
+april_graph_factor_eval_t *april_graph_eval_cache_get_scratch(april_graph_eval_cache_t *cache, april_graph_t *graph, int fidx);
+
+// The eval in slot 'fidx' if it is up to date, or NULL. Never
+// evaluates or modifies the cache, so any number of threads may peek
+// at once (but not while the cache is being updated).
+april_graph_factor_eval_t *april_graph_eval_cache_peek(const april_graph_eval_cache_t *cache, april_graph_t *graph, int fidx);
+
+// heap bytes held by the cache, including its evals.
+size_t april_graph_eval_cache_memory(const april_graph_eval_cache_t *cache);
+
+/** Parallel chi2
+    Evaluates every factor at the current node states, like
+    april_graph_chi2(), on the graph's task pool, and returns the
+    total. The factors are summed in fixed blocks that are added in
+    order, so the result doesn't depend on the number of threads.
+
+    If 'cache' is non-NULL (e.g., the solver's param->eval_cache), a
+    factor whose slot is up to date and whose nodes are at their
+    linearization point reuses the slot's eval instead of being
+    evaluated again. The cache is only read.
+
+    'chi2s', if non-NULL, receives the chi2 of each factor (one per
+    factor). 'residuals', if non-NULL, receives the whitened residual
+    R*r of each factor (W = R'*R), one after the other in factor order;
+    april_graph_residual_length() is the total length. */
+double april_graph_chi2_eval(april_graph_t *graph, april_graph_eval_cache_t *cache, double *chi2s, double *residuals);
+int april_graph_residual_length(const april_graph_t *graph);
+
 typedef struct search_tree_node search_tree_node_t;
 struct search_tree_node
 {
@@ -200,6 +344,89 @@ struct search_tree_node
     int label_relinearized;
 };
 
+/** Changed nodes
+    The graph nodes whose state, after the last solver step (i.e., the
+    last call to april_graph_cholesky() or april_graph_cholesky_inc()),
+    is more than 'eps' away (in any component; angles are compared
+    modulo 2pi) from the state they had when they were last in the
+    set, or, if never, when the solver first updated them. Small moves
+    thus add up until they are reported, and a mirror that applies
+    every step's changes stays within eps. */
+#define APRIL_GRAPH_CHANGES_MAX_LENGTH 3 // longest node state (xyt)
+
+typedef struct april_graph_changes april_graph_changes_t;
+struct april_graph_changes
+{
+    double eps;     // default 0: any change counts
+
+    int n;          // number of changed nodes
+    int *nodes;     // their indices in graph->nodes, in no particular order
+    int alloc;
+
+    // mark[i] == step iff node i is in the set.
+    int *mark;
+    int mark_alloc;
+    int step;
+
+    // the state node i was last reported with, at
+    // APRIL_GRAPH_CHANGES_MAX_LENGTH*i; NAN until the node is first
+    // updated. mark_alloc nodes.
+    double *reported;
+
+    // every node the step updated, however little it moved, e.g., to
+    // re-evaluate the factors on them. touched_mark[i] == step iff
+    // node i is in this list (mark_alloc nodes).
+    int ntouched;
+    int *touched;
+    int touched_alloc;
+    int *touched_mark;
+};
+
+typedef struct april_graph_changes_iterator april_graph_changes_iterator_t;
+struct april_graph_changes_iterator
+{
+    const april_graph_changes_t *changes;
+    int pos;
+};
+
+void april_graph_changes_iterator_init(const april_graph_changes_t *changes, april_graph_changes_iterator_t *it);
+// Returns 1 and sets *idx to the next changed node, or returns 0.
+int april_graph_changes_iterator_next(april_graph_changes_iterator_t *it, int *idx);
+
+// Encode the current states of the changed nodes into a compact
+// message (node indices are delta coded). With data == NULL, only
+// returns the size. Returns the number of bytes written.
+uint64_t april_graph_changes_encode(const april_graph_changes_t *changes, const april_graph_t *graph, uint8_t *data);
+// Apply a message from april_graph_changes_encode() to a copy of the
+// graph. Returns the number of nodes updated, or -1 if the message is
+// malformed or refers to nodes that 'graph' doesn't have (in which
+// case 'graph' may be partially updated).
+int april_graph_changes_apply(april_graph_t *graph, const uint8_t *data, uint64_t datalen);
+
+/** Running chi2
+    Keeps the chi2 of every factor of a growing graph, and their
+    total, up to date across solver steps without evaluating every
+    factor: an update evaluates the factors added since the last one
+    and the factors on the nodes the last step touched (changes->touched,
+    which doesn't depend on changes->eps; at their current state,
+    reusing 'cache' like april_graph_chi2_eval()), and adjusts the
+    total by the difference. Every 'refresh' updates (<= 0: never),
+    and whenever most nodes were touched, everything is recomputed
+    instead, which bounds the round-off that accumulates in the total,
+    and picks up node states changed outside the solver. Factors must
+    not be removed or reordered. */
+typedef struct april_graph_chi2_tracker april_graph_chi2_tracker_t;
+
+april_graph_chi2_tracker_t *april_graph_chi2_tracker_create();
+void april_graph_chi2_tracker_destroy(april_graph_chi2_tracker_t *tracker);
+// Returns the new total.
+double april_graph_chi2_tracker_update(april_graph_chi2_tracker_t *tracker, april_graph_t *graph,
+                                       april_graph_eval_cache_t *cache, const april_graph_changes_t *changes,
+                                       int refresh);
+double april_graph_chi2_tracker_total(const april_graph_chi2_tracker_t *tracker);
+// the chi2 of each factor, as of the last update.
+const double *april_graph_chi2_tracker_factors(const april_graph_chi2_tracker_t *tracker);
+
 typedef struct search_tree search_tree_t;
 struct search_tree
 {
@@ -216,8 +443,11 @@ struct search_tree
     double delta_theta;
     double total_delta_xy;
     double total_delta_theta;
+    april_graph_changes_t *changes; // where solves record changed nodes
 };
 search_tree_t *search_tree_create(int nnodes);
+// make room for at least nnodes nodes (capacity doubles).
+void search_tree_reserve(search_tree_t *tr, int nnodes);
 void search_tree_print(search_tree_t *tr);
 void search_tree_destroy(search_tree_t *tr);
 
@@ -229,6 +459,7 @@ void smatd_chol_reconstruct_tr(smatd_chol_t *chol, int *ordering, search_tree_t
 
 //Incremental Cholesky
 typedef struct april_graph_cholesky_param april_graph_cholesky_param_t;
+typedef struct april_graph_batch_job april_graph_batch_job_t;
 struct april_graph_cholesky_param
 {
     // if non-zero, add tikahnov*I to the information matrix.
@@ -250,7 +481,26 @@ struct april_graph_cholesky_param
     double *delta_x;     // Record delta_x values in last iteration
     double *B;           // Record reward in last iteration
     double *y;           // Record last intermediate reward;
-    smatd_t *A;
+    smatd_t *A;          // upper triangle of the information matrix; NULL if lean
+
+    // Boolean; non-zero: don't keep A, which is only needed for
+    // inspection. It can be recovered with april_graph_cholesky_information().
+    int lean;
+
+    int *idxs;           // idxs[j]: what index in x do the state variables for node j start at?
+
+    // Capacities of the solver buffers, which grow geometrically.
+    int xalloc;          // scalars: B, y, delta_x, rows of chol->u and A
+    int nalloc;          // nodes: ordering, idxs
+
+    // Sizes requested with april_graph_cholesky_reserve().
+    int reserve_nnodes;
+    int reserve_nfactors;
+
+    // Fill estimate: non-zeros to reserve in each row of chol->u (and
+    // A) when the row is created or re-factored in a batch. 0: only a
+    // handful. Set before the first solve.
+    int reserve_row_nz;
 
     search_tree_t *tr;
 
@@ -262,11 +512,101 @@ struct april_graph_cholesky_param
 
     double delta_xy;
     double delta_theta;
+
+    // Evals of every factor, recycled across steps. Created on demand.
+    april_graph_eval_cache_t *eval_cache;
+
+    timeprofile_t *tp;  // reused by every incremental step
+
+    // nodes changed by the last step; set changes.eps to configure.
+    april_graph_changes_t changes;
+
+    // Boolean; non-zero: when april_graph_cholesky_inc() decides that a
+    // batch re-factorization is due, run it on a background thread
+    // against a snapshot of the graph, and keep serving incremental
+    // steps with the current factorization meanwhile. The first step
+    // after the batch finishes swaps it in and replays the factors
+    // added since the snapshot on top of it. The graph's existing
+    // nodes and factors must not be removed while a batch is pending.
+    int background;
+    april_graph_batch_job_t *job; // the pending background batch, if any
+
+    // Boolean; non-zero: update a running chi2 after every step (see
+    // april_graph_chi2_tracker_t), so that april_graph_cholesky_chi2()
+    // costs nothing. A full recompute happens every chi2_refresh
+    // steps (default 100).
+    int track_chi2;
+    int chi2_refresh;
+    april_graph_chi2_tracker_t *chi2;
+
+    // Boolean; non-zero: make the result of every step a function of
+    // the graph alone, bit for bit, whatever the number of threads or
+    // the timing. Parallel work is always split by factor or node
+    // index, with every sum taken in a fixed order; this additionally
+    // turns off the decisions that depend on time: an incremental
+    // step that is slow compared to the last batch no longer triggers
+    // a batch, and a background batch is swapped in by the step right
+    // after the one that started it, waiting for it if needed.
+    int deterministic;
+
+    // Boolean; non-zero: batch steps order the nodes by nested
+    // dissection instead of minimum degree, and factor the two sides
+    // of every separator in parallel on the graph's task pool (see
+    // april_graph_nested_dissection()). Experimental: on pose graphs
+    // the ordering usually has more fill than minimum degree, which
+    // the parallelism has to make up for.
+    int nested_dissection;
 };
 
 // initialize to default values.
 void april_graph_cholesky_param_init(april_graph_cholesky_param_t *param);
 void april_graph_cholesky_param_destory(april_graph_cholesky_param_t *param);
+// Pre-allocate solver buffers for a graph expected to grow to nnodes
+// nodes and nfactors factors. Optional; buffers grow geometrically
+// anyway, but a reservation avoids the copies along the way. With a
+// reservation, an incremental step that only appends odometry
+// allocates only when fill-in outgrows a row of the factor; rows
+// double, so that is amortized O(1). With param->reserve_row_nz at
+// least the densest row of the factor, such steps don't allocate at
+// all (examples/aprilsam_alloc_check counts it).
+void april_graph_cholesky_reserve(april_graph_cholesky_param_t *param, int nnodes, int nfactors);
+// Returns the upper triangle of the current information matrix,
+// computed as U'U from the factorization (works in lean mode too).
+// The caller must destroy it. NULL before the first solve.
+smatd_t *april_graph_cholesky_information(const april_graph_cholesky_param_t *param);
+
+// The graph's chi2 after the last step, if track_chi2 is set; -1
+// otherwise, or before the first step.
+double april_graph_cholesky_chi2(const april_graph_cholesky_param_t *param);
+
+// Heap memory held by the solver state, in bytes. Counts allocated
+// capacity, not just the part in use.
+typedef struct april_graph_cholesky_memory april_graph_cholesky_memory_t;
+struct april_graph_cholesky_memory
+{
+    size_t u;           // chol->u
+    size_t A;           // param->A (0 in lean mode)
+    size_t vectors;     // B, y, delta_x, ordering, idxs
+    size_t tree;        // search tree
+    size_t eval_cache;  // cached factor evals
+    size_t total;
+};
+void april_graph_cholesky_memory(const april_graph_cholesky_param_t *param, april_graph_cholesky_memory_t *mem);
+void april_graph_cholesky_memory_print(const april_graph_cholesky_memory_t *mem);
+
+// Save the incremental solver state (factorization, ordering, search
+// tree and the nodes' linearization points) after a solve, so that a
+// restarted process can continue with april_graph_cholesky_inc()
+// instead of a batch solve. The graph itself is not included; save
+// it separately. Loading replaces the state in 'param', which should
+// be initialized and configured as before, and needs the graph the
+// checkpoint was taken from (possibly with more nodes and factors
+// appended). A checkpoint of a lean solver can only be loaded into a
+// lean one. Both return zero on success; a failed load leaves 'param'
+// and the graph as they were.
+int april_graph_cholesky_save(const april_graph_cholesky_param_t *param, const april_graph_t *graph, const char *path);
+int april_graph_cholesky_load(april_graph_cholesky_param_t *param, april_graph_t *graph, const char *path);
+
 // Compute a Gauss-Newton update on the graph, using the specified
 // node ordering. The ordering should specify the order for each
 // april_graph_node_t; if NULL, a default ordering is computed. The
@@ -276,6 +616,17 @@ void april_graph_cholesky_inc(april_graph_t *graph, april_graph_cholesky_param_t
 void april_graph_cholesky_inc_solver(april_graph_t *graph, april_graph_cholesky_param_t *param, int *idxs);
 void april_graph_cholesky_qr_inc(april_graph_t *graph, april_graph_cholesky_param_t *param);
 
+// Non-zero while a background batch (see 'background') is running or
+// finished but not swapped in yet.
+int april_graph_cholesky_batch_pending(const april_graph_cholesky_param_t *param);
+// Block until the pending background batch, if any, has finished and
+// swap it in, as a solver step of its own (see 'changes'). The factors
+// added since its snapshot are replayed by the next
+// april_graph_cholesky_inc().
+void april_graph_cholesky_batch_wait(april_graph_t *graph, april_graph_cholesky_param_t *param);
+// Drop the pending background batch, if any, waiting for its thread.
+void april_graph_cholesky_batch_cancel(april_graph_cholesky_param_t *param);
+
 
 int april_graph_dof(april_graph_t *graph);
 double april_graph_chi2(april_graph_t *graph);
@@ -285,6 +636,20 @@ april_graph_node_t *april_graph_node_xyt_create(const double *state, const doubl
 april_graph_factor_t *april_graph_factor_xyt_create(int a, int b, const double *z, const double *ztruth, const matd_t *W);
 april_graph_factor_t *april_graph_factor_xytpos_create(int a, double *z, double *ztruth, matd_t *W);
 
+// Same as above, but with an already interned information matrix. The
+// factor takes over the caller's reference to 'info'.
+april_graph_factor_t *april_graph_factor_xyt_create_info(int a, int b, const double *z, const double *ztruth, int info);
+april_graph_factor_t *april_graph_factor_xytpos_create_info(int a, const double *z, const double *ztruth, int info);
+
+// Initialize caller-owned structures around caller-owned arrays (e.g.,
+// columns of a mapped file). destroy() releases only the attributes
+// and the info reference; the arrays and the structure itself are
+// left to the caller. copy() returns an ordinary heap object.
+void april_graph_node_xyt_init_mapped(april_graph_node_t *node, double *state, double *init, double *truth,
+                                      double *l_point, double *delta_X);
+void april_graph_factor_xyt_init_mapped(april_graph_factor_t *factor, int *nodes, double *z, double *ztruth, int info);
+void april_graph_factor_xytpos_init_mapped(april_graph_factor_t *factor, int *nodes, double *z, double *ztruth, int info);
+
 void april_graph_attr_put(april_graph_t *graph, const stype_t *type, const char *key, void *data);
 void* april_graph_attr_get(april_graph_t *graph, const char * key);
 
@@ -296,6 +661,330 @@ void* april_graph_node_attr_get(april_graph_node_t *node, const char * key);
 
 int april_graph_save(april_graph_t *graph, const char *path);
 
+/** Streaming graph reader
+    Decodes a graph written by april_graph_save() from a file
+    descriptor, one node or factor at a time, so the whole file never
+    has to be in memory: the buffer starts at 'bufsize' bytes and only
+    grows to fit a single object larger than that. Every node and
+    factor is handed to the callback, in file order, together with its
+    index; the callback takes ownership. Objects of unregistered types
+    are skipped, but keep their index, so later indices match the
+    file. A NULL callback destroys the objects. A non-zero return from a callback stops reading and is
+    returned. If 'attr' is non-NULL, it receives the graph's attributes.
+    Returns 0 on success and -1 on a read error or malformed input. */
+int april_graph_read_stream(int fd, size_t bufsize,
+                            int (*on_node)(april_graph_node_t *node, int idx, void *user),
+                            int (*on_factor)(april_graph_factor_t *factor, int idx, void *user),
+                            void *user, april_graph_attr_t **attr);
+
+/** Columnar graph files
+    A versioned binary layout that stores each field of the nodes and
+    factors (states, endpoints, measurements, information matrices)
+    as one contiguous array, plus an optional section of attributes.
+    april_graph_mmap_open() maps the file and builds a graph whose
+    nodes and factors point straight into the mapping, so loading
+    copies nothing but the linearization points. The mapping is
+    private: optimizing the graph never modifies the file. Only XYT
+    nodes and XYT/XYTPOS factors are supported. */
+typedef struct april_graph_mmap april_graph_mmap_t;
+struct april_graph_mmap
+{
+    april_graph_t *graph;
+
+    void *base;     // the mapped file
+    size_t size;
+
+    int nnodes;
+    int nfactors;
+    april_graph_node_t *nodes;      // graph->nodes[i] == &nodes[i], initially
+    april_graph_factor_t *factors;
+    double *lin;                    // per node: l_point, delta_X
+};
+
+// Returns zero on success.
+int april_graph_save_columnar(april_graph_t *graph, const char *path);
+// Returns NULL if the file can't be mapped or is not a valid
+// columnar graph.
+april_graph_mmap_t *april_graph_mmap_open(const char *path);
+// Destroys gm->graph too. Nodes and factors added to the graph after
+// opening are destroyed as usual.
+void april_graph_mmap_close(april_graph_mmap_t *gm);
+
+/** Compact graph archives
+    A smaller alternative to april_graph_save() for storage and
+    transfer: node indices are delta and varint coded, node states and
+    measurements are XORed with the previous ones, each distinct
+    information matrix is stored once as its upper triangle, and type
+    names are stored once per archive. Decoding reproduces every node,
+    factor and attribute bit for bit. Nodes and factors other than XYT
+    and XYTPOS fall back to their stype encoding. */
+
+// With data == NULL, only returns the size. Returns the number of
+// bytes written.
+uint64_t april_graph_archive_encode(april_graph_t *graph, uint8_t *data);
+// Returns NULL if the data is not a valid archive.
+april_graph_t *april_graph_archive_decode(const uint8_t *data, uint64_t datalen);
+// Returns zero on success.
+int april_graph_save_archive(april_graph_t *graph, const char *path);
+// Returns NULL if the file can't be read or is not an archive.
+april_graph_t *april_graph_load_archive(const char *path);
+
+/** Graph journal
+    An append-only log of graph mutations (nodes and factors added,
+    node states updated), so that a graph survives a crash without
+    being saved in full after every change. Records are buffered and
+    written when the buffer fills or on april_graph_journal_flush();
+    'sync' also waits for the data to reach the disk. Opening an
+    existing journal appends to it, after dropping any partial record
+    at its end. april_graph_journal_compact() replaces the journal with
+    a single snapshot of 'graph', which must contain every mutation
+    logged so far. april_graph_journal_replay() rebuilds the graph;
+    'nrecords' (may be NULL) receives the number of records applied. */
+typedef struct april_graph_journal april_graph_journal_t;
+
+april_graph_journal_t *april_graph_journal_open(const char *path);
+// These return zero on success. A record is always added to the
+// buffer; non-zero means a flush it triggered failed, and the part
+// of the buffer that wasn't written goes out with the next flush. A failed compaction keeps appending to the old journal,
+// which still has every record.
+int april_graph_journal_add_node(april_graph_journal_t *j, const april_graph_node_t *node);
+int april_graph_journal_add_factor(april_graph_journal_t *j, const april_graph_factor_t *factor);
+// record node->state as the state of graph node 'idx'.
+int april_graph_journal_update_state(april_graph_journal_t *j, const april_graph_node_t *node, int idx);
+int april_graph_journal_flush(april_graph_journal_t *j, int sync);
+int april_graph_journal_compact(april_graph_journal_t *j, april_graph_t *graph);
+// flushes and syncs.
+void april_graph_journal_close(april_graph_journal_t *j);
+
+april_graph_t *april_graph_journal_replay(const char *path, int *nrecords);
+
+/** Published node estimates
+    Lets other threads read the node states while a solver updates
+    them. After a step, the solver's thread publishes a copy of every
+    node's state as a new version; readers acquire the latest version
+    and release it when done, without waiting, locking or retrying
+    (one atomic increment each). An acquired version never changes,
+    and stays valid until it is released. Only one thread may publish
+    at a time; publishing doesn't wait for readers either, but fails
+    (returning -1) in the unlikely case that readers hold too many
+    older versions.
+
+    acquire() returns NULL before anything has been published. get()
+    copies the state of node 'idx' from the latest version, and
+    returns its length, or -1 if there is no such node. */
+typedef struct april_graph_estimates april_graph_estimates_t;
+
+typedef struct april_graph_estimate april_graph_estimate_t;
+struct april_graph_estimate
+{
+    int64_t version;        // increases with every publish
+    int nnodes;
+    // the state of node i is states[offsets[i]] to states[offsets[i+1] - 1].
+    const int *offsets;
+    const double *states;
+};
+
+april_graph_estimates_t *april_graph_estimates_create();
+void april_graph_estimates_destroy(april_graph_estimates_t *est);
+int april_graph_estimates_publish(april_graph_estimates_t *est, const april_graph_t *graph);
+const april_graph_estimate_t *april_graph_estimates_acquire(april_graph_estimates_t *est);
+void april_graph_estimates_release(april_graph_estimates_t *est, const april_graph_estimate_t *estimate);
+int april_graph_estimates_get(april_graph_estimates_t *est, int idx, double *state, int64_t *version);
+
+/** Asynchronous optimizer
+    Runs april_graph_cholesky_inc() on a thread of its own, fed by
+    any number of producer threads through a lock-free queue. Adding
+    never blocks: when 'capacity' (<= 0: unbounded) items are queued,
+    the add fails instead and the item stays with the caller. The
+    optimizer drains everything queued into the graph before each
+    step, so batches grow when steps take longer than items arrive.
+
+    april_graph_optimizer_add_node() returns the index the node will
+    have in the graph (which factors use to refer to it), or -1. A
+    factor may refer to any index returned so far, even if that node
+    is still queued; april_graph_optimizer_add_factor() returns zero
+    on success. Added nodes and factors belong to the graph.
+
+    A 'prepare' function, if set (before adding anything), runs on the
+    optimizer thread before each step, when the nodes from index
+    'node0' and the factors from index 'factor0' on have just joined
+    the graph; e.g., to initialize the new nodes from the current
+    estimates of their neighbors.
+
+    While the optimizer exists, the graph and 'param' belong to its
+    thread; other threads read the node states through the estimates
+    it publishes after every step (see april_graph_estimates_t).
+    april_graph_optimizer_flush() returns once every item added
+    before the call has been solved or is held back. A node joins the
+    graph only once a factor on it has been added (and after every
+    node before it), so until then, it, the nodes after it and the
+    factors on them are held back (see 'nheld'); flush doesn't wait
+    for them. Destroying the optimizer stops it after the current
+    step and destroys the items not added to the graph yet. Returns
+    NULL if the thread can't be started. */
+typedef struct april_graph_optimizer april_graph_optimizer_t;
+
+typedef struct april_graph_optimizer_stats april_graph_optimizer_stats_t;
+struct april_graph_optimizer_stats
+{
+    int64_t npushed;        // items added
+    int64_t nrejected;      // adds that failed because the queue was full
+    int64_t nsolved;        // items included in a finished step
+    int depth;              // items queued, not drained yet
+    int nheld;              // items drained, waiting for a node or factor
+
+    int nsteps;
+    int last_batch;         // items in the last step
+    double step_time;       // ms, last step
+
+    // ms from adding an item until the estimates of the step that
+    // solved it are published.
+    double latency_mean;
+    double latency_max;
+    double latency_last;    // mean over the last step
+
+    double busy_time;       // ms spent in steps, in total
+};
+
+april_graph_optimizer_t *april_graph_optimizer_create(april_graph_t *graph, april_graph_cholesky_param_t *param,
+                                                      int capacity);
+void april_graph_optimizer_destroy(april_graph_optimizer_t *opt);
+void april_graph_optimizer_set_prepare(april_graph_optimizer_t *opt,
+                                       void (*f)(april_graph_t *graph, int node0, int factor0, void *user),
+                                       void *user);
+int april_graph_optimizer_add_node(april_graph_optimizer_t *opt, april_graph_node_t *node);
+int april_graph_optimizer_add_factor(april_graph_optimizer_t *opt, april_graph_factor_t *factor);
+void april_graph_optimizer_flush(april_graph_optimizer_t *opt);
+void april_graph_optimizer_stats(april_graph_optimizer_t *opt, april_graph_optimizer_stats_t *stats);
+april_graph_estimates_t *april_graph_optimizer_estimates(april_graph_optimizer_t *opt);
+
+/** Multi-graph scheduler
+    Optimizes any number of independent graphs on a fixed set of
+    'nthreads' threads, instead of a thread per graph. Each graph
+    gets an optimizer as above, with its own queue, 'param' and
+    estimates; april_graph_scheduler_add() takes the arguments of
+    april_graph_optimizer_create(), and the optimizer it returns is
+    used and destroyed the same way.
+
+    A time slice is one step of one graph. A free thread runs the
+    graph with queued items that has had the least thread time so far;
+    a graph that has been idle resumes at the least time of the
+    others, so it can't make up for the idle time by taking over the
+    threads. Steps of one graph never overlap, and parallel work
+    within a step uses the graph's task pool (see
+    april_graph_taskpool()), which graphs share by default.
+
+    Destroy the optimizers before the scheduler. Returns NULL if the
+    threads can't be started. */
+typedef struct april_graph_scheduler april_graph_scheduler_t;
+
+april_graph_scheduler_t *april_graph_scheduler_create(int nthreads);
+void april_graph_scheduler_destroy(april_graph_scheduler_t *sched);
+april_graph_optimizer_t *april_graph_scheduler_add(april_graph_scheduler_t *sched, april_graph_t *graph,
+                                                   april_graph_cholesky_param_t *param, int capacity);
+
+/** Connected components
+    Union-find over the nodes of a growing graph. update() accounts
+    for the nodes and factors added since the last call, merging the
+    sets that a factor connects, and returns the number of merges.
+    find() returns the representative of a node's set. */
+typedef struct april_graph_components april_graph_components_t;
+
+april_graph_components_t *april_graph_components_create();
+void april_graph_components_destroy(april_graph_components_t *comps);
+int april_graph_components_update(april_graph_components_t *comps, april_graph_t *graph);
+// make nodes [0, nnodes) known, each new one a set of its own.
+void april_graph_components_add_nodes(april_graph_components_t *comps, int nnodes);
+int april_graph_components_find(april_graph_components_t *comps, int node);
+// merges the sets of a and b; returns the representative.
+int april_graph_components_union(april_graph_components_t *comps, int a, int b);
+int april_graph_components_size(april_graph_components_t *comps, int node);
+int april_graph_components_count(const april_graph_components_t *comps);
+
+/** Per-component solver
+    Solves each connected component of a growing graph as a system of
+    its own, instead of factoring the whole graph at once: each gets
+    its own ordering, factorization and search tree, and the
+    components with new factors are stepped in parallel on the
+    graph's task pool. A node joins a component with the first factor
+    on it. When a factor bridges components, the smaller ones are
+    merged into the largest, which starts over with a batch step.
+
+    step() is the counterpart of april_graph_cholesky_inc(): it takes
+    the nodes and factors added to 'graph' since the last step (nodes
+    and factors must not be removed) and updates the node states in
+    place. The component solvers are configured like 'config', which
+    must outlive the solver. A component's graph holds the graph's
+    node objects and copies of its factors, with node indices (and
+    node UIDs) local to the component; param() returns the solver
+    state of the component of 'node' (e.g., for its changes or chi2)
+    and its local index, or NULL if no factor has reached the node
+    yet. */
+typedef struct april_graph_component_solver april_graph_component_solver_t;
+
+april_graph_component_solver_t *april_graph_component_solver_create(const april_graph_cholesky_param_t *config);
+void april_graph_component_solver_destroy(april_graph_component_solver_t *solver);
+void april_graph_component_solver_step(april_graph_component_solver_t *solver, april_graph_t *graph);
+int april_graph_component_solver_count(const april_graph_component_solver_t *solver);
+april_graph_cholesky_param_t *april_graph_component_solver_param(april_graph_component_solver_t *solver, int node,
+                                                                int *local);
+
+/** Nested dissection
+    A fill-reducing node ordering built by recursive bisection of the
+    node graph (nodes are adjacent if a factor connects them). Each
+    bisection finds a pseudo-peripheral node, builds the BFS level
+    structure from it, and takes the smallest level that leaves at
+    least a quarter of the nodes on either side as the separator,
+    less the nodes that only border one side, and then shrinks it
+    with a few Fiduccia-Mattheyses passes that move separator nodes
+    to a side, keeping a quarter of the nodes on either side. Parts
+    of at most leaf_size nodes (<= 0: a default) are not split, but
+    ordered by minimum degree.
+
+    Every part of the separator tree owns a contiguous range of the
+    ordering: first its two subtrees, then its separator. Nodes on
+    one side of a separator are never adjacent to nodes on the other
+    side, so the rows of the Cholesky factor of the two subtrees can
+    be computed independently. april_graph_separator_tree_chol() does
+    that on 'tp', on A already permuted to the ordering and analysed
+    with cs_schol(A, -1), given xpos[i], the index of the first scalar
+    of the node at position i of the ordering (xpos[nnodes] == A->n).
+    The result is the same as cs_chol()'s. */
+typedef struct april_graph_separator april_graph_separator_t;
+struct april_graph_separator
+{
+    // positions in the ordering: the part spans [begin, end), and its
+    // separator is [sep, end). A leaf is all separator.
+    int begin, sep, end;
+    int child[2];   // indices in the tree's parts; -1 for a leaf
+    int parent;     // -1 at the root
+};
+
+typedef struct april_graph_separator_tree april_graph_separator_tree_t;
+struct april_graph_separator_tree
+{
+    int nnodes;
+    int *ordering;      // ordering[i]: the node eliminated i'th
+    zarray_t *parts;    // april_graph_separator_t, children before their parent
+    int root;           // -1 if there are no nodes
+};
+
+april_graph_separator_tree_t *april_graph_nested_dissection(april_graph_t *graph, int leaf_size);
+void april_graph_separator_tree_destroy(april_graph_separator_tree_t *tree);
+csn *april_graph_separator_tree_chol(const april_graph_separator_tree_t *tree, const int *xpos,
+                                     const cs *A, const css *S, taskpool_t *tp);
+
+/** TORO and g2o 2D datasets
+    Appends the poses (VERTEX2/VERTEX_SE2) and constraints
+    (EDGE2/EDGE_SE2) of a text dataset to 'graph' as XYT nodes and
+    factors. Vertices become nodes in file order, and edges refer to
+    them by id. Comments and other record types are skipped. The file
+    is mapped and, if it is large enough, parsed in 'npieces' pieces
+    in parallel on the graph's task pool (npieces <= 0: one per
+    thread of the pool). Returns zero on success; on failure, the
+    graph is left as it was. */
+int april_graph_import_toro(april_graph_t *graph, const char *path, int npieces);
+
 void april_graph_stype_init();
 
 void free_key(void* _key);
@@ -39,7 +39,7 @@ $LICENSE_LGPL
 
 //////////////////////////////////////////////////////////////////
 // N
-static inline void encodeN(uint8_t *out, uint32_t *outpos, const uint8_t *in, uint32_t inlen)
+static inline void encodeN(uint8_t *out, uint64_t *outpos, const uint8_t *in, uint64_t inlen)
 {
     if (out)
         memcpy(&out[(*outpos)], in, inlen);
@@ -47,9 +47,9 @@ static inline void encodeN(uint8_t *out, uint32_t *outpos, const uint8_t *in, ui
 }
 
 
-static inline void decodeN(const uint8_t *in, uint32_t *inpos, uint32_t inlen, uint8_t *out, uint32_t outlen)
+static inline void decodeN(const uint8_t *in, uint64_t *inpos, uint64_t inlen, uint8_t *out, uint64_t outlen)
 {
-    int memcpy_len = outlen;
+    uint64_t memcpy_len = outlen;
     if ((*inpos) + outlen > inlen)
         memcpy_len = inlen - (*inpos);
     memcpy(out, &in[*inpos], memcpy_len);
@@ -58,7 +58,7 @@ static inline void decodeN(const uint8_t *in, uint32_t *inpos, uint32_t inlen, u
 
 //////////////////////////////////////////////////////////////////
 // u8
-static inline void encode_u8(uint8_t *out, uint32_t *outpos, uint8_t data)
+static inline void encode_u8(uint8_t *out, uint64_t *outpos, uint8_t data)
 {
     if (out)
         out[(*outpos)++] = data;
@@ -66,7 +66,7 @@ static inline void encode_u8(uint8_t *out, uint32_t *outpos, uint8_t data)
         (*outpos) += 1;
 }
 
-static inline uint8_t decode_u8(const uint8_t *in, uint32_t *inpos, uint32_t inlen)
+static inline uint8_t decode_u8(const uint8_t *in, uint64_t *inpos, uint64_t inlen)
 {
     if ((*inpos) + 1 > inlen)
         return 0;
@@ -77,7 +77,7 @@ static inline uint8_t decode_u8(const uint8_t *in, uint32_t *inpos, uint32_t inl
 
 //////////////////////////////////////////////////////////////////
 // u16
-static inline void encode_u16(uint8_t *out, uint32_t *outpos, uint16_t data)
+static inline void encode_u16(uint8_t *out, uint64_t *outpos, uint16_t data)
 {
     if (out) {
         out[(*outpos)++] = (data >> 8) & 0xff;
@@ -87,7 +87,7 @@ static inline void encode_u16(uint8_t *out, uint32_t *outpos, uint16_t data)
     }
 }
 
-static inline uint16_t decode_u16(const uint8_t *in, uint32_t *inpos, uint32_t inlen)
+static inline uint16_t decode_u16(const uint8_t *in, uint64_t *inpos, uint64_t inlen)
 {
     if ((*inpos) + 2 > inlen)
         return 0;
@@ -102,7 +102,7 @@ static inline uint16_t decode_u16(const uint8_t *in, uint32_t *inpos, uint32_t i
 
 //////////////////////////////////////////////////////////////////
 // s16
-static inline int16_t decode_s16(const uint8_t *in, uint32_t *inpos, uint32_t inlen)
+static inline int16_t decode_s16(const uint8_t *in, uint64_t *inpos, uint64_t inlen)
 {
     if ((*inpos) + 2 > inlen)
         return 0;
@@ -117,7 +117,7 @@ static inline int16_t decode_s16(const uint8_t *in, uint32_t *inpos, uint32_t in
 
 //////////////////////////////////////////////////////////////////
 // u32
-static inline void encode_u32(uint8_t *out, uint32_t *outpos, uint32_t data)
+static inline void encode_u32(uint8_t *out, uint64_t *outpos, uint32_t data)
 {
     if (out) {
         out[(*outpos)++] = (data >> 24) & 0xff;
@@ -129,7 +129,7 @@ static inline void encode_u32(uint8_t *out, uint32_t *outpos, uint32_t data)
     }
 }
 
-static inline uint32_t decode_u32(const uint8_t *in, uint32_t *inpos, uint32_t inlen)
+static inline uint32_t decode_u32(const uint8_t *in, uint64_t *inpos, uint64_t inlen)
 {
     if ((*inpos) + 4 > inlen)
         return 0;
@@ -145,19 +145,19 @@ static inline uint32_t decode_u32(const uint8_t *in, uint32_t *inpos, uint32_t i
 
 //////////////////////////////////////////////////////////////////
 // u32
-static inline void encode_s32(uint8_t *out, uint32_t *outpos, int32_t data)
+static inline void encode_s32(uint8_t *out, uint64_t *outpos, int32_t data)
 {
     encode_u32(out, outpos, data);
 }
 
-static inline int32_t decode_s32(const uint8_t *in, uint32_t *inpos, uint32_t inlen)
+static inline int32_t decode_s32(const uint8_t *in, uint64_t *inpos, uint64_t inlen)
 {
     return (int32_t) decode_u32(in, inpos, inlen);
 }
 
 //////////////////////////////////////////////////////////////////
 // u64
-static inline void encode_u64(uint8_t *out, uint32_t *outpos, uint64_t data)
+static inline void encode_u64(uint8_t *out, uint64_t *outpos, uint64_t data)
 {
     if (out) {
         out[(*outpos)++] = (data >> 56) & 0xff;
@@ -173,7 +173,7 @@ static inline void encode_u64(uint8_t *out, uint32_t *outpos, uint64_t data)
     }
 }
 
-static inline uint64_t decode_u64(const uint8_t *in, uint32_t *inpos, uint32_t inlen)
+static inline uint64_t decode_u64(const uint8_t *in, uint64_t *inpos, uint64_t inlen)
 {
     if ((*inpos) + 8 > inlen)
         return 0;
@@ -187,7 +187,7 @@ static inline uint64_t decode_u64(const uint8_t *in, uint32_t *inpos, uint32_t i
 
 //////////////////////////////////////////////////////////////////
 // f32
-static inline void encode_f32(uint8_t *out, uint32_t *outpos, float data)
+static inline void encode_f32(uint8_t *out, uint64_t *outpos, float data)
 {
     union { uint32_t i;
         float f;
@@ -198,7 +198,7 @@ static inline void encode_f32(uint8_t *out, uint32_t *outpos, float data)
 }
 
 
-static inline float decode_f32(const uint8_t *in, uint32_t *inpos, uint32_t inlen)
+static inline float decode_f32(const uint8_t *in, uint64_t *inpos, uint64_t inlen)
 {
     union { uint32_t i;
         float f;
@@ -210,7 +210,7 @@ static inline float decode_f32(const uint8_t *in, uint32_t *inpos, uint32_t inle
 
 //////////////////////////////////////////////////////////////////
 // f64
-static inline void encode_f64(uint8_t *out, uint32_t *outpos, double data)
+static inline void encode_f64(uint8_t *out, uint64_t *outpos, double data)
 {
     union { uint64_t i;
         double f;
@@ -221,7 +221,7 @@ static inline void encode_f64(uint8_t *out, uint32_t *outpos, double data)
 }
 
 
-static inline double decode_f64(const uint8_t *in, uint32_t *inpos, uint32_t inlen)
+static inline double decode_f64(const uint8_t *in, uint64_t *inpos, uint64_t inlen)
 {
     union { uint64_t i;
         double f;
@@ -231,16 +231,46 @@ static inline double decode_f64(const uint8_t *in, uint32_t *inpos, uint32_t inl
     return u.f;
 }
 
+//////////////////////////////////////////////////////////////////
+// len: object lengths. Lengths below 0xffffffff are a plain u32, as
+// they always have been; larger ones are the escape value 0xffffffff
+// followed by a u64. Files without objects of 4 GB or more are
+// therefore encoded exactly as before.
+#define ENCODE_LEN_ESCAPE 0xffffffffu
+
+static inline int encode_len_size(uint64_t len)
+{
+    return len < ENCODE_LEN_ESCAPE ? 4 : 12;
+}
+
+static inline void encode_len(uint8_t *out, uint64_t *outpos, uint64_t len)
+{
+    if (len < ENCODE_LEN_ESCAPE) {
+        encode_u32(out, outpos, len);
+    } else {
+        encode_u32(out, outpos, ENCODE_LEN_ESCAPE);
+        encode_u64(out, outpos, len);
+    }
+}
+
+static inline uint64_t decode_len(const uint8_t *in, uint64_t *inpos, uint64_t inlen)
+{
+    uint64_t len = decode_u32(in, inpos, inlen);
+    if (len == ENCODE_LEN_ESCAPE)
+        len = decode_u64(in, inpos, inlen);
+    return len;
+}
+
 //////////////////////////////////////////////////////////////////
 // string_u32
-static inline void encode_string_u32(uint8_t *out, uint32_t *outpos, const char *s)
+static inline void encode_string_u32(uint8_t *out, uint64_t *outpos, const char *s)
 {
     uint32_t len = strlen(s);
     encode_u32(out, outpos, len);
     encodeN(out, outpos, (uint8_t*) s, len);
 }
 
-static inline char *decode_string_u32(const uint8_t *in, uint32_t *inpos, uint32_t inlen)
+static inline char *decode_string_u32(const uint8_t *in, uint64_t *inpos, uint64_t inlen)
 {
     uint32_t len = decode_u32(in, inpos, inlen);
 
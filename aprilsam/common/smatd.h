@@ -111,5 +111,7 @@ void smatd_ldu_destroy(smatd_ldu_t *sldu);
 void svecd_add_i0_x(svecd_t *x, svecd_t *a, svecd_t *b, double bscale, int aidx, int bidx);
 TYPE svecd_get(svecd_t *v, int idx);
 void svecd_scale(svecd_t *v, double scale);
+// make room for at least mincap non-zero entries.
+void svecd_ensure_capacity(svecd_t *v, int mincap);
 
 #endif
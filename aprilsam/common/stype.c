@@ -26,19 +26,36 @@ $LICENSE_LGPL
 */
 
 #include <assert.h>
+#include <pthread.h>
 #include <string.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include <limits.h>
 #include "stype.h"
 #include "zset.h"
 #include "io_util.h"
 
+// 32 bit FNV-1a. The table is indexed by the low bits, and the names
+// of related types share long prefixes ("april_graph_..."), so every
+// byte has to reach them.
+static inline uint32_t stype_name_hash(const char *name, size_t len)
+{
+    uint32_t hash = 2166136261u;
+
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (uint8_t) name[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
 #define TNAME stype_hash
 #define TKEYTYPE char*
 #define TVALTYPE stype_t*
 
 // takes a pointer to the key
-#define TKEYHASH(pk) ((*pk)[0])
+#define TKEYHASH(pk) stype_name_hash(*pk, strlen(*pk))
 // takes a pointer to the value
 #define TKEYEQUAL(pka, pkb) (!strcmp(*pka, *pkb))
 #include "thash_impl.h"
@@ -46,78 +63,148 @@ $LICENSE_LGPL
 #undef TKEYTYPE
 #undef TVALTYPE
 
+// Registrations are rare and usually happen at startup, lookups are
+// frequent; lookups take the lock for reading.
+static pthread_rwlock_t stypes_lock = PTHREAD_RWLOCK_INITIALIZER;
 static stype_hash_t *stypes;
 
+// bumped by every registration, which invalidates the decode caches.
+static uint32_t stypes_generation;
+
+// names of unknown types that have been reported.
+static pthread_mutex_t no_stype_warnings_lock = PTHREAD_MUTEX_INITIALIZER;
+static zset_t *no_stype_warnings;
+
+// Decoding resolves the same few type names over and over, so each
+// thread remembers its recent lookups and compares names in place,
+// without copying them out of the buffer. A graph file holds objects
+// of only a handful of types (this tree registers seven), so they all
+// stay cached across any number of files and threads. With more types
+// in rotation, entries are replaced in turn, and a miss costs what
+// every lookup cost without the cache. The scan rejects most entries
+// on their length, so it stays cheap at this size.
+#define STYPE_DECODE_CACHE_SIZE 16
+
+struct stype_decode_cache_entry
+{
+    const stype_t *stype;
+    uint32_t namelen;
+    uint32_t generation;
+};
+
+static __thread struct stype_decode_cache_entry decode_cache[STYPE_DECODE_CACHE_SIZE];
+static __thread int decode_cache_next;
+
 void stype_register(const stype_t *stype)
 {
-    // XXX race
+    pthread_rwlock_wrlock(&stypes_lock);
     if (stypes == NULL) {
         stypes = stype_hash_create();
     }
 
     stype_hash_put(stypes, (char**) &stype->name, (stype_t**) &stype, NULL, NULL);
+    __atomic_add_fetch(&stypes_generation, 1, __ATOMIC_RELEASE);
+    pthread_rwlock_unlock(&stypes_lock);
 }
 
 stype_t *stype_get(char *name)
 {
     stype_t *stype = NULL;
 
-    if (stypes == NULL)
-        return NULL;
+    pthread_rwlock_rdlock(&stypes_lock);
+    if (stypes == NULL || !stype_hash_get(stypes, &name, &stype))
+        stype = NULL;
+    pthread_rwlock_unlock(&stypes_lock);
 
-    if (stype_hash_get(stypes, &name, &stype))
-        return stype;
+    return stype;
+}
 
-    return NULL;
+// stype_get for a name that is not NUL-terminated.
+static const stype_t *stype_get_cached(const char *name, uint32_t namelen)
+{
+    uint32_t generation = __atomic_load_n(&stypes_generation, __ATOMIC_ACQUIRE);
+
+    for (int i = 0; i < STYPE_DECODE_CACHE_SIZE; i++) {
+        struct stype_decode_cache_entry *e = &decode_cache[i];
+        if (e->stype && e->generation == generation &&
+            e->namelen == namelen && !memcmp(e->stype->name, name, namelen))
+            return e->stype;
+    }
+
+    char *s = strndup(name, namelen);
+    const stype_t *stype = stype_get(s);
+    free(s);
+
+    if (stype) {
+        struct stype_decode_cache_entry *e = &decode_cache[decode_cache_next];
+        e->stype = stype;
+        e->namelen = namelen;
+        e->generation = generation;
+        decode_cache_next = (decode_cache_next + 1) % STYPE_DECODE_CACHE_SIZE;
+    }
+
+    return stype;
 }
 
 // you CAN encode NULL (in which case stype MAY be null also)
-void stype_encode_object(uint8_t *data, uint32_t *datapos, const stype_t *stype, const void *obj)
+void stype_encode_object(uint8_t *data, uint64_t *datapos, const stype_t *stype, const void *obj)
 {
     assert(obj == NULL || stype != NULL);
 
     // XXX eventually, randomly generate these cookies?
     static uint64_t next_magic = 0x7b287f8a1579a0edULL;
 
-    uint64_t magic = next_magic;
-    next_magic++;
+    uint64_t magic = __atomic_fetch_add(&next_magic, 1, __ATOMIC_RELAXED);
 
     encode_u64(data, datapos, magic);
 
     if (obj == NULL) {
         encode_string_u32(data, datapos, "");
-        encode_u32(data, datapos, 0);
+        encode_len(data, datapos, 0);
     } else {
         assert(stype->name != NULL);
 
         encode_string_u32(data, datapos, stype->name);
 
-        // compute length and serialize
-        uint32_t datapos0 = *datapos;
-        stype->encode(stype, NULL, datapos, obj);
-        uint32_t length = *datapos - datapos0;
-        *datapos = datapos0;
-
-        encode_u32(data, datapos, length);
-
+        // Serialize after a 4 byte length slot and fill it in
+        // afterwards, so that each object is encoded once (rather than
+        // once more for every level of nesting). The rare object of
+        // 4 GB or more needs the 12 byte form and is moved up; the
+        // caller's buffer has room, since its size was computed by a
+        // dry run that saw the same length.
+        uint64_t slot = *datapos;
+        *datapos += 4;
         stype->encode(stype, data, datapos, obj);
+        uint64_t length = *datapos - slot - 4;
+
+        int lensz = encode_len_size(length);
+        if (data && lensz != 4)
+            memmove(&data[slot + lensz], &data[slot + 4], length);
+        *datapos = slot;
+        encode_len(data, datapos, length);
+        *datapos += length;
     }
 
     encode_u64(data, datapos, magic);
 }
 
-void *stype_decode_object(const uint8_t *data, uint32_t *datapos, uint32_t datalen, const stype_t **outstype)
+void *stype_decode_object(const uint8_t *data, uint64_t *datapos, uint64_t datalen, const stype_t **outstype)
 {
-    static zset_t *no_stype_warnings = NULL;
-
     uint64_t magic = decode_u64(data, datapos, datalen);
-    char *stype_name = decode_string_u32(data, datapos, datalen);
-    uint32_t length = decode_u32(data, datapos, datalen);
+
+    // the name is only copied out for error messages.
+    uint32_t namelen = decode_u32(data, datapos, datalen);
+    if (*datapos + namelen > datalen)
+        namelen = datalen - *datapos;
+    const char *name = (const char*) &data[*datapos];
+    *datapos += namelen;
+
+    uint64_t length = decode_len(data, datapos, datalen);
 
     void *obj = NULL;
 
     if (1) { // used to be length > 0, but a zero-length object is okay.
-        stype_t *stype = stype_get(stype_name);
+        const stype_t *stype = stype_get_cached(name, namelen);
 
         if (stype != NULL) {
             obj = stype->decode(stype, data, datapos, datalen);
@@ -126,6 +213,8 @@ void *stype_decode_object(const uint8_t *data, uint32_t *datapos, uint32_t datal
 
         } else if (length > 0) {
             // TODO seek until we find another copy of 'magic'
+            char *stype_name = strndup(name, namelen);
+            pthread_mutex_lock(&no_stype_warnings_lock);
             if (!no_stype_warnings) {
                 no_stype_warnings = zset_create(sizeof(char*),
                                                 zhash_str_hash, zhash_str_equals);
@@ -135,14 +224,16 @@ void *stype_decode_object(const uint8_t *data, uint32_t *datapos, uint32_t datal
                 zset_add(no_stype_warnings, &s, NULL);
                 printf("Unknown stype %s\n", stype_name);
             }
+            pthread_mutex_unlock(&no_stype_warnings_lock);
+            free(stype_name);
 
             if (outstype)
                 *outstype = NULL;
             int okay = 0;
 
-            for (uint32_t pos = *datapos; pos + 8 <= datalen; pos++) {
-                uint32_t tmp = pos;
-                uint32_t maybe_magic = decode_u64(data, &tmp, datalen);
+            for (uint64_t pos = *datapos; pos + 8 <= datalen; pos++) {
+                uint64_t tmp = pos;
+                uint64_t maybe_magic = decode_u64(data, &tmp, datalen);
                 if (maybe_magic == magic) {
                     *datapos = pos;
                     okay = 1;
@@ -159,23 +250,33 @@ void *stype_decode_object(const uint8_t *data, uint32_t *datapos, uint32_t datal
     uint64_t magic2 = decode_u64(data, datapos, datalen);
 
     if (magic != magic2) {
-        printf("magic mismatch while decoding '%s': %016"PRIx64" %016"PRIx64"\n", stype_name, magic, magic2);
+        printf("magic mismatch while decoding '%.*s': %016"PRIx64" %016"PRIx64"\n", (int) namelen, name, magic, magic2);
         assert(0);
     }
 
-    free(stype_name);
-
     return obj;
 }
 
 int stype_write_file(const stype_t *stype, void *obj, const char *path)
 {
-    uint32_t len = 0;
+    // A dry run is a single pass too (see stype_encode_object), so
+    // sizing the buffer exactly costs one extra traversal, and the
+    // encoders, which do not check the buffer's length, can never
+    // overrun it.
+    uint64_t len = 0;
     stype_encode_object(NULL, &len, stype, obj);
 
-    uint8_t *buf = calloc(1, len);
-    len = 0;
-    stype_encode_object(buf, &len, stype, obj);
+    // ioutils_write_file takes a long.
+    if (len > LONG_MAX)
+        return -1;
+
+    uint8_t *buf = malloc(len);
+    if (buf == NULL)
+        return -1;
+
+    uint64_t pos = 0;
+    stype_encode_object(buf, &pos, stype, obj);
+    assert(pos == len);
 
     int ret = ioutils_write_file(path, buf, len);
     free(buf);
@@ -191,7 +292,7 @@ void *stype_read_file(const char *path)
         return NULL;
     }
 
-    uint32_t datapos = 0;
+    uint64_t datapos = 0;
     void *obj = stype_decode_object((uint8_t*) buf, &datapos, bufsz, NULL);
     free(buf);
     return obj;
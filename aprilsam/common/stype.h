@@ -33,6 +33,15 @@ $LICENSE_LGPL
 
 #include "encode_bytes.h"
 
+// Version of this interface, for code outside this tree that defines
+// its own types. Version 2 changed 'datapos' and 'datalen' from
+// uint32_t to uint64_t, in the encode/decode callbacks below and in
+// the encode_*/decode_* helpers of encode_bytes.h. This breaks both
+// the API and the ABI: callbacks written for version 1 must change
+// their signatures, and casting them instead corrupts datapos. Data
+// without objects of 4 GB or more encodes as before.
+#define STYPE_API_VERSION 2
+
 typedef struct stype stype_t;
 struct stype
 {
@@ -44,11 +53,11 @@ struct stype
     // Note that datapos can be NULL, which means that a "dry-run" is
     // performed. datapos is still updated, allowing a caller to know
     // how much data should be allocated.
-    void (*encode)(const stype_t *stype, uint8_t *data, uint32_t *datapos, const void *obj);
+    void (*encode)(const stype_t *stype, uint8_t *data, uint64_t *datapos, const void *obj);
 
     // During decode, an object does NOT read its type; it was already
     // consumed in order to find the right deserializer.
-    void *(*decode)(const stype_t *stype, const uint8_t *data, uint32_t *datapos, uint32_t datalen);
+    void *(*decode)(const stype_t *stype, const uint8_t *data, uint64_t *datapos, uint64_t datalen);
 
     void *(*copy)(const stype_t *stype, const void *obj);
 
@@ -67,10 +76,10 @@ void stype_register(const stype_t *stype);
 // returns NULL or the stype associated with name.
 stype_t *stype_get(char *name);
 
-void stype_encode_object(uint8_t *data, uint32_t *datapos, const stype_t *stype, const void *obj);
+void stype_encode_object(uint8_t *data, uint64_t *datapos, const stype_t *stype, const void *obj);
 
 // outstype can be NULL.
-void *stype_decode_object(const uint8_t *data, uint32_t *datapos, uint32_t datalen, const stype_t **outstype);
+void *stype_decode_object(const uint8_t *data, uint64_t *datapos, uint64_t datalen, const stype_t **outstype);
 
 // write a single stype (and its children) to a file. Returns zero on success.
 int stype_write_file(const stype_t *stype, void *obj, const char *path);
@@ -30,13 +30,13 @@ $LICENSE_LGPL
 #include "stype.h"
 #include "encode_bytes.h"
 
-static void uint64_encode(const stype_t *stype, uint8_t *data, uint32_t *datapos, const void *obj)
+static void uint64_encode(const stype_t *stype, uint8_t *data, uint64_t *datapos, const void *obj)
 {
     const uint64_t *p = obj;
     encode_u64(data, datapos, *p);
 }
 
-static void* uint64_decode(const stype_t *stype, const uint8_t *data, uint32_t *datapos, uint32_t datalen)
+static void* uint64_decode(const stype_t *stype, const uint8_t *data, uint64_t *datapos, uint64_t datalen)
 {
     uint64_t *p = malloc(sizeof(uint64_t));
     *p = decode_u64(data, datapos, datalen);
@@ -62,13 +62,13 @@ const stype_t stype_uint64 = { .name = "uint64" ,
                               .copy = uint64_copy,
                               .destroy = uint64_destroy };
 
-static void string_encode(const stype_t *stype, uint8_t *data, uint32_t *datapos, const void *obj)
+static void string_encode(const stype_t *stype, uint8_t *data, uint64_t *datapos, const void *obj)
 {
     const char *p = obj;
     encode_string_u32(data, datapos, p);
 }
 
-static void *string_decode(const stype_t *stype, const uint8_t *data, uint32_t *datapos, uint32_t datalen)
+static void *string_decode(const stype_t *stype, const uint8_t *data, uint64_t *datapos, uint64_t datalen)
 {
     char *p;
     p = decode_string_u32(data, datapos, datalen);
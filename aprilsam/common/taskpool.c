@@ -0,0 +1,435 @@
+/* Copyright (C) 2013-2019, The Regents of The University of Michigan.
+All rights reserved.
+
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*$LICENSE*/
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "taskpool.h"
+
+struct task
+{
+    void (*f)(void *arg);
+    void *arg;
+    taskpool_group_t *group;
+};
+
+// A ring of tasks. The owner pushes and pops at the back; thieves
+// take from the front, where the oldest (and typically largest)
+// tasks are.
+struct deque
+{
+    pthread_mutex_t lock;
+    struct task *tasks;
+    int alloc;
+    int head;
+    int size;
+};
+
+struct taskpool
+{
+    int nthreads;
+
+    // deques[i] belongs to worker i; deques[nworkers] is shared by
+    // threads that are not workers.
+    int nworkers;
+    pthread_t *threads;
+    struct deque *deques;
+
+    int pending;     // tasks sitting in a deque
+    int nsleeping;   // idle workers waiting for sleep_cond
+    int stop;
+    pthread_mutex_t sleep_lock;
+    pthread_cond_t sleep_cond;
+
+    // Threads in taskpool_wait() that found nothing of their group to
+    // run wait for wait_cond. wait_seq counts the events that may let
+    // them go on: a task spawned, or a group finished.
+    int nwaiting;
+    int wait_seq;
+    pthread_mutex_t wait_lock;
+    pthread_cond_t wait_cond;
+};
+
+// the pool the current thread is a worker of, and its index.
+static __thread taskpool_t *self_tp;
+static __thread int self_idx;
+
+static pthread_once_t default_once = PTHREAD_ONCE_INIT;
+static taskpool_t *builtin_tp;
+static taskpool_t *default_tp;
+
+static void deque_push(struct deque *dq, const struct task *task)
+{
+    pthread_mutex_lock(&dq->lock);
+    if (dq->size == dq->alloc) {
+        int alloc = dq->alloc ? 2 * dq->alloc : 64;
+        struct task *tasks = malloc(alloc * sizeof(struct task));
+        for (int i = 0; i < dq->size; i++)
+            tasks[i] = dq->tasks[(dq->head + i) % dq->alloc];
+        free(dq->tasks);
+        dq->tasks = tasks;
+        dq->alloc = alloc;
+        dq->head = 0;
+    }
+    dq->tasks[(dq->head + dq->size) % dq->alloc] = *task;
+    __atomic_store_n(&dq->size, dq->size + 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&dq->lock);
+}
+
+// Takes the task at the front or the back, if there is one and, for
+// group != NULL, it belongs to 'group'.
+static int deque_pop(struct deque *dq, struct task *task, int front, const taskpool_group_t *group)
+{
+    // racy peek; a deque that looks empty is skipped without locking.
+    if (__atomic_load_n(&dq->size, __ATOMIC_RELAXED) == 0)
+        return 0;
+
+    int res = 0;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->size > 0) {
+        int pos = front ? dq->head : (dq->head + dq->size - 1) % dq->alloc;
+        if (group == NULL || dq->tasks[pos].group == group) {
+            *task = dq->tasks[pos];
+            if (front)
+                dq->head = (dq->head + 1) % dq->alloc;
+            __atomic_store_n(&dq->size, dq->size - 1, __ATOMIC_RELAXED);
+            res = 1;
+        }
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return res;
+}
+
+static int own_deque(taskpool_t *tp)
+{
+    return self_tp == tp ? self_idx : tp->nworkers;
+}
+
+// Our own newest task, or else the oldest task of someone else; with
+// group != NULL, only if it belongs to 'group'.
+static int find_task(taskpool_t *tp, struct task *task, const taskpool_group_t *group)
+{
+    int self = own_deque(tp);
+    int n = tp->nworkers + 1;
+
+    if (deque_pop(&tp->deques[self], task, 0, group))
+        goto found;
+
+    for (int i = 1; i < n; i++) {
+        if (deque_pop(&tp->deques[(self + i) % n], task, 1, group))
+            goto found;
+    }
+    return 0;
+
+  found:
+    __atomic_sub_fetch(&tp->pending, 1, __ATOMIC_SEQ_CST);
+    return 1;
+}
+
+// Wake the threads in taskpool_wait(), after an event that wait_seq
+// counts.
+static void notify_waiting(taskpool_t *tp)
+{
+    __atomic_add_fetch(&tp->wait_seq, 1, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&tp->nwaiting, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&tp->wait_lock);
+        pthread_cond_broadcast(&tp->wait_cond);
+        pthread_mutex_unlock(&tp->wait_lock);
+    }
+}
+
+static void run_task(const struct task *task)
+{
+    // the group may be gone as soon as its last task is done.
+    taskpool_t *tp = task->group->tp;
+
+    task->f(task->arg);
+    if (__atomic_sub_fetch(&task->group->pending, 1, __ATOMIC_SEQ_CST) == 0)
+        notify_waiting(tp);
+}
+
+static void *worker_main(void *arg)
+{
+    taskpool_t *tp = arg;
+
+    while (1) {
+        struct task task;
+        if (find_task(tp, &task, NULL)) {
+            run_task(&task);
+            continue;
+        }
+
+        // Announce that we're going to sleep before checking for work
+        // once more: a thread that queues a task afterwards sees
+        // nsleeping > 0 and wakes us.
+        pthread_mutex_lock(&tp->sleep_lock);
+        __atomic_add_fetch(&tp->nsleeping, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&tp->pending, __ATOMIC_SEQ_CST) == 0 && !tp->stop)
+            pthread_cond_wait(&tp->sleep_cond, &tp->sleep_lock);
+        __atomic_sub_fetch(&tp->nsleeping, 1, __ATOMIC_SEQ_CST);
+        int stop = tp->stop;
+        pthread_mutex_unlock(&tp->sleep_lock);
+
+        if (stop)
+            break;
+    }
+
+    return NULL;
+}
+
+struct worker_start
+{
+    taskpool_t *tp;
+    int idx;
+};
+
+static void *worker_start(void *arg)
+{
+    struct worker_start start = *(struct worker_start*) arg;
+    free(arg);
+
+    self_tp = start.tp;
+    self_idx = start.idx;
+    return worker_main(start.tp);
+}
+
+taskpool_t *taskpool_create(int nthreads)
+{
+    taskpool_t *tp = calloc(1, sizeof(taskpool_t));
+    tp->nthreads = nthreads > 1 ? nthreads : 1;
+    tp->nworkers = tp->nthreads - 1;
+
+    tp->deques = calloc(tp->nworkers + 1, sizeof(struct deque));
+    for (int i = 0; i <= tp->nworkers; i++)
+        pthread_mutex_init(&tp->deques[i].lock, NULL);
+    pthread_mutex_init(&tp->sleep_lock, NULL);
+    pthread_cond_init(&tp->sleep_cond, NULL);
+    pthread_mutex_init(&tp->wait_lock, NULL);
+    pthread_cond_init(&tp->wait_cond, NULL);
+
+    tp->threads = calloc(tp->nworkers, sizeof(pthread_t));
+    for (int i = 0; i < tp->nworkers; i++) {
+        struct worker_start *start = malloc(sizeof(struct worker_start));
+        start->tp = tp;
+        start->idx = i;
+        pthread_create(&tp->threads[i], NULL, worker_start, start);
+    }
+
+    return tp;
+}
+
+void taskpool_destroy(taskpool_t *tp)
+{
+    if (!tp)
+        return;
+
+    assert(tp->pending == 0);
+
+    pthread_mutex_lock(&tp->sleep_lock);
+    tp->stop = 1;
+    pthread_cond_broadcast(&tp->sleep_cond);
+    pthread_mutex_unlock(&tp->sleep_lock);
+
+    for (int i = 0; i < tp->nworkers; i++)
+        pthread_join(tp->threads[i], NULL);
+
+    for (int i = 0; i <= tp->nworkers; i++) {
+        pthread_mutex_destroy(&tp->deques[i].lock);
+        free(tp->deques[i].tasks);
+    }
+    pthread_mutex_destroy(&tp->sleep_lock);
+    pthread_cond_destroy(&tp->sleep_cond);
+    pthread_mutex_destroy(&tp->wait_lock);
+    pthread_cond_destroy(&tp->wait_cond);
+    free(tp->deques);
+    free(tp->threads);
+    free(tp);
+}
+
+int taskpool_nthreads(const taskpool_t *tp)
+{
+    return tp ? tp->nthreads : 1;
+}
+
+static void default_init()
+{
+    int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    const char *env = getenv("APRILSAM_THREADS");
+    if (env && atoi(env) > 0)
+        nthreads = atoi(env);
+
+    builtin_tp = taskpool_create(nthreads);
+}
+
+taskpool_t *taskpool_get_default()
+{
+    taskpool_t *tp = __atomic_load_n(&default_tp, __ATOMIC_ACQUIRE);
+    if (tp)
+        return tp;
+
+    pthread_once(&default_once, default_init);
+    return builtin_tp;
+}
+
+void taskpool_set_default(taskpool_t *tp)
+{
+    __atomic_store_n(&default_tp, tp, __ATOMIC_RELEASE);
+}
+
+void taskpool_group_init(taskpool_t *tp, taskpool_group_t *group)
+{
+    group->tp = tp;
+    group->pending = 0;
+}
+
+void taskpool_spawn(taskpool_group_t *group, void (*f)(void *arg), void *arg)
+{
+    taskpool_t *tp = group->tp;
+
+    if (tp == NULL || tp->nworkers == 0) {
+        f(arg);
+        return;
+    }
+
+    __atomic_add_fetch(&group->pending, 1, __ATOMIC_RELAXED);
+
+    struct task task = { .f = f, .arg = arg, .group = group };
+    deque_push(&tp->deques[own_deque(tp)], &task);
+    __atomic_add_fetch(&tp->pending, 1, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&tp->nsleeping, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&tp->sleep_lock);
+        pthread_cond_signal(&tp->sleep_cond);
+        pthread_mutex_unlock(&tp->sleep_lock);
+    }
+
+    notify_waiting(tp);
+}
+
+void taskpool_wait(taskpool_group_t *group)
+{
+    taskpool_t *tp = group->tp;
+
+    // Only tasks of this group are run here: another group's task can
+    // take arbitrarily long (e.g., a background job's), and would hold
+    // up our return after the group is done. The workers run the rest.
+    while (__atomic_load_n(&group->pending, __ATOMIC_SEQ_CST) > 0) {
+        int seq = __atomic_load_n(&tp->wait_seq, __ATOMIC_SEQ_CST);
+
+        struct task task;
+        if (find_task(tp, &task, group)) {
+            run_task(&task);
+            continue;
+        }
+
+        // As for the workers' sleep: with nwaiting raised, an event
+        // after this check wakes us.
+        pthread_mutex_lock(&tp->wait_lock);
+        __atomic_add_fetch(&tp->nwaiting, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&group->pending, __ATOMIC_SEQ_CST) > 0 &&
+            __atomic_load_n(&tp->wait_seq, __ATOMIC_SEQ_CST) == seq)
+            pthread_cond_wait(&tp->wait_cond, &tp->wait_lock);
+        __atomic_sub_fetch(&tp->nwaiting, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&tp->wait_lock);
+    }
+}
+
+/////////////////////////////////////////////////////////////
+// parallel for
+
+struct pfor
+{
+    void (*f)(void *arg, int i0, int i1);
+    void *arg;
+    int grain;
+
+    taskpool_group_t group;
+
+    // every split takes one range; see taskpool_parallel_for().
+    struct pfor_range *ranges;
+    int nranges;
+};
+
+struct pfor_range
+{
+    struct pfor *pf;
+    int begin, end;
+};
+
+static void pfor_task(void *arg)
+{
+    struct pfor_range *range = arg;
+    struct pfor *pf = range->pf;
+    int begin = range->begin, end = range->end;
+
+    // hand the upper half to other threads until the rest is small.
+    while (end - begin > pf->grain) {
+        int mid = begin + (end - begin) / 2;
+
+        struct pfor_range *upper = &pf->ranges[__atomic_fetch_add(&pf->nranges, 1, __ATOMIC_RELAXED)];
+        upper->pf = pf;
+        upper->begin = mid;
+        upper->end = end;
+        taskpool_spawn(&pf->group, pfor_task, upper);
+
+        end = mid;
+    }
+
+    pf->f(pf->arg, begin, end);
+}
+
+void taskpool_parallel_for(taskpool_t *tp, int begin, int end, int grain,
+                           void (*f)(void *arg, int i0, int i1), void *arg)
+{
+    if (end <= begin)
+        return;
+
+    int n = end - begin;
+    int nthreads = taskpool_nthreads(tp);
+
+    if (grain <= 0)
+        grain = n / (8 * nthreads);
+    if (grain < 1)
+        grain = 1;
+
+    if (nthreads <= 1 || n <= grain) {
+        f(arg, begin, end);
+        return;
+    }
+
+    // Halving a range of n until pieces are at most 'grain' long makes
+    // fewer than 2n/grain + 1 pieces, each split producing one.
+    struct pfor pf = { .f = f, .arg = arg, .grain = grain };
+    pf.ranges = malloc((2 * (n / grain) + 2) * sizeof(struct pfor_range));
+    taskpool_group_init(tp, &pf.group);
+
+    struct pfor_range all = { .pf = &pf, .begin = begin, .end = end };
+    pfor_task(&all);
+    taskpool_wait(&pf.group);
+
+    free(pf.ranges);
+}
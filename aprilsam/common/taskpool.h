@@ -0,0 +1,111 @@
+/* Copyright (C) 2013-2019, The Regents of The University of Michigan.
+All rights reserved.
+
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*$LICENSE*/
+
+#ifndef _TASKPOOL_H
+#define _TASKPOOL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * A pool of worker threads that run small tasks, with fork-join
+ * semantics: tasks are spawned into a group, and the spawning thread
+ * waits for the group. Every worker has its own deque of tasks; it
+ * runs the newest of its own tasks first and, when it runs out,
+ * steals the oldest task of another worker. A thread waiting for a
+ * group runs the group's tasks too, so tasks may spawn and wait for
+ * subtasks without tying up threads, and sleeps when there are none
+ * left to take.
+ *
+ * Threads that are not workers of the pool (e.g., the main thread)
+ * can spawn and wait as well; they share one more deque.
+ */
+typedef struct taskpool taskpool_t;
+
+typedef struct taskpool_group taskpool_group_t;
+struct taskpool_group
+{
+    taskpool_t *tp;
+    int pending; // tasks spawned and not finished yet
+};
+
+/**
+ * Creates a pool that runs tasks on 'nthreads' threads in total: the
+ * waiting thread counts as one, so nthreads - 1 workers are started.
+ * With nthreads <= 1, tasks run immediately when they are spawned.
+ */
+taskpool_t *taskpool_create(int nthreads);
+
+/**
+ * Stops and joins the workers. No tasks may be pending.
+ */
+void taskpool_destroy(taskpool_t *tp);
+
+/**
+ * The number of threads that run tasks, including the waiting one.
+ */
+int taskpool_nthreads(const taskpool_t *tp);
+
+/**
+ * The pool used when none is specified. It is created on first use,
+ * with one thread per online processor, or as many as the
+ * APRILSAM_THREADS environment variable says.
+ */
+taskpool_t *taskpool_get_default();
+
+/**
+ * Replace the default pool. The caller keeps ownership of 'tp' and
+ * must not destroy it while it is the default. NULL restores the
+ * built-in default.
+ */
+void taskpool_set_default(taskpool_t *tp);
+
+void taskpool_group_init(taskpool_t *tp, taskpool_group_t *group);
+
+/**
+ * Schedules f(arg) to run on some thread of the group's pool.
+ */
+void taskpool_spawn(taskpool_group_t *group, void (*f)(void *arg), void *arg);
+
+/**
+ * Returns once every task spawned into the group (including tasks
+ * spawned while waiting) has finished, running tasks of the group in
+ * the meantime; tasks of other groups are left to the workers.
+ */
+void taskpool_wait(taskpool_group_t *group);
+
+/**
+ * Calls f(arg, i0, i1) on disjoint subranges [i0, i1) that together
+ * cover [begin, end), in parallel, and returns when all are done. The
+ * range is split in halves until pieces hold at most 'grain' indices;
+ * grain <= 0 picks a size that makes a few pieces per thread.
+ */
+void taskpool_parallel_for(taskpool_t *tp, int begin, int end, int grain,
+                           void (*f)(void *arg, int i0, int i1), void *arg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
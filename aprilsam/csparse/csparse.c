@@ -437,7 +437,6 @@ int *cs_amd ( const cs *A, int order )
 }
 
 /* compute nonzero pattern of L(k,:) */
-static
 int cs_ereach (const cs *A, int k, const int *parent, int *s, int *w,
     double *x, int top)
 {
@@ -110,6 +110,8 @@ double cs_house (double *x, double *beta, int n) ;
 int *cs_maxtrans (const cs *A) ;
 int *cs_post (int n, const int *parent) ;
 int cs_reach (cs *L, const cs *B, int k, int *xi, const int *Pinv) ;
+int cs_ereach (const cs *A, int k, const int *parent, int *s, int *w,
+    double *x, int top) ;
 csd *cs_scc (cs *A) ;
 int cs_scatter (const cs *A, int j, double beta, int *w, double *x, int mark,
     cs *C, int nz) ;
@@ -0,0 +1,232 @@
+/* Copyright (C) 2013-2019, The Regents of The University of Michigan.
+All rights reserved.
+
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*$LICENSE*/
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "aprilsam/aprilsam.h"
+#include "aprilsam/common/getopt.h"
+
+/**
+   Replay a dataset pose by pose and count the heap allocations made
+   by every incremental step. Once the solver has warmed up, a step
+   that only appends a pose with its odometry (no loop closures, no
+   batch re-factorization) allocates only when fill-in outgrows a row
+   of the factor. Rows double, so that must average out to well under
+   one allocation per step. With enough storage reserved per row
+   (--row_nz), --strict asks for none at all:
+   ./aprilsam_alloc_check --datapath ../data/M3500.txt --strict
+
+   Allocations are counted by wrapping glibc's allocator.
+ */
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+
+static int counting;
+static int64_t nallocs;
+
+void *malloc(size_t size)
+{
+    if (counting)
+        __atomic_add_fetch(&nallocs, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    if (counting)
+        __atomic_add_fetch(&nallocs, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    if (counting)
+        __atomic_add_fetch(&nallocs, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, size);
+}
+
+int posix_memalign(void **ptr, size_t alignment, size_t size)
+{
+    if (counting)
+        __atomic_add_fetch(&nallocs, 1, __ATOMIC_RELAXED);
+    *ptr = __libc_memalign(alignment, size);
+    return *ptr ? 0 : 12; // ENOMEM
+}
+
+int main(int argc, char *argv[])
+{
+    APRILSAM_VERSION();
+
+    setlinebuf(stdout);
+
+    april_graph_stype_init();
+
+    getopt_t *gopt = getopt_create();
+    getopt_add_bool(gopt,   'h',  "help", 0, "Show usage");
+    getopt_add_string(gopt, '\0', "datapath", "", "TORO or g2o dataset file path");
+    getopt_add_int(gopt,    '\0', "nodes", "0", "replay only this many poses (0: all)");
+    getopt_add_int(gopt,    '\0', "warmup", "100", "steps before allocations are checked");
+    getopt_add_int(gopt,    '\0', "nthreshold",  "100", "Batch update if more than nthreshold nodes with significant change");
+    getopt_add_int(gopt,    '\0', "row_nz", "32", "non-zeros to reserve per row of the factor (param->reserve_row_nz)");
+    getopt_add_bool(gopt,   '\0', "strict", 0, "Fail if any odometry step allocates");
+    getopt_add_bool(gopt,   '\0', "verbose", 0, "Print every step that allocates");
+
+    if (!getopt_parse(gopt, argc, argv, 1) || getopt_get_bool(gopt, "help") ||
+        !strlen(getopt_get_string(gopt, "datapath"))) {
+        getopt_do_usage(gopt);
+        return 1;
+    }
+
+    april_graph_t *loaded = april_graph_create();
+    if (april_graph_import_toro(loaded, getopt_get_string(gopt, "datapath"), 0))
+        return 1;
+
+    int nnodes = zarray_size(loaded->nodes);
+    if (getopt_get_int(gopt, "nodes") > 0 && getopt_get_int(gopt, "nodes") < nnodes)
+        nnodes = getopt_get_int(gopt, "nodes");
+
+    // per node: the loaded factors whose last node it is.
+    zarray_t **factors = calloc(nnodes, sizeof(zarray_t*));
+    for (int i = 0; i < nnodes; i++)
+        factors[i] = zarray_create(sizeof(april_graph_factor_t*));
+    for (int i = 0; i < zarray_size(loaded->factors); i++) {
+        april_graph_factor_t *factor;
+        zarray_get(loaded->factors, i, &factor);
+        int last = 0;
+        for (int j = 0; j < factor->nnodes; j++)
+            last = factor->nodes[j] > last ? factor->nodes[j] : last;
+        if (last < nnodes)
+            zarray_add(factors[last], &factor);
+    }
+
+    // one thread: tasks run where they are spawned.
+    taskpool_t *tp = taskpool_create(1);
+    april_graph_t *graph = april_graph_create();
+    graph->taskpool = tp;
+    zarray_ensure_capacity(graph->nodes, nnodes);
+    zarray_ensure_capacity(graph->factors, zarray_size(loaded->factors) + 1);
+
+    april_graph_cholesky_param_t *param = calloc(1, sizeof(april_graph_cholesky_param_t));
+    april_graph_cholesky_param_init(param);
+    param->delta_xy = 0.1;
+    param->delta_theta = 0.1;
+    param->nthreshold = getopt_get_int(gopt, "nthreshold");
+    param->deterministic = 1;
+    param->reserve_row_nz = getopt_get_int(gopt, "row_nz");
+    april_graph_cholesky_reserve(param, nnodes, zarray_size(loaded->factors) + 1);
+
+    int warmup = getopt_get_int(gopt, "warmup");
+    int nodometry = 0, nbatch = 0, nclosure = 0, nallocating = 0;
+    int64_t odometry_allocs = 0, closure_allocs = 0;
+
+    for (int i = 0; i < nnodes; i++) {
+        april_graph_node_t *node;
+        zarray_get(loaded->nodes, i, &node);
+        node = april_graph_node_xyt_create(node->init, node->init, node->truth);
+        zarray_add(graph->nodes, &node);
+
+        if (i == 0) {
+            matd_t *W = matd_create_data(3, 3, (double []) { 10000, 0, 0,
+                        0, 10000, 0,
+                        0, 0, 1000 });
+            april_graph_factor_t *factor = april_graph_factor_xytpos_create(0, (double[3]) { 0, 0, 0 }, NULL, W);
+            zarray_add(graph->factors, &factor);
+            matd_destroy(W);
+        }
+
+        // start the node at its predecessor composed with the odometry.
+        int odometry_only = 1;
+        for (int j = 0; j < zarray_size(factors[i]); j++) {
+            april_graph_factor_t *factor;
+            zarray_get(factors[i], j, &factor);
+            factor = factor->copy(factor);
+            zarray_add(graph->factors, &factor);
+
+            if (factor->type == APRIL_GRAPH_FACTOR_XYT_TYPE && factor->nodes[1] == i && factor->nodes[0] == i - 1) {
+                april_graph_node_t *prev;
+                zarray_get(graph->nodes, i - 1, &prev);
+                doubles_xyt_mul(prev->state, factor->u.common.z, node->state);
+                node->relinearize(node);
+            } else {
+                odometry_only = 0;
+            }
+        }
+
+        if (i == 0)
+            continue;
+        if (i == 1) {
+            april_graph_cholesky(graph, param);
+            continue;
+        }
+
+        // a batch step replaces the factorization.
+        smatd_chol_t *chol = param->chol;
+        nallocs = 0;
+        counting = 1;
+        april_graph_cholesky_inc(graph, param);
+        counting = 0;
+
+        if (i < warmup)
+            continue;
+        if (param->chol != chol) {
+            nbatch++;
+        } else if (!odometry_only) {
+            nclosure++;
+            closure_allocs += nallocs;
+        } else {
+            nodometry++;
+            odometry_allocs += nallocs;
+            if (nallocs) {
+                nallocating++;
+                if (getopt_get_bool(gopt, "verbose"))
+                    printf("step %d: %" PRId64 " allocations\n", i, nallocs);
+            }
+        }
+    }
+
+    double per_step = nodometry ? (double) odometry_allocs / nodometry : 0.0;
+    int failed = getopt_get_bool(gopt, "strict") ? nallocating > 0 : per_step >= 1.0;
+
+    printf("%d odometry steps, %d of them allocated, %.3f allocations each\n",
+           nodometry, nallocating, per_step);
+    printf("%d loop closure steps, %.1f allocations each\n", nclosure,
+           nclosure ? (double) closure_allocs / nclosure : 0.0);
+    printf("%d batch steps\n", nbatch);
+    printf("%s\n", failed ? "ALLOCATES" : nallocating ? "AMORTIZED" : "ALLOCATION-FREE");
+
+    april_graph_cholesky_param_destory(param);
+    april_graph_destroy(graph);
+    taskpool_destroy(tp);
+    for (int i = 0; i < nnodes; i++)
+        zarray_destroy(factors[i]);
+    free(factors);
+    april_graph_destroy(loaded);
+    getopt_destroy(gopt);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,309 @@
+/* Copyright (C) 2013-2019, The Regents of The University of Michigan.
+All rights reserved.
+
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*$LICENSE*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "aprilsam/aprilsam.h"
+#include "aprilsam/common/getopt.h"
+#include "aprilsam/common/time_util.h"
+
+/**
+   Feed a dataset to the asynchronous optimizer from a producer
+   thread, pose by pose, while a reader thread queries the latest
+   pose, and report the optimizer's statistics:
+   ./aprilsam_async --datapath ../data/M3500.txt --rate 200
+
+   With --sessions, as many graphs replay the dataset at once, each
+   fed by a producer of its own; with --threads, a scheduler optimizes
+   them on that many threads instead of a thread per graph.
+ */
+
+typedef struct state state_t;
+
+typedef struct session session_t;
+struct session
+{
+    state_t *state;
+    april_graph_t *graph;
+    april_graph_cholesky_param_t *param;
+    april_graph_optimizer_t *opt;
+    int nretries;                   // adds repeated because the queue was full
+};
+
+struct state
+{
+    april_graph_t *loaded_graph;
+    zarray_t **factors;             // per node: loaded factors whose last node it is
+    double rate;                    // poses per second; 0: as fast as possible
+
+    int nsessions;
+    session_t *sessions;
+
+    // a reader that queries the latest pose of the first session, as
+    // a planner would.
+    double query_rate;
+    int done;
+    int64_t nqueries;
+    int64_t last_version;
+    double query_max;               // ms
+};
+
+static void print_stats(april_graph_optimizer_stats_t *stats)
+{
+    printf("pushed %" PRId64 ", rejected %" PRId64 ", solved %" PRId64 ", queued %d, held %d, steps %d, last batch %d\n",
+           stats->npushed, stats->nrejected, stats->nsolved, stats->depth, stats->nheld, stats->nsteps, stats->last_batch);
+    printf("latency mean %.3f ms, max %.3f ms, last %.3f ms; step time %.3f ms\n",
+           stats->latency_mean, stats->latency_max, stats->latency_last, stats->step_time);
+}
+
+// Start new nodes at their predecessor's estimate composed with the
+// odometry between them, like aprilsam_demo does.
+static void prepare(april_graph_t *graph, int node0, int factor0, void *user)
+{
+    for (int i = factor0; i < zarray_size(graph->factors); i++) {
+        april_graph_factor_t *factor;
+        zarray_get(graph->factors, i, &factor);
+        if (factor->type != APRIL_GRAPH_FACTOR_XYT_TYPE || factor->nodes[1] != factor->nodes[0] + 1 ||
+            factor->nodes[1] < node0)
+            continue;
+
+        april_graph_node_t *na, *nb;
+        zarray_get(graph->nodes, factor->nodes[0], &na);
+        zarray_get(graph->nodes, factor->nodes[1], &nb);
+        doubles_xyt_mul(na->state, factor->u.common.z, nb->state);
+        nb->relinearize(nb);
+    }
+}
+
+static void *reader_main(void *arg)
+{
+    state_t *state = arg;
+    april_graph_estimates_t *est = april_graph_optimizer_estimates(state->sessions[0].opt);
+
+    while (!__atomic_load_n(&state->done, __ATOMIC_ACQUIRE)) {
+        int64_t utime0 = utime_now();
+        const april_graph_estimate_t *estimate = april_graph_estimates_acquire(est);
+        if (estimate && estimate->nnodes > 0) {
+            double pose[3];
+            memcpy(pose, &estimate->states[estimate->offsets[estimate->nnodes - 1]], sizeof(pose));
+            if (estimate->version < state->last_version)
+                printf("estimates went back from version %" PRId64 " to %" PRId64 "\n",
+                       state->last_version, estimate->version);
+            state->last_version = estimate->version;
+        }
+        april_graph_estimates_release(est, estimate);
+        int64_t utime1 = utime_now();
+
+        state->nqueries++;
+        if ((utime1 - utime0) / 1.0E3 > state->query_max)
+            state->query_max = (utime1 - utime0) / 1.0E3;
+        if (state->query_rate > 0)
+            usleep(1.0E6 / state->query_rate);
+    }
+
+    return NULL;
+}
+
+static void *producer_main(void *arg)
+{
+    session_t *session = arg;
+    state_t *state = session->state;
+    zarray_t *factors = zarray_create(sizeof(april_graph_factor_t*));
+
+    for (int i = 0; i < zarray_size(state->loaded_graph->nodes); i++) {
+        int64_t utime0 = utime_now();
+
+        april_graph_node_t *loaded;
+        zarray_get(state->loaded_graph->nodes, i, &loaded);
+        april_graph_node_t *node = april_graph_node_xyt_create(loaded->init, loaded->init, loaded->truth);
+
+        // back off while the queue is full.
+        int idx;
+        while ((idx = april_graph_optimizer_add_node(session->opt, node)) < 0) {
+            session->nretries++;
+            usleep(1000);
+        }
+
+        // the loaded factors stay with the loaded graph.
+        zarray_clear(factors);
+        for (int j = 0; j < zarray_size(state->factors[i]); j++) {
+            april_graph_factor_t *factor;
+            zarray_get(state->factors[i], j, &factor);
+            factor = factor->copy(factor);
+            zarray_add(factors, &factor);
+        }
+        if (idx == 0) {
+            matd_t *W = matd_create_data(3, 3, (double []) { 10000, 0, 0,
+                        0, 10000, 0,
+                        0, 0, 1000 });
+            april_graph_factor_t *factor = april_graph_factor_xytpos_create(idx, (double[3]) { 0, 0, 0 }, NULL, W);
+            zarray_add(factors, &factor);
+            matd_destroy(W);
+        }
+
+        for (int j = 0; j < zarray_size(factors); j++) {
+            april_graph_factor_t *factor;
+            zarray_get(factors, j, &factor);
+            while (april_graph_optimizer_add_factor(session->opt, factor) < 0) {
+                session->nretries++;
+                usleep(1000);
+            }
+        }
+
+        if (state->rate > 0) {
+            int64_t utime1 = utime0 + 1.0E6 / state->rate;
+            int64_t now = utime_now();
+            if (utime1 > now)
+                usleep(utime1 - now);
+        }
+    }
+
+    zarray_destroy(factors);
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    APRILSAM_VERSION();
+
+    setlinebuf(stdout);
+    setlinebuf(stderr);
+
+    april_graph_stype_init();
+    stype_register_basic_types();
+    getopt_t *gopt = getopt_create();
+    getopt_add_bool(gopt,   'h',  "help", 0, "Show usage");
+    getopt_add_string(gopt, '\0', "datapath", "", "TORO or g2o dataset file path");
+    getopt_add_double(gopt, '\0', "rate", "100", "poses per second (0: as fast as possible)");
+    getopt_add_double(gopt, '\0', "query_rate", "1000", "pose queries per second (0: as fast as possible)");
+    getopt_add_int(gopt,    '\0', "capacity", "64", "queued items before adds fail (0: unbounded)");
+    getopt_add_int(gopt,    '\0', "nthreshold",  "100", "Batch update if more than nthreshold nodes with significant change");
+    getopt_add_bool(gopt,   '\0', "background", 0, "Run batch re-factorizations on a background thread");
+    getopt_add_int(gopt,    '\0', "sessions", "1", "graphs optimized at once");
+    getopt_add_int(gopt,    '\0', "threads", "0", "optimize the graphs on this many threads (0: a thread per graph)");
+
+    if (!getopt_parse(gopt, argc, argv, 1) || getopt_get_bool(gopt, "help") ||
+        !strlen(getopt_get_string(gopt, "datapath"))) {
+        getopt_do_usage(gopt);
+        return 1;
+    }
+
+    state_t *state = calloc(1, sizeof(state_t));
+    state->rate = getopt_get_double(gopt, "rate");
+    state->query_rate = getopt_get_double(gopt, "query_rate");
+    state->loaded_graph = april_graph_create();
+    if (april_graph_import_toro(state->loaded_graph, getopt_get_string(gopt, "datapath"), 0))
+        return 1;
+
+    int nnodes = zarray_size(state->loaded_graph->nodes);
+    state->factors = calloc(nnodes, sizeof(zarray_t*));
+    for (int i = 0; i < nnodes; i++)
+        state->factors[i] = zarray_create(sizeof(april_graph_factor_t*));
+    for (int i = 0; i < zarray_size(state->loaded_graph->factors); i++) {
+        april_graph_factor_t *factor;
+        zarray_get(state->loaded_graph->factors, i, &factor);
+        int last = 0;
+        for (int j = 0; j < factor->nnodes; j++)
+            last = factor->nodes[j] > last ? factor->nodes[j] : last;
+        zarray_add(state->factors[last], &factor);
+    }
+
+    int nthreads = getopt_get_int(gopt, "threads");
+    april_graph_scheduler_t *sched = nthreads > 0 ? april_graph_scheduler_create(nthreads) : NULL;
+    if (nthreads > 0 && !sched)
+        return 1;
+
+    state->nsessions = getopt_get_int(gopt, "sessions") > 1 ? getopt_get_int(gopt, "sessions") : 1;
+    state->sessions = calloc(state->nsessions, sizeof(session_t));
+    for (int i = 0; i < state->nsessions; i++) {
+        session_t *session = &state->sessions[i];
+        session->state = state;
+
+        session->param = calloc(1, sizeof(april_graph_cholesky_param_t));
+        april_graph_cholesky_param_init(session->param);
+        session->param->delta_xy = 0.1;
+        session->param->delta_theta = 0.1;
+        session->param->nthreshold = getopt_get_int(gopt, "nthreshold");
+        session->param->background = getopt_get_bool(gopt, "background");
+
+        session->graph = april_graph_create();
+        if (sched)
+            session->opt = april_graph_scheduler_add(sched, session->graph, session->param,
+                                                     getopt_get_int(gopt, "capacity"));
+        else
+            session->opt = april_graph_optimizer_create(session->graph, session->param,
+                                                        getopt_get_int(gopt, "capacity"));
+        if (!session->opt)
+            return 1;
+        april_graph_optimizer_set_prepare(session->opt, prepare, NULL);
+    }
+
+    int64_t utime0 = utime_now();
+    pthread_t reader;
+    pthread_t *producers = calloc(state->nsessions, sizeof(pthread_t));
+    pthread_create(&reader, NULL, reader_main, state);
+    for (int i = 0; i < state->nsessions; i++)
+        pthread_create(&producers[i], NULL, producer_main, &state->sessions[i]);
+    for (int i = 0; i < state->nsessions; i++) {
+        pthread_join(producers[i], NULL);
+        april_graph_optimizer_flush(state->sessions[i].opt);
+    }
+    int64_t utime1 = utime_now();
+    __atomic_store_n(&state->done, 1, __ATOMIC_RELEASE);
+    pthread_join(reader, NULL);
+
+    for (int i = 0; i < state->nsessions; i++) {
+        session_t *session = &state->sessions[i];
+        if (state->nsessions > 1)
+            printf("session %d:\n", i);
+
+        april_graph_optimizer_stats_t stats;
+        april_graph_optimizer_stats(session->opt, &stats);
+        print_stats(&stats);
+        printf("producer retries %d, busy time %.3f ms\n", session->nretries, stats.busy_time);
+
+        april_graph_optimizer_destroy(session->opt);
+        printf("Chi squared error: %f\n", april_graph_chi2(session->graph));
+        april_graph_cholesky_param_destory(session->param);
+        april_graph_destroy(session->graph);
+    }
+    printf("total time %.3f ms\n", (utime1 - utime0) / 1.0E3);
+    printf("reader queries %" PRId64 ", last version %" PRId64 ", max query time %.3f ms\n",
+           state->nqueries, state->last_version, state->query_max);
+    april_graph_scheduler_destroy(sched);
+
+    for (int i = 0; i < nnodes; i++)
+        zarray_destroy(state->factors[i]);
+    free(state->factors);
+    free(state->sessions);
+    free(producers);
+    april_graph_destroy(state->loaded_graph);
+    free(state);
+    getopt_destroy(gopt);
+    return 0;
+}
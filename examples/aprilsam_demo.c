@@ -40,64 +40,21 @@ struct state
 {
     april_graph_t *graph;
     april_graph_t *loaded_graph;
+    april_graph_mmap_t *loaded_mmap; // non-NULL if loaded_graph is a mapped columnar file
     struct april_graph_cholesky_param *chol_param;
 
     double total_time;
     double step_time;
 
+    april_graph_journal_t *journal; // non-NULL if --journal is given
+    int journal_compact;            // compact the journal every this many steps
+    int journal_nnodes;             // nodes and factors already in the journal
+    int journal_nfactors;
+
     bool batch_update_only;
     int event_idx; //simulate pose by pose; It is the idx of the pose id in true_path;
 };
 
-static int convert_datafile_to_graph(april_graph_t *graph, FILE *f)
-{
-    char str[20];
-    int ID;
-    double init[3];
-    int aidx;
-    int bidx;
-    double T[3];
-    matd_t *W = matd_create(3, 3);
-    while(fscanf(f, "%s", str) != -1) {
-        if(!strcmp(str, "VERTEX2")) {
-            if(!fscanf(f, "%d %lf %lf %lf", &ID, &init[0], &init[1], &init[2]))
-                exit(-1);
-            double _state[3] = { init[0], init[1], init[2] };
-            double truth[3] = { init[0], init[1], init[2] };
-            april_graph_node_t *node = april_graph_node_xyt_create(_state,
-                                                                   init,
-                                                                   truth);
-            zarray_add(graph->nodes, &node);
-        } else if(!strcmp(str, "EDGE2")) {
-            //IDout   IDin   dx   dy   dth   I11   I12  I22  I33  I13  I23
-            if(!fscanf(f, "%d %d %lf %lf %lf %lf %lf %lf %lf %lf %lf ",
-                       &aidx, &bidx, &T[0], &T[1], &T[2],
-                       &(W->data[0]), &(W->data[1]), &(W->data[4]), &(W->data[8]), &(W->data[2]), &(W->data[5])))
-                return -1;
-
-            april_graph_node_t *na, *nb;
-            zarray_get(graph->nodes, aidx, &na);
-            zarray_get(graph->nodes, bidx, &nb);
-            april_graph_factor_t *factor = april_graph_factor_xyt_create(aidx, bidx, T, NULL, W);
-            //HACK: iSAM2 w10000 dataset has different format of Manhatan
-            if(fabs(bidx - aidx) == 1) {
-                april_graph_factor_attr_put(factor, stype_get("string"), "type", strdup("odom"));
-            } else {
-                april_graph_factor_attr_put(factor, stype_get("string"), "type", strdup("scan"));
-            }
-            zarray_add(graph->factors, &factor);
-        } else {
-            printf("error!");
-            fclose(f);
-            return -1;
-        }
-    }
-    matd_destroy(W);
-    printf("%d nodes,  factors: %d \n", zarray_size(graph->nodes), zarray_size(graph->factors));
-    fclose(f);
-    return 0;
-}
-
 static void optimize_cholesky(state_t *state)
 {
     int64_t utime0 = utime_now();
@@ -167,7 +124,11 @@ static int simulate_on_exist_graph(state_t *state)
                 /* printf("Add factor %f,%f,%f\n", */
                 /*        factor->u.common.z[0], factor->u.common.z[1], factor->u.common.z[2]); */
                 /* matd_print(factor->u.common.W, "%f, "); */
-                char *type = april_graph_factor_attr_get(factor, "type");
+                const char *type = april_graph_factor_attr_get(factor, "type");
+                //Imported datasets don't label their factors
+                //HACK: iSAM2 w10000 dataset has different format of Manhatan
+                if(!type)
+                    type = abs(factor->nodes[1] - factor->nodes[0]) == 1 ? "odom" : "scan";
                 if(type) {
                     if(!strcmp(type, "odom")) {
                         //if it is odom factor, update currnode state based on this:
@@ -216,6 +177,36 @@ static int simulate_on_exist_graph(state_t *state)
     return 0;
 }
 
+static void journal_step(state_t *state)
+{
+    april_graph_t *graph = state->graph;
+    for (; state->journal_nnodes < zarray_size(graph->nodes); state->journal_nnodes++) {
+        april_graph_node_t *node;
+        zarray_get(graph->nodes, state->journal_nnodes, &node);
+        april_graph_journal_add_node(state->journal, node);
+    }
+    for (; state->journal_nfactors < zarray_size(graph->factors); state->journal_nfactors++) {
+        april_graph_factor_t *factor;
+        zarray_get(graph->factors, state->journal_nfactors, &factor);
+        april_graph_journal_add_factor(state->journal, factor);
+    }
+
+    // only the nodes that the solver moved.
+    april_graph_changes_iterator_t it;
+    april_graph_changes_iterator_init(&state->chol_param->changes, &it);
+    int idx;
+    while (april_graph_changes_iterator_next(&it, &idx)) {
+        april_graph_node_t *node;
+        zarray_get(graph->nodes, idx, &node);
+        april_graph_journal_update_state(state->journal, node, idx);
+    }
+
+    if(state->journal_compact > 0 && state->event_idx % state->journal_compact == 0)
+        april_graph_journal_compact(state->journal, graph);
+    else
+        april_graph_journal_flush(state->journal, 0);
+}
+
 void simulate_event(state_t *state)
 {
     while(1) {
@@ -226,11 +217,20 @@ void simulate_event(state_t *state)
         } else {
             optimize_cholesky(state);
         }
-        double error = april_graph_chi2(state->graph);
+        if(state->journal)
+            journal_step(state);
+        double error = april_graph_cholesky_chi2(state->chol_param);
         printf("Chi squared error: %f \nStep running time: %.3f ms, Total running time: %.3f ms \n",
                 error,
                 state->step_time, state->total_time);
     }
+
+    // fold in a background batch that is still running.
+    if (april_graph_cholesky_batch_pending(state->chol_param)) {
+        april_graph_cholesky_batch_wait(state->graph, state->chol_param);
+        optimize_chol_inc(state);
+        printf("Chi squared error: %f \n", april_graph_cholesky_chi2(state->chol_param));
+    }
 }
 
 int main(int argc, char *argv[])
@@ -246,31 +246,45 @@ int main(int argc, char *argv[])
     getopt_add_bool(gopt,   'h',  "help", 0, "Show usage");
     getopt_add_bool(gopt,   '\0', "batch_update_only", 0,  "loaded dataset file path");
     getopt_add_string(gopt, '\0', "datapath",    "",    "loaded dataset file path");
+    getopt_add_int(gopt,    '\0', "threads", "0", "threads for parallel work (0: one per processor)");
     getopt_add_string(gopt, '\0', "graphpath",  "../data/M3500.graph",   "loaded graph file path");
     getopt_add_int(gopt,    '\0', "nthreshold",  "100", "Batch update if more than nthreshold nodes with significant change");
     getopt_add_double(gopt, '\0', "delta_xy",    "0.1", "re-linearization xy threshold");
     getopt_add_double(gopt, '\0', "delta_theta", "0.1", "re-linearization theta threshold");
+    getopt_add_bool(gopt,   '\0', "lean", 0, "Don't keep the information matrix in the solver");
+    getopt_add_bool(gopt,   '\0', "background", 0, "Run batch re-factorizations on a background thread");
+    getopt_add_bool(gopt,   '\0', "deterministic", 0, "Make every step reproducible bit for bit");
+    getopt_add_bool(gopt,   '\0', "nested_dissection", 0, "Order batch steps by nested dissection and factor them in parallel");
+    getopt_add_string(gopt, '\0', "journal", "", "log graph changes to this journal file");
+    getopt_add_int(gopt,    '\0', "journal_compact", "0", "compact the journal every n steps (0: never)");
+    getopt_add_double(gopt, '\0', "change_eps", "0", "journal only state changes larger than this");
 
     if (!getopt_parse(gopt, argc, argv, 1) || getopt_get_bool(gopt, "help")) {
         getopt_do_usage(gopt);
         return 1;
     }
 
+    if (getopt_get_int(gopt, "threads") > 0)
+        taskpool_set_default(taskpool_create(getopt_get_int(gopt, "threads")));
+
     state_t *state = calloc(1, sizeof(state_t));
     const char *datapath = getopt_get_string(gopt,"datapath");
     if(!strlen(datapath)) {
-        state->loaded_graph = april_graph_create_from_file(getopt_get_string(gopt,"graphpath"));
+        // columnar files are mapped, archives are decoded from
+        // their compact form; anything else is decoded as usual.
+        const char *graphpath = getopt_get_string(gopt,"graphpath");
+        state->loaded_mmap = april_graph_mmap_open(graphpath);
+        if (state->loaded_mmap)
+            state->loaded_graph = state->loaded_mmap->graph;
+        else if (!(state->loaded_graph = april_graph_load_archive(graphpath)))
+            state->loaded_graph = april_graph_create_from_file(graphpath);
     }
     else {
-        FILE *f = fopen(datapath, "r");
-        if(f==NULL) {
-            exit(-1);
-        }
-
         state->loaded_graph = april_graph_create();
-        if(convert_datafile_to_graph(state->loaded_graph, f)) {
+        if(april_graph_import_toro(state->loaded_graph, datapath, 0)) {
             exit(-1);
         }
+        printf("%d nodes,  factors: %d \n", zarray_size(state->loaded_graph->nodes), zarray_size(state->loaded_graph->factors));
         april_graph_save(state->loaded_graph, "/tmp/loaded.graph");
     }
 
@@ -282,12 +296,30 @@ int main(int argc, char *argv[])
     state->chol_param->delta_xy =  getopt_get_double(gopt, "delta_xy");
     state->chol_param->delta_theta = getopt_get_double(gopt, "delta_theta");
     state->chol_param->nthreshold = getopt_get_int(gopt, "nthreshold");
+    state->chol_param->lean = getopt_get_bool(gopt, "lean");
+    state->chol_param->background = getopt_get_bool(gopt, "background");
+    state->chol_param->deterministic = getopt_get_bool(gopt, "deterministic");
+    state->chol_param->nested_dissection = getopt_get_bool(gopt, "nested_dissection");
+    state->chol_param->changes.eps = getopt_get_double(gopt, "change_eps");
+    state->chol_param->track_chi2 = 1;
     state->batch_update_only = getopt_get_bool(gopt, "batch_update_only");
+    if(strlen(getopt_get_string(gopt, "journal"))) {
+        state->journal = april_graph_journal_open(getopt_get_string(gopt, "journal"));
+        if(!state->journal)
+            exit(-1);
+        state->journal_compact = getopt_get_int(gopt, "journal_compact");
+    }
+
     //simulate
     state->graph = april_graph_create();
     simulate_event(state);
 
+    april_graph_cholesky_memory_t mem;
+    april_graph_cholesky_memory(state->chol_param, &mem);
+    april_graph_cholesky_memory_print(&mem);
+
     //cleanup
+    april_graph_journal_close(state->journal);
     april_graph_cholesky_param_destory(state->chol_param);
     april_graph_destroy(state->graph);
     getopt_destroy(gopt);
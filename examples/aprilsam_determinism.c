@@ -0,0 +1,222 @@
+/* Copyright (C) 2013-2019, The Regents of The University of Michigan.
+All rights reserved.
+
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*$LICENSE*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+
+#include "aprilsam/aprilsam.h"
+#include "aprilsam/common/getopt.h"
+#include "aprilsam/common/string_util.h"
+#include "aprilsam/common/time_util.h"
+
+/**
+   Replay a dataset pose by pose with the solver in deterministic
+   mode, once for every thread count given, and check that every run
+   produces bit for bit the same chi2 after every step and the same
+   final states as the first:
+   ./aprilsam_determinism --datapath ../data/M3500.txt --threads 1,2,4
+ */
+
+typedef struct run run_t;
+struct run
+{
+    int nthreads;
+    double *chi2s;      // after every step
+    int nsteps;
+    uint64_t hash;      // of the final node states
+    double time;        // ms
+};
+
+// FNV-1a over the bits of the states.
+static uint64_t hash_states(april_graph_t *graph)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (int i = 0; i < zarray_size(graph->nodes); i++) {
+        april_graph_node_t *node;
+        zarray_get(graph->nodes, i, &node);
+        const uint8_t *p = (const uint8_t*) node->state;
+        for (size_t j = 0; j < node->length * sizeof(double); j++) {
+            hash ^= p[j];
+            hash *= 0x100000001b3ULL;
+        }
+    }
+    return hash;
+}
+
+static void replay(april_graph_t *loaded, zarray_t **factors, int nnodes, getopt_t *gopt, run_t *run)
+{
+    taskpool_t *tp = taskpool_create(run->nthreads);
+    april_graph_t *graph = april_graph_create();
+    graph->taskpool = tp;
+
+    april_graph_cholesky_param_t *param = calloc(1, sizeof(april_graph_cholesky_param_t));
+    april_graph_cholesky_param_init(param);
+    param->delta_xy = 0.1;
+    param->delta_theta = 0.1;
+    param->nthreshold = getopt_get_int(gopt, "nthreshold");
+    param->background = getopt_get_bool(gopt, "background");
+    param->deterministic = 1;
+    param->nested_dissection = getopt_get_bool(gopt, "nested_dissection");
+
+    run->chi2s = calloc(nnodes, sizeof(double));
+    int64_t utime0 = utime_now();
+
+    for (int i = 0; i < nnodes; i++) {
+        april_graph_node_t *node;
+        zarray_get(loaded->nodes, i, &node);
+        node = april_graph_node_xyt_create(node->init, node->init, node->truth);
+        zarray_add(graph->nodes, &node);
+
+        if (i == 0) {
+            matd_t *W = matd_create_data(3, 3, (double []) { 10000, 0, 0,
+                        0, 10000, 0,
+                        0, 0, 1000 });
+            april_graph_factor_t *factor = april_graph_factor_xytpos_create(0, (double[3]) { 0, 0, 0 }, NULL, W);
+            zarray_add(graph->factors, &factor);
+            matd_destroy(W);
+        }
+
+        // start the node at its predecessor composed with the odometry.
+        for (int j = 0; j < zarray_size(factors[i]); j++) {
+            april_graph_factor_t *factor;
+            zarray_get(factors[i], j, &factor);
+            factor = factor->copy(factor);
+            zarray_add(graph->factors, &factor);
+
+            if (factor->type == APRIL_GRAPH_FACTOR_XYT_TYPE && factor->nodes[1] == i && factor->nodes[0] == i - 1) {
+                april_graph_node_t *prev;
+                zarray_get(graph->nodes, i - 1, &prev);
+                doubles_xyt_mul(prev->state, factor->u.common.z, node->state);
+                node->relinearize(node);
+            }
+        }
+
+        if (i == 0)
+            continue;
+        if (i == 1)
+            april_graph_cholesky(graph, param);
+        else
+            april_graph_cholesky_inc(graph, param);
+        run->chi2s[run->nsteps++] = april_graph_chi2_eval(graph, param->eval_cache, NULL, NULL);
+    }
+    april_graph_cholesky_batch_wait(graph, param);
+
+    run->time = (utime_now() - utime0) / 1.0E3;
+    run->hash = hash_states(graph);
+
+    april_graph_cholesky_param_destory(param);
+    april_graph_destroy(graph);
+    taskpool_destroy(tp);
+}
+
+int main(int argc, char *argv[])
+{
+    APRILSAM_VERSION();
+
+    setlinebuf(stdout);
+    setlinebuf(stderr);
+
+    april_graph_stype_init();
+    stype_register_basic_types();
+    getopt_t *gopt = getopt_create();
+    getopt_add_bool(gopt,   'h',  "help", 0, "Show usage");
+    getopt_add_string(gopt, '\0', "datapath", "", "TORO or g2o dataset file path");
+    getopt_add_string(gopt, '\0', "threads", "1,2,4", "comma-separated thread counts to compare");
+    getopt_add_int(gopt,    '\0', "nodes", "0", "replay only this many poses (0: all)");
+    getopt_add_int(gopt,    '\0', "nthreshold",  "100", "Batch update if more than nthreshold nodes with significant change");
+    getopt_add_bool(gopt,   '\0', "background", 0, "Run batch re-factorizations on a background thread");
+    getopt_add_bool(gopt,   '\0', "nested_dissection", 0, "Order batch steps by nested dissection");
+
+    if (!getopt_parse(gopt, argc, argv, 1) || getopt_get_bool(gopt, "help") ||
+        !strlen(getopt_get_string(gopt, "datapath"))) {
+        getopt_do_usage(gopt);
+        return 1;
+    }
+
+    april_graph_t *loaded = april_graph_create();
+    if (april_graph_import_toro(loaded, getopt_get_string(gopt, "datapath"), 0))
+        return 1;
+
+    int nnodes = zarray_size(loaded->nodes);
+    if (getopt_get_int(gopt, "nodes") > 0 && getopt_get_int(gopt, "nodes") < nnodes)
+        nnodes = getopt_get_int(gopt, "nodes");
+
+    // per node: the loaded factors whose last node it is.
+    zarray_t **factors = calloc(nnodes, sizeof(zarray_t*));
+    for (int i = 0; i < nnodes; i++)
+        factors[i] = zarray_create(sizeof(april_graph_factor_t*));
+    for (int i = 0; i < zarray_size(loaded->factors); i++) {
+        april_graph_factor_t *factor;
+        zarray_get(loaded->factors, i, &factor);
+        int last = 0;
+        for (int j = 0; j < factor->nnodes; j++)
+            last = factor->nodes[j] > last ? factor->nodes[j] : last;
+        if (last < nnodes)
+            zarray_add(factors[last], &factor);
+    }
+
+    zarray_t *counts = str_split(getopt_get_string(gopt, "threads"), ",");
+    int nruns = zarray_size(counts);
+    run_t *runs = calloc(nruns, sizeof(run_t));
+    int failed = 0;
+
+    for (int r = 0; r < nruns; r++) {
+        char *count;
+        zarray_get(counts, r, &count);
+        runs[r].nthreads = atoi(count);
+        replay(loaded, factors, nnodes, gopt, &runs[r]);
+
+        printf("threads %d: %d steps, final chi2 %.17g, states %016" PRIx64 ", %.3f ms",
+               runs[r].nthreads, runs[r].nsteps, runs[r].nsteps ? runs[r].chi2s[runs[r].nsteps - 1] : 0,
+               runs[r].hash, runs[r].time);
+
+        int step = 0;
+        while (step < runs[r].nsteps && !memcmp(&runs[r].chi2s[step], &runs[0].chi2s[step], sizeof(double)))
+            step++;
+        if (step < runs[r].nsteps) {
+            printf(", chi2 differs from the first run from step %d on\n", step + 1);
+            failed = 1;
+        } else if (runs[r].hash != runs[0].hash) {
+            printf(", states differ from the first run\n");
+            failed = 1;
+        } else {
+            printf("%s\n", r > 0 ? ", identical" : "");
+        }
+    }
+
+    printf("%s\n", failed ? "NOT REPRODUCIBLE" : "REPRODUCIBLE");
+
+    for (int r = 0; r < nruns; r++)
+        free(runs[r].chi2s);
+    free(runs);
+    zarray_vmap(counts, free);
+    zarray_destroy(counts);
+    for (int i = 0; i < nnodes; i++)
+        zarray_destroy(factors[i]);
+    free(factors);
+    april_graph_destroy(loaded);
+    getopt_destroy(gopt);
+    return failed;
+}
@@ -0,0 +1,119 @@
+/* Copyright (C) 2013-2019, The Regents of The University of Michigan.
+All rights reserved.
+
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*$LICENSE*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <unistd.h>
+
+#include "aprilsam/aprilsam.h"
+#include "aprilsam/common/getopt.h"
+#include "aprilsam/common/time_util.h"
+
+/**
+   Rebuild a graph from a journal (see aprilsam_demo --journal):
+   ./aprilsam_journal_replay --journal /tmp/demo.journal --solve
+   Resume from a solver checkpoint instead of a batch solve:
+   ./aprilsam_journal_replay --journal /tmp/demo.journal --checkpoint /tmp/demo.chk --solve
+ */
+
+int main(int argc, char *argv[])
+{
+    APRILSAM_VERSION();
+
+    setlinebuf(stdout);
+    setlinebuf(stderr);
+
+    april_graph_stype_init();
+    stype_register_basic_types();
+    getopt_t *gopt = getopt_create();
+    getopt_add_bool(gopt,   'h',  "help", 0, "Show usage");
+    getopt_add_string(gopt, '\0', "journal", "", "journal file path");
+    getopt_add_string(gopt, '\0', "checkpoint", "", "solver checkpoint to resume from");
+    getopt_add_bool(gopt,   '\0', "solve", 0, "optimize the replayed graph");
+    getopt_add_bool(gopt,   '\0', "compact", 0, "replace the journal with a snapshot of the replayed graph");
+    getopt_add_string(gopt, '\0', "save", "", "save the replayed graph to this file");
+    getopt_add_string(gopt, '\0', "archive", "", "save the replayed graph as a compact archive");
+
+    if (!getopt_parse(gopt, argc, argv, 1) || getopt_get_bool(gopt, "help") ||
+        !strlen(getopt_get_string(gopt, "journal"))) {
+        getopt_do_usage(gopt);
+        return 1;
+    }
+
+    const char *path = getopt_get_string(gopt, "journal");
+
+    int64_t utime0 = utime_now();
+    int nrecords;
+    april_graph_t *graph = april_graph_journal_replay(path, &nrecords);
+    if (!graph)
+        return 1;
+    int64_t utime1 = utime_now();
+    printf("replayed %d records: %d nodes, %d factors in %.3f ms\n", nrecords,
+           zarray_size(graph->nodes), zarray_size(graph->factors), (utime1 - utime0) / 1.0E3);
+    printf("Chi squared error: %f\n", april_graph_chi2(graph));
+
+    april_graph_cholesky_param_t *param = calloc(1, sizeof(april_graph_cholesky_param_t));
+    april_graph_cholesky_param_init(param);
+    param->delta_xy = 0.1;
+    param->delta_theta = 0.1;
+    param->nthreshold = 100;
+
+    int resumed = 0;
+    const char *checkpoint = getopt_get_string(gopt, "checkpoint");
+    if (strlen(checkpoint)) {
+        if (april_graph_cholesky_load(param, graph, checkpoint))
+            return 1;
+        resumed = 1;
+        printf("resumed solver at %d nodes, %d factors\n", param->nreordering, param->factor_num);
+    }
+
+    if (getopt_get_bool(gopt, "solve")) {
+        utime0 = utime_now();
+        // factors added after the checkpoint are folded in incrementally.
+        if (resumed)
+            april_graph_cholesky_inc(graph, param);
+        else
+            april_graph_cholesky(graph, param);
+        utime1 = utime_now();
+        printf("Chi squared error: %f, solve time: %.3f ms\n", april_graph_chi2(graph), (utime1 - utime0) / 1.0E3);
+    }
+
+    if (strlen(getopt_get_string(gopt, "save")))
+        april_graph_save(graph, getopt_get_string(gopt, "save"));
+
+    if (strlen(getopt_get_string(gopt, "archive")))
+        april_graph_save_archive(graph, getopt_get_string(gopt, "archive"));
+
+    if (getopt_get_bool(gopt, "compact")) {
+        april_graph_journal_t *journal = april_graph_journal_open(path);
+        if (!journal || april_graph_journal_compact(journal, graph))
+            printf("compaction failed\n");
+        april_graph_journal_close(journal);
+    }
+
+    april_graph_cholesky_param_destory(param);
+    april_graph_destroy(graph);
+    getopt_destroy(gopt);
+    return 0;
+}
@@ -65,7 +65,7 @@ static void optimize_chol_inc(state_t *state)
 void print_state(state_t *state, int step_id)
 {
     printf("\n==================== Step: %d ======================= \n", step_id);
-    double error = april_graph_chi2(state->graph);
+    double error = april_graph_chi2_eval(state->graph, state->chol_param->eval_cache, NULL, NULL);
     printf("Chi squared error: %f \nStep running time: %.3f ms, Total running time: %.3f ms \n",
            error,
            state->step_time, state->total_time);